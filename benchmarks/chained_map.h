@@ -0,0 +1,126 @@
+#pragma once
+
+#include <cstring>
+#include <new>
+
+// The chained hash table HashMap replaced, kept to compare the two. It has a fixed
+// number of buckets and copies every key into its entry.
+template <typename T>
+class ChainedMap
+{
+public:
+  ChainedMap( size_t capacity = 256 )
+  {
+    m_capacity = capacity;
+    m_table    = new Entry *[m_capacity];
+    for( size_t i = 0; i < m_capacity; i++ )
+    {
+      m_table[i] = nullptr;
+    }
+  }
+
+  ~ChainedMap()
+  {
+    clear();
+    delete[] m_table;
+  }
+
+  void set( const char * key, const T & value )
+  {
+    size_t idx   = hash( key );
+    Entry * curr = m_table[idx];
+    while( curr )
+    {
+      if( strcmp( curr->key, key ) == 0 )
+      {
+        curr->value = value;
+        return;
+      }
+      curr = curr->next;
+    }
+    m_table[idx] = Entry::make( key, value, m_table[idx] );
+  }
+
+  template <typename F>
+  void for_each( F fn )
+  {
+    for( size_t i = 0; i < m_capacity; i++ )
+    {
+      for( Entry * curr = m_table[i]; curr != nullptr; curr = curr->next )
+      {
+        fn( curr->key, curr->value );
+      }
+    }
+  }
+
+  bool get( const char * key, T & value )
+  {
+    size_t idx   = hash( key );
+    Entry * curr = m_table[idx];
+    while( curr )
+    {
+      if( strcmp( curr->key, key ) == 0 )
+      {
+        value = curr->value;
+        return true;
+      }
+      curr = curr->next;
+    }
+    return false;
+  }
+
+private:
+  // The key is stored right after the entry
+  struct Entry
+  {
+    char * key;
+    T value;
+    Entry * next;
+    Entry( const char * k, T v, Entry * nxt )
+        : key( reinterpret_cast<char *>( this + 1 ) )
+        , value( v )
+        , next( nxt )
+    {
+      strcpy( key, k );
+    }
+
+    static Entry * make( const char * k, T v, Entry * nxt )
+    {
+      void * memory = ::operator new( sizeof( Entry ) + strlen( k ) + 1 );
+      return new( memory ) Entry( k, v, nxt );
+    }
+
+    static void destroy( Entry * entry )
+    {
+      entry->~Entry();
+      ::operator delete( entry );
+    }
+  };
+
+  size_t m_capacity;
+  Entry ** m_table;
+
+  size_t hash( const char * str ) const
+  {
+    size_t hash = 5381;
+    int c;
+    while( ( c = *str++ ) )
+      hash = ( ( hash << 5 ) + hash ) + c; // hash * 33 + c
+    return hash % m_capacity;
+  }
+
+  void clear()
+  {
+    for( size_t i = 0; i < m_capacity; i++ )
+    {
+      Entry * curr = m_table[i];
+      while( curr )
+      {
+        Entry * tmp = curr;
+        curr        = curr->next;
+        Entry::destroy( tmp );
+      }
+      m_table[i] = nullptr;
+    }
+  }
+};
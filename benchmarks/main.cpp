@@ -0,0 +1,232 @@
+#include "brass.h"
+#include "chained_map.h"
+#include "lexer.h"
+#include "parser.h"
+#include "object.h"
+#include "utils.h"
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Runs every benchmark a few times and reports the fastest run, a benchmark is only
+// run if its name contains the filter given on the command line. Benchmarks that
+// process a number of bytes also report their throughput.
+
+struct Benchmark
+{
+  std::string name;
+  std::function<void()> run;
+  size_t bytes = 0;
+};
+
+static std::string read_program( const std::string & name )
+{
+  std::ifstream file( std::string( BRASS_BENCHMARK_DIR ) + "/" + name );
+  std::ostringstream ss;
+  ss << file.rdbuf();
+  return ss.str();
+}
+
+static Benchmark program( const std::string & name, Engine engine )
+{
+  std::string src = read_program( name );
+  std::string tag = engine == Engine::STACK ? " (stack)" : " (register)";
+  return { name + tag,
+           [src, engine]()
+           {
+             std::ostringstream out, err;
+             if( eval( src.c_str(), out, err, { engine } ) != 0 )
+             {
+               std::cerr << err.str();
+             }
+           } };
+}
+
+// A program that is mostly declarations, to measure the front end against loading
+// its code from a cache
+static std::string startup_program()
+{
+  std::ostringstream src;
+  for( int i = 0; i < 2000; i++ )
+  {
+    src << "fn f" << i << "(a: int, b: int) : int {\n  var c = a * b + " << i << ";\n  return c - a;\n}\n";
+  }
+  src << "print f1999(2, 3);\n";
+  return src.str();
+}
+
+static Benchmark startup( bool cached )
+{
+  std::string src  = startup_program();
+  std::string path = ( std::filesystem::temp_directory_path() / "brass_startup.bsc" ).string();
+  return { cached ? "startup (cached)" : "startup (compiled)",
+           [src, path, cached]()
+           {
+             std::ostringstream out, err;
+             int r = cached ? eval_cached( src, path, out, err ) : eval( src.c_str(), out, err );
+             if( r != 0 )
+             {
+               std::cerr << err.str();
+             }
+           } };
+}
+
+// A few megabytes of indented code with string literals
+static std::string front_end_program()
+{
+  std::ostringstream ss;
+  for( int i = 0; ss.tellp() < ( 4 << 20 ); i++ )
+  {
+    ss << "fn function_" << i << "(argument: int, other_argument: float) : int {\n"
+       << "    var result = argument * 2 + " << i << ";\n"
+       << "    println \"function " << i << " called with\\t\\\"argument\\\"\";\n"
+       << "    return result - 1.5;\n"
+       << "}\n\n";
+  }
+  return ss.str();
+}
+
+static Benchmark lexer()
+{
+  std::string src = front_end_program();
+  return { "lex " + std::to_string( src.size() >> 20 ) + " MB",
+           [src]()
+           {
+             AtomTable atoms;
+             volatile size_t num_tokens = lex( src, atoms ).size();
+             ( void ) num_tokens;
+           },
+           src.size() };
+}
+
+// The nodes are released with the allocator, inside the measured time
+static Benchmark parser()
+{
+  std::string src = front_end_program();
+  return { "parse " + std::to_string( src.size() >> 20 ) + " MB",
+           [src]()
+           {
+             GarbageCollector gc;
+             NodeAllocator allocator;
+             AtomTable atoms;
+             if( !parse( src, atoms, allocator, gc ).ok() )
+             {
+               std::cerr << "parse error\n";
+             }
+           },
+           src.size() };
+}
+
+// Blocks nested depth deep, every block declares a variable and reads the variables
+// of the outermost and the enclosing block
+static Benchmark nested_scopes( int depth )
+{
+  std::ostringstream src;
+  for( int i = 0; i < depth; i++ )
+  {
+    src << "{ var v" << i << " = " << ( i == 0 ? "0" : "v0 + v" + std::to_string( i - 1 ) ) << ";\n";
+  }
+  src << "print v" << depth - 1 << ";\n";
+  for( int i = 0; i < depth; i++ )
+  {
+    src << "}";
+  }
+  return { "nested scopes " + std::to_string( depth ),
+           [src = src.str()]()
+           {
+             std::ostringstream out, err;
+             if( eval( src.c_str(), out, err ) != 0 )
+             {
+               std::cerr << err.str();
+             }
+           } };
+}
+
+// Inserts num_keys keys and looks up a million keys, half of which are missing
+template <typename Map>
+static Benchmark hash_map( const std::string & name, size_t num_keys )
+{
+  std::vector<std::string> keys;
+  for( size_t i = 0; i < 2 * num_keys; i++ )
+  {
+    keys.push_back( "key_" + std::to_string( i ) );
+  }
+
+  return { name + " " + std::to_string( num_keys ),
+           [keys, num_keys]()
+           {
+             Map map;
+             for( size_t i = 0; i < num_keys; i++ )
+             {
+               map.set( keys[i].c_str(), ( int ) i );
+             }
+
+             volatile int found = 0;
+             for( size_t i = 0; i < 1000000; i++ )
+             {
+               int value = 0;
+               found     = found + map.get( keys[i % keys.size()].c_str(), value );
+             }
+           } };
+}
+
+int main( int argc, char * argv[] )
+{
+  const int RUNS     = 5;
+  std::string filter = argc > 1 ? argv[1] : "";
+
+  std::vector<Benchmark> benchmarks;
+  for( const char * name : { "stack_heavy.bs", "field_heavy.bs", "string_concat.bs", "list_heavy.bs" } )
+  {
+    for( Engine engine : { Engine::STACK, Engine::REGISTER } )
+    {
+      benchmarks.push_back( program( name, engine ) );
+    }
+  }
+  benchmarks.push_back( startup( false ) );
+  benchmarks.push_back( startup( true ) );
+  benchmarks.push_back( lexer() );
+  benchmarks.push_back( parser() );
+  for( int depth : { 500, 2000 } )
+  {
+    benchmarks.push_back( nested_scopes( depth ) );
+  }
+  for( size_t num_keys : { 16, 1000, 100000 } )
+  {
+    benchmarks.push_back( hash_map<ChainedMap<int>>( "chained map", num_keys ) );
+    benchmarks.push_back( hash_map<HashMap<const char *, int>>( "swiss map", num_keys ) );
+  }
+
+  std::cout << "sizeof(Object) = " << sizeof( Object ) << "\n";
+  for( const Benchmark & benchmark : benchmarks )
+  {
+    if( benchmark.name.find( filter ) == std::string::npos )
+    {
+      continue;
+    }
+
+    double best = 0;
+    for( int i = 0; i < RUNS; i++ )
+    {
+      auto start = std::chrono::steady_clock::now();
+      benchmark.run();
+      std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+      best = i == 0 ? elapsed.count() : std::min( best, elapsed.count() );
+    }
+    std::cout << std::left << std::setw( 32 ) << benchmark.name << std::right << std::setw( 10 ) << std::fixed
+              << std::setprecision( 2 ) << best << " ms";
+    if( benchmark.bytes )
+    {
+      std::cout << std::setw( 10 ) << benchmark.bytes / ( best * 1000.0 ) << " MB/s";
+    }
+    std::cout << "\n";
+  }
+  return 0;
+}
@@ -1,12 +1,15 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <list>
 #include <memory_resource>
 #include <new>
 #include <utility>
+#include <vector>
 
 // https://nullprogram.com/blog/2023/09/27/
 // https://www.rfleury.com/p/untangling-lifetimes-the-arena-allocator
@@ -45,6 +48,49 @@ public:
     return new( memory ) T( std::forward<Args>( args )... );
   }
 
+  // Like alloc() but for raw memory, returns nullptr instead of throwing when the arena is full.
+  void * try_alloc( std::size_t size, std::size_t alignment )
+  {
+    std::size_t base              = reinterpret_cast<std::size_t>( m_base );
+    std::size_t current           = base + m_offset;
+    std::size_t alignment_padding = ( alignment - ( current % alignment ) ) % alignment;
+    std::size_t new_offset        = m_offset + alignment_padding + size;
+
+    if( m_size < new_offset )
+    {
+      return nullptr;
+    }
+
+    m_offset = new_offset;
+    return reinterpret_cast<void *>( current + alignment_padding );
+  }
+
+  // Release everything at once, no destructors are run. Debug builds overwrite
+  // the released memory, so that dangling pointers into the arena fail early.
+  void reset()
+  {
+#ifndef NDEBUG
+    memset( m_base, 0xdd, m_offset );
+#endif
+    m_offset = 0;
+  }
+
+  bool contains( const void * ptr ) const
+  {
+    const uint8_t * p = static_cast<const uint8_t *>( ptr );
+    return m_base <= p && p < m_base + m_size;
+  }
+
+  std::size_t used() const
+  {
+    return m_offset;
+  }
+
+  std::size_t capacity() const
+  {
+    return m_size;
+  }
+
 private:
   std::size_t m_size;
   std::size_t m_offset;
@@ -74,4 +120,177 @@ private:
 
     return reinterpret_cast<void *>( aligned );
   }
-};
\ No newline at end of file
+};
+// Allocator for objects of many sizes that are freed one by one. Sizes are rounded up
+// to a size class, every page holds the slots of a single class and the free slots of
+// a class are kept in a free list. Pages are aligned to their size, so the page of a
+// pointer is found by masking. Objects larger than MAX_SLOT_SIZE get a page of their own,
+// which is released with the object. Other pages are kept for reuse.
+class SlabAllocator
+{
+public:
+  static constexpr std::size_t PAGE_SIZE     = 16 * 1024;
+  static constexpr std::size_t GRANULARITY   = 16;
+  static constexpr std::size_t MAX_SLOT_SIZE = 1024;
+  static constexpr std::size_t NUM_CLASSES   = MAX_SLOT_SIZE / GRANULARITY;
+  static constexpr std::size_t MAX_SLOTS     = PAGE_SIZE / GRANULARITY;
+
+  struct Page
+  {
+    std::size_t index; // in pages()
+    std::size_t slot_size;
+    std::size_t num_slots;
+    std::size_t num_used;
+    bool swept; // free for the owner, a sweeping collector tracks its progress with it
+    uint64_t used[MAX_SLOTS / 64];
+
+    uint8_t * slot( std::size_t i )
+    {
+      return reinterpret_cast<uint8_t *>( this ) + HEADER_SIZE + i * slot_size;
+    }
+
+    bool is_used( std::size_t i ) const
+    {
+      return used[i / 64] & ( 1ull << ( i % 64 ) );
+    }
+  };
+
+  static constexpr std::size_t HEADER_SIZE = ( sizeof( Page ) + GRANULARITY - 1 ) / GRANULARITY * GRANULARITY;
+
+  SlabAllocator( const SlabAllocator & )             = delete;
+  SlabAllocator & operator=( const SlabAllocator & ) = delete;
+
+  SlabAllocator()
+  {
+    for( std::size_t i = 0; i < NUM_CLASSES; i++ )
+    {
+      m_free[i] = nullptr;
+    }
+  }
+
+  // The objects in the pages are not destroyed
+  ~SlabAllocator()
+  {
+    for( Page * page : m_pages )
+    {
+      std::free( page );
+    }
+  }
+
+  void * alloc( std::size_t size )
+  {
+    if( MAX_SLOT_SIZE < size )
+    {
+      Page * page = new_page( size, 1 );
+      mark_used( page, 0 );
+      return page->slot( 0 );
+    }
+
+    std::size_t size_class = ( size + GRANULARITY - 1 ) / GRANULARITY - 1;
+    if( !m_free[size_class] )
+    {
+      std::size_t slot_size = ( size_class + 1 ) * GRANULARITY;
+      Page * page           = new_page( slot_size, ( PAGE_SIZE - HEADER_SIZE ) / slot_size );
+      for( std::size_t i = page->num_slots; i-- > 0; )
+      {
+        push_free( size_class, page->slot( i ) );
+      }
+    }
+
+    FreeSlot * slot    = m_free[size_class];
+    m_free[size_class] = slot->next;
+
+    Page * page = page_of( slot );
+    mark_used( page, ( reinterpret_cast<uint8_t *>( slot ) - page->slot( 0 ) ) / page->slot_size );
+    return slot;
+  }
+
+  void free( void * ptr )
+  {
+    Page * page   = page_of( ptr );
+    std::size_t i = ( static_cast<uint8_t *>( ptr ) - page->slot( 0 ) ) / page->slot_size;
+    page->used[i / 64] &= ~( 1ull << ( i % 64 ) );
+    page->num_used--;
+
+    if( page->slot_size > MAX_SLOT_SIZE )
+    {
+      m_pages[page->index] = nullptr;
+      std::free( page );
+    }
+    else
+    {
+      push_free( page->slot_size / GRANULARITY - 1, ptr );
+    }
+  }
+
+  static Page * page_of( const void * ptr )
+  {
+    return reinterpret_cast<Page *>( reinterpret_cast<std::size_t>( ptr ) & ~( PAGE_SIZE - 1 ) );
+  }
+
+  // Pages in the order they were created, freed large pages leave a nullptr until compact()
+  std::size_t num_pages() const
+  {
+    return m_pages.size();
+  }
+
+  Page * page( std::size_t i ) const
+  {
+    return m_pages[i];
+  }
+
+  void compact()
+  {
+    std::size_t n = 0;
+    for( Page * page : m_pages )
+    {
+      if( page )
+      {
+        page->index  = n;
+        m_pages[n++] = page;
+      }
+    }
+    m_pages.resize( n );
+  }
+
+private:
+  struct FreeSlot
+  {
+    FreeSlot * next;
+  };
+
+  FreeSlot * m_free[NUM_CLASSES];
+  std::vector<Page *> m_pages;
+
+  Page * new_page( std::size_t slot_size, std::size_t num_slots )
+  {
+    std::size_t bytes = ( HEADER_SIZE + slot_size * num_slots + PAGE_SIZE - 1 ) / PAGE_SIZE * PAGE_SIZE;
+    void * memory     = std::aligned_alloc( PAGE_SIZE, bytes );
+    if( !memory )
+    {
+      throw std::bad_alloc();
+    }
+
+    Page * page     = new( memory ) Page();
+    page->index     = m_pages.size();
+    page->slot_size = slot_size;
+    page->num_slots = num_slots;
+    page->num_used  = 0;
+    page->swept     = true;
+    m_pages.push_back( page );
+    return page;
+  }
+
+  void mark_used( Page * page, std::size_t i )
+  {
+    page->used[i / 64] |= 1ull << ( i % 64 );
+    page->num_used++;
+  }
+
+  void push_free( std::size_t size_class, void * ptr )
+  {
+    FreeSlot * slot    = static_cast<FreeSlot *>( ptr );
+    slot->next         = m_free[size_class];
+    m_free[size_class] = slot;
+  }
+};
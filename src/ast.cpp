@@ -1,4 +1,5 @@
 #include "ast.h"
+#include "optimizer.h"
 #include <algorithm>
 #include <cassert>
 #include <iostream>
@@ -7,6 +8,37 @@ void AstNode::compile( Compiler & )
 {
 }
 
+void AstNode::count_writes( Optimizer & )
+{
+}
+
+Expr * Expr::optimize( Optimizer & )
+{
+  return this;
+}
+
+Stmt * Stmt::optimize( Optimizer & )
+{
+  return this;
+}
+
+// A declaration that is not in a block belongs to the enclosing scope
+static bool is_declaration( Stmt * stmt )
+{
+  return dynamic_cast<VariableDecl *>( stmt ) || dynamic_cast<FnDecl *>( stmt ) || dynamic_cast<ClassDecl *>( stmt );
+}
+
+// An empty list literal takes the type of the variable, field or argument it is
+// stored in
+static void expect_type( Expr * expr, TypeInfo * type )
+{
+  ListLiteral * list = dynamic_cast<ListLiteral *>( expr );
+  if( list && list->elements.empty() && type && type->element_type )
+  {
+    list->type = type;
+  }
+}
+
 Literal::Literal( Object value )
     : value( value )
 {
@@ -19,12 +51,16 @@ void Literal::compile( Compiler & compiler )
 
 TypeInfo * Literal::infer_types( TypeContext & ctx )
 {
-  switch( value.type )
+  switch( value.type() )
   {
     case Object ::Type ::INTEGER :
       {
         return ctx.lookup_type( "int" );
       }
+    case Object ::Type ::REAL :
+      {
+        return ctx.lookup_type( "float" );
+      }
     case Object ::Type ::STRING :
       {
         return ctx.lookup_type( "string" );
@@ -35,10 +71,15 @@ TypeInfo * Literal::infer_types( TypeContext & ctx )
   }
 }
 
+Program::Program( std::pmr::memory_resource * resource )
+    : stmts( resource )
+{
+}
+
 void Program::compile( Compiler & compiler )
 {
   // declare builtin functions
-  ( void ) compiler.define_var( "typeof" );
+  ( void ) compiler.define_var( compiler.atoms.intern( "typeof" ) );
 
   for( Stmt * stmt : stmts )
   {
@@ -68,8 +109,25 @@ bool Program::check_types( TypeContext & ctx )
   return true;
 }
 
-Binary::Binary( const std::string & op, Expr * lhs, Expr * rhs )
-    : op( op )
+void Program::count_writes( Optimizer & optimizer )
+{
+  for( Stmt * stmt : stmts )
+  {
+    stmt->count_writes( optimizer );
+  }
+}
+
+Stmt * Program::optimize( Optimizer & optimizer )
+{
+  for( Stmt *& stmt : stmts )
+  {
+    stmt = stmt->optimize( optimizer );
+  }
+  return this;
+}
+
+Binary::Binary( AstString op, Expr * lhs, Expr * rhs )
+    : op( std::move( op ) )
     , lhs( lhs )
     , rhs( rhs )
 {
@@ -80,23 +138,29 @@ void Binary::compile( Compiler & compiler )
   rhs->compile( compiler );
   lhs->compile( compiler );
 
+  // the type checker only lets through the combinations below
+  assert( type );
   OpCode instr = OP_NOP;
 
-  if( op == "+" )
+  if( type->name == "string" )
+  {
+    instr = OP_CONCAT_STR;
+  }
+  else if( op == "+" )
   {
-    instr = OP_ADD;
+    instr = type->name == "float" ? OP_ADD_FLOAT : OP_ADD_INT;
   }
   else if( op == "-" )
   {
-    instr = OP_SUB;
+    instr = type->name == "float" ? OP_SUB_FLOAT : OP_SUB_INT;
   }
   else if( op == "*" )
   {
-    instr = OP_MULT;
+    instr = type->name == "float" ? OP_MULT_FLOAT : OP_MULT_INT;
   }
   else if( op == "/" )
   {
-    instr = OP_DIV;
+    instr = type->name == "float" ? OP_DIV_FLOAT : OP_DIV_INT;
   }
   else
   {
@@ -106,19 +170,113 @@ void Binary::compile( Compiler & compiler )
   compiler.code->emit_instr( instr );
 }
 
+// Arithmetic needs two operands of the same type, the compiler picks the instruction
+// for that type, so nothing is checked at runtime
 TypeInfo * Binary::infer_types( TypeContext & ctx )
 {
   TypeInfo * l = lhs->infer_types( ctx );
   TypeInfo * r = rhs->infer_types( ctx );
-  if( l == r )
+  if( !l || !r )
   {
-    return r;
+    return nullptr;
   }
-  else
+
+  if( l != r )
   {
     ctx.throw_type_error( "Type mismatch in binary operation" );
     return nullptr;
   }
+
+  bool numeric = l->name == "int" || l->name == "float";
+  if( !numeric && !( l->name == "string" && op == "+" ) )
+  {
+    ctx.throw_type_error( "Operator '" + std::string( op ) + "' is not defined for type '" + l->name + "'" );
+    return nullptr;
+  }
+
+  type = l;
+  return l;
+}
+
+void Binary::count_writes( Optimizer & optimizer )
+{
+  lhs->count_writes( optimizer );
+  rhs->count_writes( optimizer );
+}
+
+// Integer arithmetic wraps around like it does in the VM. Division by zero is left
+// to the VM, which reports it.
+static bool fold_integer( std::string_view op, int lhs, int rhs, int & result )
+{
+  uint32_t x = ( uint32_t ) lhs;
+  uint32_t y = ( uint32_t ) rhs;
+
+  if( op == "+" )
+  {
+    result = ( int ) ( x + y );
+  }
+  else if( op == "-" )
+  {
+    result = ( int ) ( x - y );
+  }
+  else if( op == "*" )
+  {
+    result = ( int ) ( x * y );
+  }
+  else if( op == "/" && rhs != 0 && !( rhs == -1 && lhs == INT32_MIN ) )
+  {
+    result = lhs / rhs;
+  }
+  else
+  {
+    return false;
+  }
+  return true;
+}
+
+static double fold_real( std::string_view op, double lhs, double rhs )
+{
+  if( op == "+" )
+  {
+    return lhs + rhs;
+  }
+  else if( op == "-" )
+  {
+    return lhs - rhs;
+  }
+  else if( op == "*" )
+  {
+    return lhs * rhs;
+  }
+  else
+  {
+    return lhs / rhs;
+  }
+}
+
+Expr * Binary::optimize( Optimizer & optimizer )
+{
+  lhs = lhs->optimize( optimizer );
+  rhs = rhs->optimize( optimizer );
+
+  Literal * a = dynamic_cast<Literal *>( lhs );
+  Literal * b = dynamic_cast<Literal *>( rhs );
+  if( !a || !b )
+  {
+    return this;
+  }
+
+  int result = 0;
+  if( a->value.is_integer() && b->value.is_integer() &&
+      fold_integer( op, a->value.as_integer(), b->value.as_integer(), result ) )
+  {
+    return optimizer.allocator.alloc<Literal>( Object::Integer( result ) );
+  }
+  if( a->value.is_real() && b->value.is_real() )
+  {
+    return optimizer.allocator.alloc<Literal>( Object::Real( fold_real( op, a->value.as_real(), b->value.as_real() ) ) );
+  }
+  return this;
 }
 
 Print::Print( Expr * expr, bool newline )
@@ -139,6 +297,17 @@ bool Print::check_types( TypeContext & ctx )
   return ti != nullptr;
 }
 
+void Print::count_writes( Optimizer & optimizer )
+{
+  expr->count_writes( optimizer );
+}
+
+Stmt * Print::optimize( Optimizer & optimizer )
+{
+  expr = expr->optimize( optimizer );
+  return this;
+}
+
 IfStmt::IfStmt( Expr * cond, Stmt * then_stmt, Stmt * else_stmt )
     : cond( cond )
     , then_stmt( then_stmt )
@@ -172,7 +341,45 @@ void IfStmt::compile( Compiler & compiler )
 
 bool IfStmt::check_types( TypeContext & ctx )
 {
-  return false;
+  if( !cond->infer_types( ctx ) || !then_stmt->check_types( ctx ) )
+  {
+    return false;
+  }
+  return !else_stmt || else_stmt->check_types( ctx );
+}
+
+void IfStmt::count_writes( Optimizer & optimizer )
+{
+  cond->count_writes( optimizer );
+  then_stmt->count_writes( optimizer );
+  if( else_stmt )
+  {
+    else_stmt->count_writes( optimizer );
+  }
+}
+
+Stmt * IfStmt::optimize( Optimizer & optimizer )
+{
+  cond      = cond->optimize( optimizer );
+  then_stmt = then_stmt->optimize( optimizer );
+  if( else_stmt )
+  {
+    else_stmt = else_stmt->optimize( optimizer );
+  }
+
+  Literal * literal = dynamic_cast<Literal *>( cond );
+  if( !literal )
+  {
+    return this;
+  }
+
+  Stmt * taken   = literal->value.is_truthy() ? then_stmt : else_stmt;
+  Stmt * dropped = literal->value.is_truthy() ? else_stmt : then_stmt;
+  if( dropped && is_declaration( dropped ) )
+  {
+    return this;
+  }
+  return taken ? taken : optimizer.allocator.alloc<Block>( &optimizer.allocator );
 }
 
 WhileStmt::WhileStmt( Expr * cond, Stmt * body )
@@ -193,14 +400,32 @@ void WhileStmt::compile( Compiler & compiler )
 
 bool WhileStmt::check_types( TypeContext & ctx )
 {
-  return false;
+  return cond->infer_types( ctx ) && body->check_types( ctx );
 }
 
-FnDecl::FnDecl(
-    const std::string & name, const std::vector<FnArgDecl> & args, const std::string & return_type, Stmt * body )
+void WhileStmt::count_writes( Optimizer & optimizer )
+{
+  cond->count_writes( optimizer );
+  body->count_writes( optimizer );
+}
+
+Stmt * WhileStmt::optimize( Optimizer & optimizer )
+{
+  cond = cond->optimize( optimizer );
+  body = body->optimize( optimizer );
+
+  Literal * literal = dynamic_cast<Literal *>( cond );
+  if( literal && literal->value.is_falsy() && !is_declaration( body ) )
+  {
+    return optimizer.allocator.alloc<Block>( &optimizer.allocator );
+  }
+  return this;
+}
+
+FnDecl::FnDecl( Atom name, std::pmr::vector<FnArgDecl> args, AstString return_type, Stmt * body )
     : name( name )
-    , args( args )
-    , return_type( return_type )
+    , args( std::move( args ) )
+    , return_type( std::move( return_type ) )
     , body( body )
 {
 }
@@ -210,7 +435,7 @@ void FnDecl::compile( Compiler & compiler )
 
   CodeObject * global = compiler.code;
 
-  FunctionObject * fn = compiler.gc.alloc<FunctionObject>( name.c_str(), ( uint8_t ) args.size(), global );
+  FunctionObject * fn = compiler.gc.alloc<FunctionObject>( compiler.atoms.name( name ).c_str(), ( uint8_t ) args.size(), global );
 
   uint16_t index = compiler.define_var( name );
   compiler.code->emit_literal( Object::Function( fn ) );
@@ -259,7 +484,32 @@ bool FnDecl::declare_global( TypeContext & ctx )
 
 bool FnDecl::check_types( TypeContext & ctx )
 {
-  return true;
+  ctx.push_scope();
+  for( const auto & arg : args )
+  {
+    ctx.define_var( arg.name, ctx.lookup_type( arg.type ) );
+  }
+  bool ok = body->check_types( ctx );
+  ctx.pop_scope();
+  return ok;
+}
+
+void FnDecl::count_writes( Optimizer & optimizer )
+{
+  optimizer.count_write( name );
+  for( const auto & arg : args )
+  {
+    optimizer.count_write( arg.name );
+  }
+  body->count_writes( optimizer );
+}
+
+Stmt * FnDecl::optimize( Optimizer & optimizer )
+{
+  optimizer.push_scope();
+  body = body->optimize( optimizer );
+  optimizer.pop_scope();
+  return this;
 }
 
 Return::Return( Expr * expr )
@@ -280,7 +530,18 @@ bool Return::check_types( TypeContext & ctx )
   return ti != nullptr;
 }
 
-Variable::Variable( const std::string & name )
+void Return::count_writes( Optimizer & optimizer )
+{
+  expr->count_writes( optimizer );
+}
+
+Stmt * Return::optimize( Optimizer & optimizer )
+{
+  expr = expr->optimize( optimizer );
+  return this;
+}
+
+Variable::Variable( Atom name )
     : name( name )
 {
 }
@@ -290,7 +551,7 @@ void Variable::compile( Compiler & compiler )
   auto [index, is_global] = compiler.find_var( name );
   if( index == UNDEFINED )
   {
-    std::cerr << "Undefined varaible " << name << std::endl;
+    std::cerr << "Undefined varaible " << compiler.atoms.name( name ) << std::endl;
   }
   compiler.code->emit_instr( is_global ? OP_LOAD_GLOBAL : OP_LOAD_LOCAL, index );
 }
@@ -301,9 +562,19 @@ TypeInfo * Variable::infer_types( TypeContext & ctx )
   return ti;
 }
 
-Call::Call( Expr * callee, const std::vector<Expr *> & args )
+Expr * Variable::optimize( Optimizer & optimizer )
+{
+  Literal * value = optimizer.find_constant( name );
+  if( !value )
+  {
+    return this;
+  }
+  return optimizer.allocator.alloc<Literal>( value->value );
+}
+
+Call::Call( Expr * callee, ExprList args )
     : callee( callee )
-    , args( args )
+    , args( std::move( args ) )
 {
 }
 
@@ -334,6 +605,7 @@ TypeInfo * Call::infer_types( TypeContext & ctx )
 
   for( size_t i = 0; i < args.size(); i++ )
   {
+    expect_type( args[i], fn_type->arg_types[i] );
     TypeInfo * arg_type = args[i]->infer_types( ctx );
     if( arg_type != fn_type->arg_types[i] )
     {
@@ -346,6 +618,30 @@ TypeInfo * Call::infer_types( TypeContext & ctx )
   return fn_type->return_type;
 }
 
+void Call::count_writes( Optimizer & optimizer )
+{
+  callee->count_writes( optimizer );
+  for( Expr * expr : args )
+  {
+    expr->count_writes( optimizer );
+  }
+}
+
+Expr * Call::optimize( Optimizer & optimizer )
+{
+  callee = callee->optimize( optimizer );
+  for( Expr *& expr : args )
+  {
+    expr = expr->optimize( optimizer );
+  }
+  return this;
+}
+
+Block::Block( std::pmr::memory_resource * resource )
+    : stmts( resource )
+{
+}
+
 void Block::compile( Compiler & compiler )
 {
   compiler.push_scope();
@@ -358,12 +654,42 @@ void Block::compile( Compiler & compiler )
 
 bool Block::check_types( TypeContext & ctx )
 {
-  return false;
+  ctx.push_scope();
+  bool ok = true;
+  for( Stmt * stmt : stmts )
+  {
+    if( !stmt->check_types( ctx ) )
+    {
+      ok = false;
+      break;
+    }
+  }
+  ctx.pop_scope();
+  return ok;
+}
+
+void Block::count_writes( Optimizer & optimizer )
+{
+  for( Stmt * stmt : stmts )
+  {
+    stmt->count_writes( optimizer );
+  }
 }
 
-VariableDecl::VariableDecl( const std::string & var_name, const std::string & type_name, Expr * expr )
+Stmt * Block::optimize( Optimizer & optimizer )
+{
+  optimizer.push_scope();
+  for( Stmt *& stmt : stmts )
+  {
+    stmt = stmt->optimize( optimizer );
+  }
+  optimizer.pop_scope();
+  return this;
+}
+
+VariableDecl::VariableDecl( Atom var_name, AstString type_name, Expr * expr )
     : var_name( var_name )
-    , type_name( type_name )
+    , type_name( std::move( type_name ) )
     , expr( expr )
 {
 }
@@ -372,22 +698,13 @@ void VariableDecl::compile( Compiler & compiler )
 {
   expr->compile( compiler );
   uint16_t index = compiler.define_var( var_name );
-  bool global    = compiler.scopes.size() == 1;
+  bool global    = compiler.scopes.depth() == 1;
   compiler.code->emit_instr( global ? OP_STORE_GLOBAL : OP_STORE_LOCAL, index );
 }
 
 bool VariableDecl::check_types( TypeContext & ctx )
 {
   // TODO: check if the variable was declard before this should throw an error
-  TypeInfo * a = ctx.lookup_var( var_name ); // TODO: should also return whether it is global
-  if( a->declard )
-  {
-    ctx.throw_type_error( "was already declared" );
-  }
-  else
-  {
-    a->declard = true;
-  }
 
   TypeInfo * decl_type = nullptr;
   if( !type_name.empty() )
@@ -395,6 +712,7 @@ bool VariableDecl::check_types( TypeContext & ctx )
     decl_type = ctx.lookup_type( type_name );
   }
 
+  expect_type( expr, decl_type );
   TypeInfo * infered_type = expr->infer_types( ctx );
 
   if( decl_type && decl_type != infered_type )
@@ -411,8 +729,6 @@ bool VariableDecl::check_types( TypeContext & ctx )
 
 bool VariableDecl::declare_global( TypeContext & ctx )
 {
-  TypeInfo * expr_type = expr->infer_types( ctx );
-
   TypeInfo * decl_type = nullptr;
 
   if( !type_name.empty() )
@@ -420,6 +736,9 @@ bool VariableDecl::declare_global( TypeContext & ctx )
     decl_type = ctx.lookup_type( type_name );
   }
 
+  expect_type( expr, decl_type );
+  TypeInfo * expr_type = expr->infer_types( ctx );
+
   if( decl_type && expr_type != decl_type )
   {
     ctx.throw_type_error( "Declared type does not match infered type" );
@@ -433,7 +752,26 @@ bool VariableDecl::declare_global( TypeContext & ctx )
   return true;
 }
 
-Assignment::Assignment( const std::string & name, Expr * expr )
+void VariableDecl::count_writes( Optimizer & optimizer )
+{
+  optimizer.count_write( var_name );
+  expr->count_writes( optimizer );
+}
+
+// Globals are left alone, the REPL can assign them later
+Stmt * VariableDecl::optimize( Optimizer & optimizer )
+{
+  expr = expr->optimize( optimizer );
+
+  Literal * literal = dynamic_cast<Literal *>( expr );
+  if( literal && optimizer.scopes.depth() > 1 && optimizer.num_writes( var_name ) == 1 )
+  {
+    optimizer.define_constant( var_name, literal );
+  }
+  return this;
+}
+
+Assignment::Assignment( Atom name, Expr * expr )
     : name( name )
     , expr( expr )
 {
@@ -456,6 +794,7 @@ TypeInfo * Assignment::infer_types( TypeContext & ctx )
     return nullptr;
   }
 
+  expect_type( expr, var_type );
   TypeInfo * expr_type = expr->infer_types( ctx );
 
   if( var_type != expr_type )
@@ -467,20 +806,33 @@ TypeInfo * Assignment::infer_types( TypeContext & ctx )
   return expr_type;
 }
 
-ClassDecl::ClassDecl( const std::string & name )
-    : name( name )
+void Assignment::count_writes( Optimizer & optimizer )
 {
+  optimizer.count_write( name );
+  expr->count_writes( optimizer );
 }
 
-ClassDecl::ClassDecl( const std::string & name, const std::vector<ClassFieldDecl> & fields )
+Expr * Assignment::optimize( Optimizer & optimizer )
+{
+  expr = expr->optimize( optimizer );
+  return this;
+}
+
+ClassDecl::ClassDecl( Atom name, std::pmr::vector<ClassFieldDecl> fields )
     : name( name )
-    , fields( fields )
+    , fields( std::move( fields ) )
 {
 }
 
 void ClassDecl::compile( Compiler & compiler )
 {
-  ClassObject * cls = compiler.gc.alloc<ClassObject>( name.c_str() );
+  std::vector<std::string> field_names;
+  for( const auto & field : fields )
+  {
+    field_names.push_back( compiler.atoms.name( field.name ) );
+  }
+
+  ClassObject * cls = compiler.gc.alloc<ClassObject>( compiler.atoms.name( name ).c_str(), field_names );
   uint16_t index    = compiler.define_var( name );
   compiler.code->emit_literal( Object::Class( cls ) );
   compiler.code->emit_instr( OP_STORE_GLOBAL, index );
@@ -488,15 +840,17 @@ void ClassDecl::compile( Compiler & compiler )
 
 bool ClassDecl::declare_global( TypeContext & ctx )
 {
-  TypeInfo * type_info = ctx.define_type( name );
+  TypeInfo * type_info = ctx.define_type( ctx.atoms.name( name ) );
   ctx.define_var( name, type_info );
 
-  for( const auto & field : fields )
+  for( size_t i = 0; i < fields.size(); i++ )
   {
-    type_info->field_types[field.name] = ctx.lookup_type( field.type );
+    const auto & field                 = fields[i];
+    type_info->field_types.emplace( field.name, ctx.lookup_type( field.type ) );
+    type_info->field_slots.emplace( field.name, ( uint16_t ) i );
   }
 
-  std::string ctor_type_name = "() -> " + name;
+  std::string ctor_type_name = "() -> " + ctx.atoms.name( name );
 
   TypeInfo * ctor_type   = ctx.define_type( ctor_type_name );
   ctor_type->arg_types   = {};
@@ -511,7 +865,12 @@ bool ClassDecl::check_types( TypeContext & ctx )
   return true;
 }
 
-Get::Get( Expr * object, const std::string & name )
+void ClassDecl::count_writes( Optimizer & optimizer )
+{
+  optimizer.count_write( name );
+}
+
+Get::Get( Expr * object, Atom name )
     : object( object )
     , property( name )
 {
@@ -520,16 +879,29 @@ Get::Get( Expr * object, const std::string & name )
 void Get::compile( Compiler & compiler )
 {
   object->compile( compiler );
-  uint16_t index = compiler.define_global_var( property );
-  compiler.code->emit_instr( OP_GET_PROPERTY, index );
+  if( slot != UNDEFINED )
+  {
+    compiler.code->emit_instr( OP_GET_FIELD, slot );
+  }
+  else
+  {
+    uint16_t index = compiler.define_global_var( property );
+    compiler.code->emit_instr( OP_GET_PROPERTY, index );
+  }
 }
 
 TypeInfo * Get::infer_types( TypeContext & ctx )
 {
   TypeInfo * a = object->infer_types( ctx );
-  auto it      = a->field_types.find( property );
+  if( !a )
+  {
+    return nullptr;
+  }
+
+  auto it = a->field_types.find( property );
   if( it != a->field_types.end() )
   {
+    slot = a->field_slots.find( it->first )->second;
     return it->second;
   }
   else
@@ -538,7 +910,18 @@ TypeInfo * Get::infer_types( TypeContext & ctx )
   }
 }
 
-Set::Set( Expr * object, const std::string & name, Expr * value )
+void Get::count_writes( Optimizer & optimizer )
+{
+  object->count_writes( optimizer );
+}
+
+Expr * Get::optimize( Optimizer & optimizer )
+{
+  object = object->optimize( optimizer );
+  return this;
+}
+
+Set::Set( Expr * object, Atom name, Expr * value )
     : object( object )
     , property( name )
     , value( value )
@@ -549,24 +932,38 @@ void Set::compile( Compiler & compiler )
 {
   value->compile( compiler );
   object->compile( compiler );
-  uint16_t index = compiler.define_global_var( property );
-  compiler.code->emit_instr( OP_SET_PROPERTY, index );
+  if( slot != UNDEFINED )
+  {
+    compiler.code->emit_instr( OP_SET_FIELD, slot );
+  }
+  else
+  {
+    uint16_t index = compiler.define_global_var( property );
+    compiler.code->emit_instr( OP_SET_PROPERTY, index );
+  }
 }
 
 TypeInfo * Set::infer_types( TypeContext & ctx )
 {
 
   TypeInfo * a = object->infer_types( ctx );
-  TypeInfo * b = value->infer_types( ctx );
+
+  if( !a )
+  {
+    ctx.throw_type_error( "Tried to set field '" + ctx.atoms.name( property ) + "' of untyped value" );
+    return nullptr;
+  }
 
   auto it = a->field_types.find( property );
   if( it == a->field_types.end() )
   {
-    ctx.throw_type_error( "Tried to access not existant field '" + property + "'" );
+    ctx.throw_type_error( "Tried to access not existant field '" + ctx.atoms.name( property ) + "'" );
     return nullptr;
   }
 
   TypeInfo * c = it->second;
+  expect_type( value, c );
+  TypeInfo * b = value->infer_types( ctx );
 
   if( c != b )
   {
@@ -574,9 +971,24 @@ TypeInfo * Set::infer_types( TypeContext & ctx )
     return nullptr;
   }
 
+  slot = a->field_slots.find( it->first )->second;
+
   return b;
 }
 
+void Set::count_writes( Optimizer & optimizer )
+{
+  object->count_writes( optimizer );
+  value->count_writes( optimizer );
+}
+
+Expr * Set::optimize( Optimizer & optimizer )
+{
+  object = object->optimize( optimizer );
+  value  = value->optimize( optimizer );
+  return this;
+}
+
 ExprStmt::ExprStmt( Expr * expr )
     : expr( expr )
 {
@@ -584,7 +996,13 @@ ExprStmt::ExprStmt( Expr * expr )
 
 void ExprStmt::compile( Compiler & compiler )
 {
+  // calls leave their result on the stack, assignments do not
+  int depth = compiler.code->stack_depth;
   expr->compile( compiler );
+  while( depth < compiler.code->stack_depth )
+  {
+    compiler.code->emit_instr( OP_POP );
+  }
 }
 
 bool ExprStmt::check_types( TypeContext & ctx )
@@ -593,10 +1011,233 @@ bool ExprStmt::check_types( TypeContext & ctx )
   return true;
 }
 
-TypeContext::TypeContext()
+void ExprStmt::count_writes( Optimizer & optimizer )
+{
+  expr->count_writes( optimizer );
+}
+
+Stmt * ExprStmt::optimize( Optimizer & optimizer )
+{
+  expr = expr->optimize( optimizer );
+  return this;
+}
+
+ListLiteral::ListLiteral( ExprList elements )
+    : elements( std::move( elements ) )
+{
+}
+
+void ListLiteral::compile( Compiler & compiler )
+{
+  for( Expr * element : elements )
+  {
+    element->compile( compiler );
+  }
+  compiler.code->emit_instr( OP_BUILD_LIST, ( uint16_t ) elements.size() );
+}
+
+TypeInfo * ListLiteral::infer_types( TypeContext & ctx )
+{
+  if( elements.empty() )
+  {
+    if( !type )
+    {
+      ctx.throw_type_error( "Can not infer the type of an empty list" );
+    }
+    return type;
+  }
+
+  TypeInfo * element_type = elements[0]->infer_types( ctx );
+  if( !element_type )
+  {
+    return nullptr;
+  }
+
+  for( size_t i = 1; i < elements.size(); i++ )
+  {
+    if( elements[i]->infer_types( ctx ) != element_type )
+    {
+      ctx.throw_type_error( "Type mismatch in list literal" );
+      return nullptr;
+    }
+  }
+
+  type = ctx.list_type( element_type );
+  return type;
+}
+
+void ListLiteral::count_writes( Optimizer & optimizer )
 {
-  m_scopes.push_back({});
+  for( Expr * element : elements )
+  {
+    element->count_writes( optimizer );
+  }
+}
 
+Expr * ListLiteral::optimize( Optimizer & optimizer )
+{
+  for( Expr *& element : elements )
+  {
+    element = element->optimize( optimizer );
+  }
+  return this;
+}
+
+// Returns the element type of the indexed list
+static TypeInfo * check_index( TypeContext & ctx, Expr * list, Expr * index )
+{
+  TypeInfo * list_type  = list->infer_types( ctx );
+  TypeInfo * index_type = index->infer_types( ctx );
+  if( !list_type || !index_type )
+  {
+    return nullptr;
+  }
+
+  if( !list_type->element_type )
+  {
+    ctx.throw_type_error( "Can not index a value of type '" + list_type->name + "'" );
+    return nullptr;
+  }
+
+  if( index_type->name != "int" )
+  {
+    ctx.throw_type_error( "Invalid index of type '" + index_type->name + "', expected 'int'" );
+    return nullptr;
+  }
+
+  return list_type->element_type;
+}
+
+GetIndex::GetIndex( Expr * list, Expr * index )
+    : list( list )
+    , index( index )
+{
+}
+
+void GetIndex::compile( Compiler & compiler )
+{
+  list->compile( compiler );
+  index->compile( compiler );
+  compiler.code->emit_instr( OP_INDEX_GET );
+}
+
+TypeInfo * GetIndex::infer_types( TypeContext & ctx )
+{
+  return check_index( ctx, list, index );
+}
+
+void GetIndex::count_writes( Optimizer & optimizer )
+{
+  list->count_writes( optimizer );
+  index->count_writes( optimizer );
+}
+
+Expr * GetIndex::optimize( Optimizer & optimizer )
+{
+  list  = list->optimize( optimizer );
+  index = index->optimize( optimizer );
+  return this;
+}
+
+SetIndex::SetIndex( Expr * list, Expr * index, Expr * value )
+    : list( list )
+    , index( index )
+    , value( value )
+{
+}
+
+void SetIndex::compile( Compiler & compiler )
+{
+  value->compile( compiler );
+  list->compile( compiler );
+  index->compile( compiler );
+  compiler.code->emit_instr( OP_INDEX_SET );
+}
+
+TypeInfo * SetIndex::infer_types( TypeContext & ctx )
+{
+  TypeInfo * element_type = check_index( ctx, list, index );
+  if( !element_type )
+  {
+    return nullptr;
+  }
+
+  expect_type( value, element_type );
+  if( value->infer_types( ctx ) != element_type )
+  {
+    ctx.throw_type_error( "Type mismatch in list element assignment" );
+    return nullptr;
+  }
+  return element_type;
+}
+
+void SetIndex::count_writes( Optimizer & optimizer )
+{
+  list->count_writes( optimizer );
+  index->count_writes( optimizer );
+  value->count_writes( optimizer );
+}
+
+Expr * SetIndex::optimize( Optimizer & optimizer )
+{
+  list  = list->optimize( optimizer );
+  index = index->optimize( optimizer );
+  value = value->optimize( optimizer );
+  return this;
+}
+
+Append::Append( Expr * list, Expr * value )
+    : list( list )
+    , value( value )
+{
+}
+
+void Append::compile( Compiler & compiler )
+{
+  value->compile( compiler );
+  list->compile( compiler );
+  compiler.code->emit_instr( OP_APPEND );
+}
+
+TypeInfo * Append::infer_types( TypeContext & ctx )
+{
+  TypeInfo * list_type = list->infer_types( ctx );
+  if( !list_type )
+  {
+    return nullptr;
+  }
+
+  if( !list_type->element_type )
+  {
+    ctx.throw_type_error( "Can not append to a value of type '" + list_type->name + "'" );
+    return nullptr;
+  }
+
+  expect_type( value, list_type->element_type );
+  if( value->infer_types( ctx ) != list_type->element_type )
+  {
+    ctx.throw_type_error( "Type mismatch in append" );
+    return nullptr;
+  }
+  return list_type;
+}
+
+void Append::count_writes( Optimizer & optimizer )
+{
+  list->count_writes( optimizer );
+  value->count_writes( optimizer );
+}
+
+Expr * Append::optimize( Optimizer & optimizer )
+{
+  list  = list->optimize( optimizer );
+  value = value->optimize( optimizer );
+  return this;
+}
+
+TypeContext::TypeContext( AtomTable & atoms )
+    : atoms( atoms )
+{
   // builtin types
   ( void ) define_type( "int" );
   ( void ) define_type( "bool" );
@@ -618,34 +1259,26 @@ TypeContext::~TypeContext()
 
 void TypeContext::push_scope()
 {
-  m_scopes.push_back( {} );
+  m_scopes.push_scope();
 }
 
 void TypeContext::pop_scope()
 {
-  m_scopes.pop_back();
+  m_scopes.pop_scope();
 }
 
-void TypeContext::define_var( const std::string & name, TypeInfo * type_info )
+void TypeContext::define_var( Atom name, TypeInfo * type_info )
 {
-  auto & scope = m_scopes.back();
-  scope[name]  = type_info;
+  m_scopes.define( name, type_info );
 }
 
-TypeInfo * TypeContext::lookup_var( const std::string & name )
+TypeInfo * TypeContext::lookup_var( Atom name )
 {
-  for( auto scope_it = m_scopes.rbegin(); scope_it != m_scopes.rend(); scope_it++ )
-  {
-    auto it = scope_it->find( name );
-    if( it != scope_it->end() )
-    {
-      return it->second;
-    }
-  }
-  return nullptr;
+  auto * symbol = m_scopes.find( name );
+  return symbol ? symbol->value : nullptr;
 }
 
-TypeInfo * TypeContext::define_type( const std::string & name )
+TypeInfo * TypeContext::define_type( std::string_view name )
 {
   auto it = m_types.find( name );
   if( it != m_types.end() )
@@ -654,25 +1287,38 @@ TypeInfo * TypeContext::define_type( const std::string & name )
   }
   else
   {
-    TypeInfo * ti = new TypeInfo( name );
-    m_types[name] = ti;
+    TypeInfo * ti = new TypeInfo( std::string( name ) );
+    m_types.emplace( name, ti );
     return ti;
   }
 }
 
-TypeInfo * TypeContext::lookup_type( const std::string & name )
+TypeInfo * TypeContext::lookup_type( std::string_view name )
 {
   auto it = m_types.find( name );
   if( it != m_types.end() )
   {
     return it->second;
   }
+  else if( 2 < name.size() && name.front() == '[' && name.back() == ']' )
+  {
+    // list types are created on first use
+    TypeInfo * element_type = lookup_type( name.substr( 1, name.size() - 2 ) );
+    return element_type ? list_type( element_type ) : nullptr;
+  }
   else
   {
     return nullptr;
   }
 }
 
+TypeInfo * TypeContext::list_type( TypeInfo * element_type )
+{
+  TypeInfo * type_info    = define_type( "[" + element_type->name + "]" );
+  type_info->element_type = element_type;
+  return type_info;
+}
+
 void TypeContext::throw_type_error( const std::string & msg )
 {
   error = msg;
@@ -1,21 +1,29 @@
 #pragma once
 
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <string>
 #include <vector>
 
+#include "allocator.h"
+#include "atom.h"
 #include "compiler.h"
 #include "object.h"
 
 struct TypeInfo
 {
   std::string name;
-  bool declard = false;
 
-  std::map<std::string, TypeInfo *> field_types;
+  std::map<Atom, TypeInfo *> field_types;
+  std::map<Atom, uint16_t> field_slots; // index of a field in an instance
 
   // only needed for functions
   TypeInfo * return_type;
   std::vector<TypeInfo *> arg_types;
 
+  TypeInfo * element_type = nullptr; // only set for list types
+
   bool is_callable() const
   {
     return return_type != nullptr;
@@ -31,14 +39,15 @@ struct TypeInfo
 class TypeContext
 {
 public:
-  TypeContext();
+  TypeContext( AtomTable & atoms );
   ~TypeContext();
   void push_scope();
   void pop_scope();
-  void define_var( const std::string & name, TypeInfo * type_info );
-  TypeInfo * lookup_var( const std::string & name );
-  TypeInfo * define_type( const std::string & name );
-  TypeInfo * lookup_type( const std::string & name );
+  void define_var( Atom name, TypeInfo * type_info );
+  TypeInfo * lookup_var( Atom name );
+  TypeInfo * define_type( std::string_view name );
+  TypeInfo * lookup_type( std::string_view name );
+  TypeInfo * list_type( TypeInfo * element_type );
 
   void throw_type_error( const std::string & msg );
 
@@ -48,15 +57,28 @@ public:
   }
 
   std::string error;
+  AtomTable & atoms;
 
 private:
   // mapping of type names to TypeInfo*
-  std::map<std::string, TypeInfo *> m_types;
+  std::map<std::string, TypeInfo *, std::less<>> m_types;
 
   // mapping of variable names to types
-  std::list<std::map<std::string, TypeInfo *>> m_scopes;
+  ScopeTable<TypeInfo *> m_scopes;
 };
 
+struct Optimizer;
+struct Expr;
+struct Stmt;
+
+// Names of variables, functions, classes and fields are atoms. The other strings and
+// the lists of the nodes take their memory from the NodeAllocator of the tree. The
+// parser creates them with it and the constructors of the nodes move them in, a copy
+// would take its memory from the default resource.
+using AstString = std::pmr::string;
+using ExprList  = std::pmr::vector<Expr *>;
+using StmtList  = std::pmr::vector<Stmt *>;
+
 struct AstNode
 {
   virtual ~AstNode()
@@ -64,17 +86,26 @@ struct AstNode
   }
 
   virtual void compile( Compiler & ) = 0;
+
+  // Count the declarations and assignments of every name, before optimize()
+  virtual void count_writes( Optimizer & );
 };
 
 struct Expr : AstNode
 {
   virtual TypeInfo * infer_types( TypeContext & ctx ) = 0;
+
+  // Returns the expression that replaces this one
+  virtual Expr * optimize( Optimizer & );
 };
 
 struct Stmt : AstNode
 {
   virtual bool declare_global( TypeContext & ctx );
   virtual bool check_types( TypeContext & ctx ) = 0;
+
+  // Returns the statement that replaces this one
+  virtual Stmt * optimize( Optimizer & );
 };
 
 struct Literal : Expr
@@ -87,29 +118,35 @@ struct Literal : Expr
 
 struct Binary : Expr
 {
-  std::string op;
+  AstString op;
   Expr * rhs;
   Expr * lhs;
-  Binary( const std::string & op, Expr * lhs, Expr * rhs );
+  TypeInfo * type = nullptr; // of both operands, set by the type checker
+  Binary( AstString op, Expr * lhs, Expr * rhs );
   void compile( Compiler & compiler ) override;
   TypeInfo * infer_types( TypeContext & ctx ) override;
+  void count_writes( Optimizer & ) override;
+  Expr * optimize( Optimizer & ) override;
 };
 
 struct Call : Expr
 {
   Expr * callee;
-  std::vector<Expr *> args;
-  Call( Expr * callee, const std::vector<Expr *> & args );
+  ExprList args;
+  Call( Expr * callee, ExprList args );
   void compile( Compiler & compiler ) override;
   TypeInfo * infer_types( TypeContext & ctx ) override;
+  void count_writes( Optimizer & ) override;
+  Expr * optimize( Optimizer & ) override;
 };
 
 struct Variable : Expr
 {
-  std::string name;
-  Variable( const std::string & name );
+  Atom name;
+  Variable( Atom name );
   void compile( Compiler & compiler ) override;
   TypeInfo * infer_types( TypeContext & ctx ) override;
+  Expr * optimize( Optimizer & ) override;
 };
 
 struct ExprStmt : Stmt
@@ -118,58 +155,72 @@ struct ExprStmt : Stmt
   ExprStmt( Expr * expr );
   void compile( Compiler & compiler ) override;
   bool check_types( TypeContext & ctx ) override;
+  void count_writes( Optimizer & ) override;
+  Stmt * optimize( Optimizer & ) override;
 };
 
 struct VariableDecl : Stmt
 {
-  std::string var_name;
-  std::string type_name;
+  Atom var_name;
+  AstString type_name;
   Expr * expr;
-  VariableDecl( const std::string & var_name, const std::string & type_name, Expr * expr );
+  VariableDecl( Atom var_name, AstString type_name, Expr * expr );
   void compile( Compiler & compiler ) override;
   bool check_types( TypeContext & ctx ) override;
   bool declare_global( TypeContext & ctx ) override;
+  void count_writes( Optimizer & ) override;
+  Stmt * optimize( Optimizer & ) override;
 };
 
 struct Assignment : Expr
 {
-  std::string name;
+  Atom name;
   Expr * expr;
-  Assignment( const std::string & name, Expr * expr );
+  Assignment( Atom name, Expr * expr );
   void compile( Compiler & compiler ) override;
   TypeInfo * infer_types( TypeContext & ctx ) override;
+  void count_writes( Optimizer & ) override;
+  Expr * optimize( Optimizer & ) override;
 };
 
 struct Program : Stmt
 {
-  std::vector<Stmt *> stmts;
+  StmtList stmts;
+  Program( std::pmr::memory_resource * resource );
   void compile( Compiler & compiler ) override;
   bool check_types( TypeContext & ctx ) override;
+  void count_writes( Optimizer & ) override;
+  Stmt * optimize( Optimizer & ) override;
 };
 
 struct Block : Stmt
 {
-  std::vector<Stmt *> stmts;
+  StmtList stmts;
+  Block( std::pmr::memory_resource * resource );
   void compile( Compiler & compiler ) override;
   bool check_types( TypeContext & ctx ) override;
+  void count_writes( Optimizer & ) override;
+  Stmt * optimize( Optimizer & ) override;
 };
 
 struct FnArgDecl
 {
-  std::string name;
-  std::string type;
+  Atom name;
+  AstString type;
 };
 
 struct FnDecl : Stmt
 {
-  std::string name;
-  std::vector<FnArgDecl> args;
-  std::string return_type;
+  Atom name;
+  std::pmr::vector<FnArgDecl> args;
+  AstString return_type;
   Stmt * body;
-  FnDecl( const std::string & name, const std::vector<FnArgDecl> & args, const std::string & return_type, Stmt * body );
+  FnDecl( Atom name, std::pmr::vector<FnArgDecl> args, AstString return_type, Stmt * body );
   void compile( Compiler & compiler ) override;
   bool declare_global( TypeContext & ctx ) override;
   bool check_types( TypeContext & ctx ) override;
+  void count_writes( Optimizer & ) override;
+  Stmt * optimize( Optimizer & ) override;
 };
 
 struct IfStmt : Stmt
@@ -180,6 +231,8 @@ struct IfStmt : Stmt
   IfStmt( Expr * cond, Stmt * then, Stmt * otherwise );
   void compile( Compiler & compiler ) override;
   bool check_types( TypeContext & ctx ) override;
+  void count_writes( Optimizer & ) override;
+  Stmt * optimize( Optimizer & ) override;
 };
 
 struct WhileStmt : Stmt
@@ -189,6 +242,8 @@ struct WhileStmt : Stmt
   WhileStmt( Expr * cond, Stmt * body );
   void compile( Compiler & compiler ) override;
   bool check_types( TypeContext & ctx ) override;
+  void count_writes( Optimizer & ) override;
+  Stmt * optimize( Optimizer & ) override;
 };
 
 struct Print : Stmt
@@ -198,6 +253,8 @@ struct Print : Stmt
   Print( Expr * expr, bool newline = false );
   void compile( Compiler & compiler ) override;
   bool check_types( TypeContext & ctx ) override;
+  void count_writes( Optimizer & ) override;
+  Stmt * optimize( Optimizer & ) override;
 };
 
 struct Return : Stmt
@@ -206,69 +263,160 @@ struct Return : Stmt
   Return( Expr * expr );
   void compile( Compiler & compiler ) override;
   bool check_types( TypeContext & ctx ) override;
+  void count_writes( Optimizer & ) override;
+  Stmt * optimize( Optimizer & ) override;
 };
 
 struct ClassFieldDecl
 {
-  std::string name;
-  std::string type;
+  Atom name;
+  AstString type;
 };
 
 struct ClassDecl : Stmt
 {
-  std::string name;
-  std::vector<ClassFieldDecl> fields;
-  ClassDecl( const std::string & name );
-  ClassDecl( const std::string & name, const std::vector<ClassFieldDecl> & fields );
+  Atom name;
+  std::pmr::vector<ClassFieldDecl> fields;
+  ClassDecl( Atom name, std::pmr::vector<ClassFieldDecl> fields );
   void compile( Compiler & compiler ) override;
   bool declare_global( TypeContext & ctx ) override;
   bool check_types( TypeContext & ctx ) override;
+  void count_writes( Optimizer & ) override;
 };
 
 struct Get : Expr
 {
   Expr * object;
-  std::string property;
-  Get( Expr * object, const std::string & name );
+  Atom property;
+  uint16_t slot = UNDEFINED; // resolved by the type checker
+  Get( Expr * object, Atom name );
   void compile( Compiler & compiler ) override;
   TypeInfo * infer_types( TypeContext & ctx ) override;
+  void count_writes( Optimizer & ) override;
+  Expr * optimize( Optimizer & ) override;
 };
 
 struct Set : Expr
 {
   Expr * object;
-  std::string property;
+  Atom property;
+  uint16_t slot = UNDEFINED; // resolved by the type checker
+  Expr * value;
+  Set( Expr * object, Atom name, Expr * value );
+  void compile( Compiler & compiler ) override;
+  TypeInfo * infer_types( TypeContext & ctx ) override;
+  void count_writes( Optimizer & ) override;
+  Expr * optimize( Optimizer & ) override;
+};
+
+// An empty list literal has the type it is declared or assigned as
+struct ListLiteral : Expr
+{
+  ExprList elements;
+  TypeInfo * type = nullptr; // set by the type checker
+  ListLiteral( ExprList elements );
+  void compile( Compiler & compiler ) override;
+  TypeInfo * infer_types( TypeContext & ctx ) override;
+  void count_writes( Optimizer & ) override;
+  Expr * optimize( Optimizer & ) override;
+};
+
+struct GetIndex : Expr
+{
+  Expr * list;
+  Expr * index;
+  GetIndex( Expr * list, Expr * index );
+  void compile( Compiler & compiler ) override;
+  TypeInfo * infer_types( TypeContext & ctx ) override;
+  void count_writes( Optimizer & ) override;
+  Expr * optimize( Optimizer & ) override;
+};
+
+struct SetIndex : Expr
+{
+  Expr * list;
+  Expr * index;
   Expr * value;
-  Set( Expr * object, const std::string & name, Expr * value );
+  SetIndex( Expr * list, Expr * index, Expr * value );
   void compile( Compiler & compiler ) override;
   TypeInfo * infer_types( TypeContext & ctx ) override;
+  void count_writes( Optimizer & ) override;
+  Expr * optimize( Optimizer & ) override;
 };
 
-// basic allocator, should be replaced by a arena allocator
-// arena allocator does not allow me to use stl containers
-class NodeAllocator
+// list.append(value)
+struct Append : Expr
+{
+  Expr * list;
+  Expr * value;
+  Append( Expr * list, Expr * value );
+  void compile( Compiler & compiler ) override;
+  TypeInfo * infer_types( TypeContext & ctx ) override;
+  void count_writes( Optimizer & ) override;
+  Expr * optimize( Optimizer & ) override;
+};
+
+// The nodes of a syntax tree live in a chain of arenas and are released together when
+// the allocator is destroyed, their destructors are not run. The allocator is also the
+// memory resource of the strings and lists in the nodes, so building a tree does not
+// go through malloc for every node.
+class NodeAllocator : public std::pmr::memory_resource
 {
 public:
+  static constexpr std::size_t MIN_BLOCK_SIZE = 64 * 1024;
+  static constexpr std::size_t MAX_BLOCK_SIZE = 4 * 1024 * 1024;
+
   NodeAllocator()
   {
   }
-  ~NodeAllocator()
+
+  NodeAllocator( const NodeAllocator & )             = delete;
+  NodeAllocator & operator=( const NodeAllocator & ) = delete;
+
+  template <typename T, typename... Args>
+  T * alloc( Args &&... args )
+  {
+    return new( allocate( sizeof( T ), alignof( T ) ) ) T( std::forward<Args>( args )... );
+  }
+
+  std::size_t used() const
   {
-    for( AstNode * node : m_nodes )
+    std::size_t bytes = 0;
+    for( const auto & block : m_blocks )
     {
-      delete node;
+      bytes += block->used();
     }
-    m_nodes.clear();
+    return bytes;
   }
 
-  template <typename T, typename... Args>
-  T * alloc( Args &&... args )
+  std::size_t num_blocks() const
   {
-    T * ptr = new T( std::forward<Args>( args )... );
-    m_nodes.push_back( ptr );
-    return ptr;
+    return m_blocks.size();
   }
 
 private:
-  std::list<AstNode *> m_nodes;
+  std::vector<std::unique_ptr<ArenaAllocator>> m_blocks;
+
+  // Each block is twice as large as the one before, up to MAX_BLOCK_SIZE
+  void * do_allocate( std::size_t bytes, std::size_t alignment ) override
+  {
+    void * memory = m_blocks.empty() ? nullptr : m_blocks.back()->try_alloc( bytes, alignment );
+    if( !memory )
+    {
+      std::size_t size = m_blocks.empty() ? MIN_BLOCK_SIZE : std::min( 2 * m_blocks.back()->capacity(), MAX_BLOCK_SIZE );
+      m_blocks.push_back( std::make_unique<ArenaAllocator>( std::max( size, bytes + alignment ) ) );
+      memory = m_blocks.back()->try_alloc( bytes, alignment );
+    }
+    return memory;
+  }
+
+  // the memory is released with the allocator
+  void do_deallocate( void *, std::size_t, std::size_t ) override
+  {
+  }
+
+  bool do_is_equal( const std::pmr::memory_resource & other ) const noexcept override
+  {
+    return this == &other;
+  }
 };
@@ -0,0 +1,19 @@
+#include "atom.h"
+
+AtomTable::AtomTable()
+{
+  ( void ) intern( "" );
+}
+
+Atom AtomTable::intern( std::string_view name )
+{
+  if( const Atom * atom = m_atoms.find( name ) )
+  {
+    return *atom;
+  }
+
+  Atom atom = ( Atom ) m_names.size();
+  m_names.emplace_back( name );
+  m_atoms.set( m_names.back(), atom );
+  return atom;
+}
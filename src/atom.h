@@ -0,0 +1,143 @@
+#pragma once
+
+#include "utils.h"
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Identifiers are interned by the lexer, every later stage keys its tables on the
+// atom and only turns it back into a name for messages and for the names of the
+// code objects. Atom 0 is the empty name.
+//
+// A table belongs to one compilation, or to a REPL session, and is passed to the
+// lexer, the type checker and the compiler. The names end up copied into the code
+// objects, so the table can be released once the code is compiled. It is not
+// synchronized, every thread that compiles uses a table of its own.
+using Atom = uint32_t;
+
+class AtomTable
+{
+public:
+  AtomTable();
+
+  AtomTable( const AtomTable & )             = delete;
+  AtomTable & operator=( const AtomTable & ) = delete;
+
+  Atom intern( std::string_view name );
+
+  const std::string & name( Atom atom ) const
+  {
+    return m_names[atom];
+  }
+
+  size_t size() const
+  {
+    return m_names.size();
+  }
+
+private:
+  std::deque<std::string> m_names;         // a deque does not move its elements
+  HashMap<std::string_view, Atom> m_atoms; // views of m_names
+};
+
+// Names in nested scopes, as a single stack of symbols. A scope is a marker into the
+// stack, so entering and leaving one does not allocate once the vectors have grown.
+// The innermost symbol of every atom is found through an index by atom, each symbol
+// remembers the one it shadows, which becomes visible again when its scope is left.
+// The index is dense, atoms are numbered per compilation, so it is as long as the
+// number of distinct names of the program and not of everything the process compiled.
+template <typename V>
+class ScopeTable
+{
+public:
+  struct Symbol
+  {
+    Atom name;
+    uint32_t shadowed; // position + 1 of the shadowed symbol, 0 if there is none
+    V value;
+  };
+
+  void push_scope()
+  {
+    m_scopes.push_back( ( uint32_t ) m_symbols.size() );
+  }
+
+  void pop_scope()
+  {
+    size_t start = m_scopes.back();
+    m_scopes.pop_back();
+    while( m_symbols.size() > start )
+    {
+      const Symbol & symbol = m_symbols.back();
+      m_index[symbol.name]  = symbol.shadowed;
+      m_symbols.pop_back();
+    }
+  }
+
+  // Replaces the value if the name is defined in the innermost scope already
+  void define( Atom name, const V & value )
+  {
+    if( m_index.size() <= name )
+    {
+      m_index.resize( name + 1, 0 );
+    }
+
+    uint32_t shadowed = m_index[name];
+    if( shadowed && scope_start( depth() - 1 ) < shadowed )
+    {
+      m_symbols[shadowed - 1].value = value;
+      return;
+    }
+
+    m_symbols.push_back( { name, shadowed, value } );
+    m_index[name] = ( uint32_t ) m_symbols.size();
+  }
+
+  // The innermost symbol of a name or nullptr
+  Symbol * find( Atom name )
+  {
+    uint32_t position = name < m_index.size() ? m_index[name] : 0;
+    return position ? &m_symbols[position - 1] : nullptr;
+  }
+
+  // The symbol of a name in the outermost scope, even if it is shadowed
+  Symbol * find_global( Atom name )
+  {
+    Symbol * symbol = find( name );
+    while( symbol && symbol->shadowed )
+    {
+      symbol = &m_symbols[symbol->shadowed - 1];
+    }
+    return symbol && is_global( symbol ) ? symbol : nullptr;
+  }
+
+  bool is_global( const Symbol * symbol ) const
+  {
+    return ( size_t ) ( symbol - m_symbols.data() ) < scope_start( 1 );
+  }
+
+  // The number of scopes, the outermost one included
+  size_t depth() const
+  {
+    return m_scopes.size() + 1;
+  }
+
+  // The number of symbols in the innermost scope
+  size_t scope_size() const
+  {
+    return m_symbols.size() - scope_start( depth() - 1 );
+  }
+
+private:
+  std::vector<Symbol> m_symbols;
+  std::vector<uint32_t> m_scopes; // the position of the first symbol of every inner scope
+  std::vector<uint32_t> m_index;  // position + 1 of the innermost symbol of every atom
+
+  size_t scope_start( size_t scope ) const
+  {
+    return scope == 0 ? 0 : scope <= m_scopes.size() ? m_scopes[scope - 1] : m_symbols.size();
+  }
+};
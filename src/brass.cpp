@@ -1,41 +1,93 @@
 #include "brass.h"
 #include "allocator.h"
 #include "bytecode.h"
+#include "cache.h"
 #include "compiler.h"
 #include "lexer.h"
+#include "optimizer.h"
 #include "parser.h"
+#include "superinstructions.h"
 #include "vm.h"
+#include <charconv>
+#include <filesystem>
 #include <fstream>
 #include <sstream>
 
-int eval( const char * src, std::ostream & out, std::ostream & err )
+// Runs the front end, returns false and reports the error if the source is invalid
+static bool compile_source(
+    const char * src, GarbageCollector & gc, CodeObject * code, std::ostream & err, VMOptions options )
 {
-  std::vector<Token> tokens = lex( src );
-
-  GarbageCollector gc;
+  // the tree and the atoms are released once the code is compiled
   NodeAllocator allocator;
+  AtomTable atoms;
 
-  Result<Program> result = parse( tokens, allocator, gc );
+  Result<Program> result = parse( src, atoms, allocator, gc );
   if( !result.ok() )
   {
     err << "PARSER ERROR: " << result.error << std::endl;
-    return 1;
+    return false;
   }
 
-  TypeContext ctx;
+  TypeContext ctx( atoms );
   result.node->check_types( ctx );
   if( !ctx.ok() )
   {
     err << "TYPE ERROR: " << ctx.error << std::endl;
-    return 1;
+    return false;
   }
 
-  CodeObject code;
-  compile( result.node, gc, &code );
+  if( options.optimize )
+  {
+    Optimizer optimizer( allocator );
+    optimize( result.node, optimizer );
+  }
+
+  compile( result.node, gc, code, atoms );
+  return true;
+}
 
-  VirtualMachine vm( out, err, gc );
+static int run_code(
+    CodeObject * code, GarbageCollector & gc, std::ostream & out, std::ostream & err, VMOptions options )
+{
+  VirtualMachine vm( out, err, gc, options );
+
+  int r = vm.run( code );
+  if( options.gc_stats )
+  {
+    err << "minor collections, ";
+    gc.minor_pauses().print( err );
+    err << "major collections, ";
+    gc.major_pauses().print( err );
+  }
+  return r;
+}
+
+int eval( const char * src, std::ostream & out, std::ostream & err, VMOptions options )
+{
+  GarbageCollector gc( options.gc );
+  CodeObject code;
+  if( !compile_source( src, gc, &code, err, options ) )
+  {
+    return 1;
+  }
+  return run_code( &code, gc, out, err, options );
+}
 
-  return vm.run( &code );
+int eval_cached(
+    const std::string & src, const std::string & cache_path, std::ostream & out, std::ostream & err, VMOptions options )
+{
+  GarbageCollector gc( options.gc );
+  CodeObject code;
+  uint64_t key = cache_key( src, options.optimize );
+  if( !read_cache( cache_path, key, gc, &code ) )
+  {
+    if( !compile_source( src.c_str(), gc, &code, err, options ) )
+    {
+      return 1;
+    }
+    ( void ) write_cache( cache_path, key, code ); // running does not depend on the cache
+  }
+  return run_code( &code, gc, out, err, options );
 }
 
 std::string repl_header()
@@ -45,16 +97,18 @@ std::string repl_header()
   return ss.str();
 }
 
-int repl()
+int repl( VMOptions options )
 {
-  TypeContext ctx;
-  GarbageCollector gc;
+  AtomTable atoms; // later lines refer to the names of earlier ones
+  TypeContext ctx( atoms );
+  GarbageCollector gc( options.gc );
   NodeAllocator allocator;
+  Optimizer optimizer( allocator );
 
-  VirtualMachine vm( std::cout, std::cerr, gc );
+  VirtualMachine vm( std::cout, std::cerr, gc, options );
 
   CodeObject code_object;
-  Compiler compiler( gc, &code_object );
+  Compiler compiler( gc, &code_object, atoms );
 
   std::cout << repl_header() << std::endl;
 
@@ -75,13 +129,13 @@ int repl()
       continue;
     }
 
-    auto tokens = lex( line );
-    if( tokens.empty() )
+    Lexer lexer( line, atoms );
+    if( lexer.is_finished() )
     {
       continue;
     }
 
-    auto ast = parse( tokens, allocator, gc );
+    auto ast = parse( lexer, allocator, gc );
     if( !ast.ok() )
     {
       std::cerr << ast.error << std::endl;
@@ -95,6 +149,11 @@ int repl()
       continue;
     }
 
+    if( options.optimize )
+    {
+      optimize( ast.node, optimizer );
+    }
+
     ast.node->compile( compiler );
 
     vm.run( &code_object );
@@ -104,12 +163,91 @@ int repl()
   return 0;
 }
 
+// The number after the prefix of an option like --gc-work-budget=, false if it is
+// missing, not a number or out of range.
+static bool parse_option_value( const std::string & arg, size_t prefix, size_t & value )
+{
+  const char * first            = arg.data() + prefix;
+  const char * last             = arg.data() + arg.size();
+  std::from_chars_result result = std::from_chars( first, last, value );
+  return first != last && result.ec == std::errc() && result.ptr == last;
+}
+
 int brass( int argc, char * argv[] )
 {
-  if( 1 < argc )
+  VMOptions options;
+  SequenceProfile profile;
+  std::string filename;
+  std::string cache_dir;
+  bool cache = false;
+
+  for( int i = 1; i < argc; i++ )
   {
-    std::string filename = argv[1];
+    std::string arg = argv[i];
+    if( arg == "--engine=register" )
+    {
+      options.engine = Engine::REGISTER;
+    }
+    else if( arg == "--engine=stack" )
+    {
+      options.engine = Engine::STACK;
+    }
+    else if( arg == "--no-superinstructions" )
+    {
+      options.superinstructions = false;
+    }
+    else if( arg == "--profile-sequences" )
+    {
+      options.engine  = Engine::STACK;
+      options.profile = &profile;
+    }
+    else if( arg == "--no-optimize" )
+    {
+      options.optimize = false;
+    }
+    else if( arg == "--gc=incremental" )
+    {
+      options.gc.incremental = true;
+    }
+    else if( arg.rfind( "--gc-work-budget=", 0 ) == 0 )
+    {
+      if( !parse_option_value( arg, 17, options.gc.work_budget ) )
+      {
+        std::cerr << "Usage error: '" << arg << "' needs a number of objects" << std::endl;
+        return 1;
+      }
+    }
+    else if( arg.rfind( "--gc-time-budget-us=", 0 ) == 0 )
+    {
+      size_t microseconds = 0;
+      if( !parse_option_value( arg, 20, microseconds ) )
+      {
+        std::cerr << "Usage error: '" << arg << "' needs a number of microseconds" << std::endl;
+        return 1;
+      }
+      options.gc.time_budget = std::chrono::microseconds( microseconds );
+    }
+    else if( arg == "--gc-stats" )
+    {
+      options.gc_stats = true;
+    }
+    else if( arg == "--cache" )
+    {
+      cache = true;
+    }
+    else if( arg.rfind( "--cache-dir=", 0 ) == 0 )
+    {
+      cache     = true;
+      cache_dir = arg.substr( 12 );
+    }
+    else
+    {
+      filename = arg;
+    }
+  }
 
+  if( !filename.empty() )
+  {
     std::fstream file( filename );
     if( !file.is_open() )
     {
@@ -127,10 +265,33 @@ int brass( int argc, char * argv[] )
       return 1;
     }
 
-    return eval( src.c_str(), std::cout, std::cerr );
+    int r = 0;
+    if( cache )
+    {
+      // next to the source, or in the cache directory under the key of the source
+      std::string cache_path = filename + "c";
+      if( !cache_dir.empty() )
+      {
+        std::error_code error;
+        std::filesystem::create_directories( cache_dir, error );
+        cache_path = cache_dir + "/" + cache_file_name( cache_key( src, options.optimize ) );
+      }
+      r = eval_cached( src, cache_path, std::cout, std::cerr, options );
+    }
+    else
+    {
+      r = eval( src.c_str(), std::cout, std::cerr, options );
+    }
+
+    if( options.profile )
+    {
+      std::cerr << "executed sequences, by dispatches saved if fused:" << std::endl;
+      profile.print( std::cerr, 20 );
+    }
+    return r;
   }
   else
   {
-    return repl();
+    return repl( options );
   }
 }
@@ -1,10 +1,21 @@
 #pragma once
 
+#include "vm.h"
+
 #include <iostream>
 #include <ostream>
+#include <string>
+
+int eval( const char * src, std::ostream & out = std::cout, std::ostream & err = std::cerr, VMOptions options = {} );
 
-int eval( const char * src, std::ostream & out = std::cout, std::ostream & err = std::cerr );
+// Like eval(), but the compiled code is read from cache_path if it was written for
+// the same source and options, and written there otherwise. See cache.h.
+int eval_cached( const std::string & src,
+                 const std::string & cache_path,
+                 std::ostream & out = std::cout,
+                 std::ostream & err = std::cerr,
+                 VMOptions options  = {} );
 
-int repl();
+int repl( VMOptions options = {} );
 
 int brass( int argc, char * argv[] );
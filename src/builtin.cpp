@@ -1,27 +1,39 @@
 #include "builtin.h"
 #include "vm.h"
 #include <cassert>
+#include <map>
 
+// The type names are interned, so calling typeof does not allocate
 Object f_typeof( VirtualMachine * vm, int argc, Object args[] )
 {
   assert( argc == 1 );
   Object arg0 = args[0];
   StringObject * str;
-  switch( arg0.type )
+  switch( arg0.type() )
   {
     case Object ::Type ::NIL :
-      str = vm->gc().alloc<StringObject>( "niltype" );
+      str = intern_string( vm->gc(), "niltype" );
       break;
     case Object ::Type ::INTEGER :
-      str = vm->gc().alloc<StringObject>( "integer" );
+      str = intern_string( vm->gc(), "integer" );
       break;
     case Object ::Type ::STRING :
-      str = vm->gc().alloc<StringObject>( "string" );
+      str = intern_string( vm->gc(), "string" );
       break;
     default :
-      str = vm->gc().alloc<StringObject>( "unknown-type" );
+      str = intern_string( vm->gc(), "unknown-type" );
       break;
   }
 
   return Object::String( str );
 }
+
+NativeFunction find_builtin( const std::string & name )
+{
+  static const std::map<std::string, NativeFunction> builtins = {
+      { "typeof", f_typeof },
+  };
+
+  auto it = builtins.find( name );
+  return ( it != builtins.end() ) ? it->second : nullptr;
+}
@@ -5,3 +5,6 @@
 class VirtualMachine;
 
 Object f_typeof( VirtualMachine*, int argc, Object args[] );
+
+// returns nullptr if there is no builtin function with that name
+NativeFunction find_builtin( const std::string & name );
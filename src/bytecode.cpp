@@ -1,9 +1,6 @@
 #include "bytecode.h"
 #include "object.h"
 
-// size of a single instruction in bytes
-constexpr size_t INSTR_SIZE = 3;
-
 std::pair<uint8_t, uint8_t> short_to_bytes( uint16_t u16 )
 {
   uint16_t hi = ( u16 >> 8 ) & 0xff;
@@ -11,9 +8,21 @@ std::pair<uint8_t, uint8_t> short_to_bytes( uint16_t u16 )
   return std::make_pair( ( uint8_t ) hi, ( uint8_t ) lo );
 }
 
+// The compiler emits structured code, every statement leaves the stack as it found
+// it, so the height can be tracked in emission order without following jumps.
+static void track_depth( CodeObject & code, OpCode op, uint32_t arg )
+{
+  code.stack_depth += stack_effect( op, arg );
+  if( code.max_stack < code.stack_depth )
+  {
+    code.max_stack = ( uint16_t ) code.stack_depth;
+  }
+}
+
 void CodeObject::emit_instr( OpCode instr )
 {
   instructions.push_back( instr );
+  track_depth( *this, instr, 0 );
 }
 
 void CodeObject::emit_instr( OpCode instr, uint16_t arg )
@@ -23,6 +32,7 @@ void CodeObject::emit_instr( OpCode instr, uint16_t arg )
   instructions.push_back( instr );
   instructions.push_back( ( uint8_t ) hi );
   instructions.push_back( ( uint8_t ) lo );
+  track_depth( *this, instr, arg );
 }
 
 void CodeObject::emit_literal( Object value )
@@ -73,3 +83,138 @@ CodeObject * CodeObject::get_root()
   }
   return current;
 }
+
+bool has_operand( OpCode op )
+{
+  switch( op )
+  {
+    case OP_LOAD_CONST :
+    case OP_LOAD_GLOBAL :
+    case OP_STORE_GLOBAL :
+    case OP_LOAD_LOCAL :
+    case OP_STORE_LOCAL :
+    case OP_GET_PROPERTY :
+    case OP_SET_PROPERTY :
+    case OP_GET_FIELD :
+    case OP_SET_FIELD :
+    case OP_JMP :
+    case OP_JMP_IF_FALSE :
+    case OP_LOOP :
+    case OP_CALL :
+    case OP_BUILD_LIST :
+      return true;
+    default :
+      return false;
+  }
+}
+
+const char * op_name( OpCode op )
+{
+  static const char * const names[] = {
+      // clang-format off
+      "NOP", "LOAD_CONST", "LOAD_GLOBAL", "STORE_GLOBAL", "LOAD_LOCAL",
+      "STORE_LOCAL", "CALL", "SET_PROPERTY", "GET_PROPERTY", "RETURN",
+      "ADD_INT", "SUB_INT", "DIV_INT", "MULT_INT", "ADD_FLOAT",
+      "SUB_FLOAT", "DIV_FLOAT", "MULT_FLOAT", "CONCAT_STR", "PRINT",
+      "PRINTLN", "JMP", "JMP_IF_FALSE", "LOOP", "POP",
+      "GET_FIELD", "SET_FIELD", "BUILD_LIST", "INDEX_GET", "INDEX_SET",
+      "APPEND", "HALT", "ADD_LL", "ADD_LL_STORE", "SUB_KL",
+      "SUB_KL_STORE", "JMP_IF_LOCAL_FALSE", "STORE_GLOBAL_CONST", "CALL_GLOBAL",
+      // clang-format on
+  };
+  static_assert( sizeof( names ) / sizeof( names[0] ) == OP_CALL_GLOBAL + 1 );
+  return op <= OP_CALL_GLOBAL ? names[op] : "UNKNOWN";
+}
+
+int stack_effect( OpCode op, uint32_t arg )
+{
+  switch( op )
+  {
+    case OP_LOAD_CONST :
+    case OP_LOAD_GLOBAL :
+    case OP_LOAD_LOCAL :
+      return 1;
+    case OP_STORE_GLOBAL :
+    case OP_STORE_LOCAL :
+    case OP_RETURN :
+    case OP_ADD_INT :
+    case OP_SUB_INT :
+    case OP_DIV_INT :
+    case OP_MULT_INT :
+    case OP_ADD_FLOAT :
+    case OP_SUB_FLOAT :
+    case OP_DIV_FLOAT :
+    case OP_MULT_FLOAT :
+    case OP_CONCAT_STR :
+    case OP_PRINT :
+    case OP_PRINTLN :
+    case OP_JMP_IF_FALSE :
+    case OP_POP :
+    case OP_INDEX_GET :
+      return -1;
+    case OP_SET_PROPERTY :
+    case OP_SET_FIELD :
+    case OP_APPEND :
+      return -2;
+    case OP_INDEX_SET :
+      return -3;
+    case OP_BUILD_LIST :
+      return 1 - ( int ) arg;
+    case OP_CALL :
+      // the arguments and the callee are replaced by the result
+      return -( int ) arg;
+    default :
+      return 0;
+  }
+}
+
+// Translate the byte encoded instructions into a stream of fixed size instructions.
+// Jump offsets are relative byte counts in the encoded form, in the decoded form
+// they become absolute instruction indices. The stream is terminated by OP_HALT.
+void CodeObject::decode()
+{
+  decoded.clear();
+
+  std::vector<uint32_t> index_of( instructions.size() + 1, 0 );
+  std::vector<size_t> offset_of;
+
+  size_t pos = 0;
+  while( pos < instructions.size() )
+  {
+    OpCode op     = static_cast<OpCode>( instructions[pos] );
+    index_of[pos] = ( uint32_t ) decoded.size();
+    uint32_t arg  = 0;
+    size_t start  = pos++;
+
+    if( has_operand( op ) )
+    {
+      uint8_t hi = instructions[pos++];
+      uint8_t lo = instructions[pos++];
+      arg        = ( uint32_t( hi ) << 8 ) | uint32_t( lo );
+    }
+
+    decoded.push_back( { nullptr, op, arg } );
+    offset_of.push_back( start );
+  }
+
+  index_of[pos] = ( uint32_t ) decoded.size();
+  decoded.push_back( { nullptr, OP_HALT, 0 } );
+
+  for( size_t i = 0; i < offset_of.size(); i++ )
+  {
+    Instr & instr = decoded[i];
+    size_t next   = offset_of[i] + INSTR_SIZE;
+    switch( instr.op )
+    {
+      case OP_JMP :
+      case OP_JMP_IF_FALSE :
+        instr.arg = index_of[next + instr.arg];
+        break;
+      case OP_LOOP :
+        instr.arg = index_of[next - instr.arg];
+        break;
+      default :
+        break;
+    }
+  }
+}
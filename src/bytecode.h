@@ -19,25 +19,114 @@ enum OpCode : uint8_t
   OP_SET_PROPERTY,
   OP_GET_PROPERTY,
   OP_RETURN,
-  OP_ADD,
-  OP_SUB,
-  OP_DIV,
-  OP_MULT,
+  OP_ADD_INT, // the operand types of arithmetic are known from the type checker
+  OP_SUB_INT,
+  OP_DIV_INT,
+  OP_MULT_INT,
+  OP_ADD_FLOAT,
+  OP_SUB_FLOAT,
+  OP_DIV_FLOAT,
+  OP_MULT_FLOAT,
+  OP_CONCAT_STR,
   OP_PRINT,
   OP_PRINTLN,
   OP_JMP,
   OP_JMP_IF_FALSE,
   OP_LOOP,
   OP_POP,
+  OP_GET_FIELD,
+  OP_SET_FIELD,
+  OP_BUILD_LIST, // the list of the arg values on top of the stack
+  OP_INDEX_GET,
+  OP_INDEX_SET,
+  OP_APPEND,
+  OP_HALT, // only appears in decoded instruction streams
+
+  // superinstructions, see superinstructions.cpp
+  OP_ADD_LL,
+  OP_ADD_LL_STORE,
+  OP_SUB_KL,
+  OP_SUB_KL_STORE,
+  OP_JMP_IF_LOCAL_FALSE,
+  OP_STORE_GLOBAL_CONST,
+  OP_CALL_GLOBAL,
+};
+
+// size of an encoded instruction with an operand in bytes
+constexpr size_t INSTR_SIZE = 3;
+
+// An instruction with its operand already decoded. Jump operands are
+// resolved to absolute indices into the decoded stream.
+struct Instr
+{
+  const void * handler; // dispatch target, filled in by the VirtualMachine
+  OpCode op;
+  uint32_t arg;
+};
+
+bool has_operand( OpCode );
+
+// The name of an opcode without the OP_ prefix
+const char * op_name( OpCode );
+
+// Change of the operand stack height caused by an instruction
+int stack_effect( OpCode, uint32_t arg );
+
+// Three-address instructions executed by VirtualMachine::run_registers().
+// Operands marked RK can either name a register or, if RK_CONSTANT is set,
+// an entry in the literal table.
+enum RegOpCode : uint8_t
+{
+  ROP_NOP,
+  ROP_MOVE,         // R[a] = RK(b)
+  ROP_LOAD_GLOBAL,  // R[a] = globals[b]
+  ROP_STORE_GLOBAL, // globals[a] = RK(b)
+  ROP_ADD_INT,      // R[a] = RK(b) + RK(c)
+  ROP_SUB_INT,      // R[a] = RK(b) - RK(c)
+  ROP_MULT_INT,     // R[a] = RK(b) * RK(c)
+  ROP_DIV_INT,      // R[a] = RK(b) / RK(c)
+  ROP_ADD_FLOAT,    // R[a] = RK(b) + RK(c)
+  ROP_SUB_FLOAT,    // R[a] = RK(b) - RK(c)
+  ROP_MULT_FLOAT,   // R[a] = RK(b) * RK(c)
+  ROP_DIV_FLOAT,    // R[a] = RK(b) / RK(c)
+  ROP_CONCAT_STR,   // R[a] = RK(b) .. RK(c)
+  ROP_PRINT,        // print RK(a)
+  ROP_PRINTLN,      // println RK(a)
+  ROP_CALL,         // R[a] = R[a + b](R[a], ..., R[a + b - 1])
+  ROP_RETURN,       // return RK(a)
+  ROP_GET_PROPERTY, // R[a] = RK(b).names[c]
+  ROP_SET_PROPERTY, // RK(a).names[b] = RK(c)
+  ROP_GET_FIELD,    // R[a] = RK(b).fields[c]
+  ROP_SET_FIELD,    // RK(a).fields[b] = RK(c)
+  ROP_BUILD_LIST,   // R[a] = [R[a], ..., R[a + b - 1]]
+  ROP_INDEX_GET,    // R[a] = RK(b)[RK(c)]
+  ROP_INDEX_SET,    // RK(a)[RK(b)] = RK(c)
+  ROP_APPEND,       // append RK(b) to RK(a)
+  ROP_JMP,          // ip = a
+  ROP_JMP_IF_FALSE, // if !RK(a) then ip = b
+  ROP_HALT,
+};
+
+constexpr uint16_t RK_CONSTANT = 0x8000;
+
+struct RegInstr
+{
+  RegOpCode op;
+  uint16_t a, b, c;
 };
 
 struct CodeObject
 {
   CodeObject * parent = nullptr;
   uint16_t num_locals = 0;
+  uint16_t max_stack  = 0; // operand stack slots needed above the locals
+  int stack_depth     = 0; // operand stack height at the end of the emitted code
   std::vector<Object> literals;
   std::vector<uint8_t> instructions;
-  std::vector<std::string> names; // local names
+  std::vector<std::string> names; // globals and property names, a global's slot is its index
+  std::vector<Instr> decoded;
+  std::vector<RegInstr> reg_instructions;
+  uint16_t num_registers = 0;
   void emit_instr( OpCode );
   void emit_instr( OpCode, uint16_t );
   void emit_literal( Object );
@@ -46,4 +135,5 @@ struct CodeObject
   void emit_loop( size_t );
   uint16_t emit_name( const std::string & name );
   CodeObject * get_root();
+  void decode();
 };
@@ -0,0 +1,519 @@
+#include "cache.h"
+#include "object.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <process.h>
+#endif
+
+// All numbers are stored in the byte order of the machine, a cache is not meant to
+// be moved to another one.
+//
+//   header   magic "BRSC", version (u32), key (u64), checksum of the body (u64)
+//   code     num_locals (u16), max_stack (u16), instructions (u32 count + bytes),
+//            names (u32 count + strings), literals (u32 count + literals)
+//   string   length (u32) + characters
+//   literal  Object::Type (u8) + payload: int (i32), real (f64), string, or for a
+//            function its name, arity (u8) and code, for a class its name and
+//            field names (u32 count + strings)
+static const char MAGIC[4] = { 'B', 'R', 'S', 'C' };
+
+struct CacheHeader
+{
+  char magic[4];
+  uint32_t version;
+  uint64_t key;
+  uint64_t checksum;
+};
+
+uint64_t cache_key( const std::string & src, bool optimized )
+{
+  return hash_bytes( src.data(), src.size() ) ^ ( optimized ? 0x9e3779b97f4a7c15ull : 0 );
+}
+
+std::string cache_file_name( uint64_t key )
+{
+  char name[32];
+  snprintf( name, sizeof( name ), "%016llx.bsc", ( unsigned long long ) key );
+  return name;
+}
+
+class Writer
+{
+public:
+  std::string bytes;
+
+  template <typename T>
+  void write( T value )
+  {
+    bytes.append( reinterpret_cast<const char *>( &value ), sizeof( T ) );
+  }
+
+  void write_string( const std::string & str )
+  {
+    write<uint32_t>( ( uint32_t ) str.size() );
+    bytes.append( str );
+  }
+
+  bool write_code( const CodeObject & code )
+  {
+    write<uint16_t>( code.num_locals );
+    write<uint16_t>( code.max_stack );
+
+    write<uint32_t>( ( uint32_t ) code.instructions.size() );
+    bytes.append( code.instructions.begin(), code.instructions.end() );
+
+    write<uint32_t>( ( uint32_t ) code.names.size() );
+    for( const std::string & name : code.names )
+    {
+      write_string( name );
+    }
+
+    write<uint32_t>( ( uint32_t ) code.literals.size() );
+    for( const Object & literal : code.literals )
+    {
+      if( !write_literal( literal ) )
+      {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool write_literal( const Object & literal )
+  {
+    write<uint8_t>( ( uint8_t ) literal.type() );
+    switch( literal.type() )
+    {
+      case Object::NIL :
+        return true;
+      case Object::BOOLEAN :
+        write<uint8_t>( literal.as_boolean() );
+        return true;
+      case Object::INTEGER :
+        write<int32_t>( literal.as_integer() );
+        return true;
+      case Object::REAL :
+        write<double>( literal.as_real() );
+        return true;
+      case Object::STRING :
+        write_string( literal.as_string()->c_str() );
+        return true;
+      case Object::FUNCTION :
+        write_string( literal.as_function()->name );
+        write<uint8_t>( literal.as_function()->num_args );
+        return write_code( literal.as_function()->code_object );
+      case Object::CLASS :
+        write_string( literal.as_class()->name );
+        write<uint32_t>( ( uint32_t ) literal.as_class()->fields.size() );
+        for( const std::string & field : literal.as_class()->fields )
+        {
+          write_string( field );
+        }
+        return true;
+      default :
+        return false; // the compiler does not emit other literals
+    }
+  }
+};
+
+// Every read checks the bounds, after the first failure all reads return zeros
+class Reader
+{
+public:
+  Reader( const uint8_t * data, size_t size, GarbageCollector & gc )
+      : m_pos( data )
+      , m_end( data + size )
+      , m_gc( gc )
+  {
+  }
+
+  bool ok() const
+  {
+    return m_ok;
+  }
+
+  template <typename T>
+  T read()
+  {
+    T value{};
+    const uint8_t * bytes = take( sizeof( T ) );
+    if( bytes )
+    {
+      memcpy( &value, bytes, sizeof( T ) );
+    }
+    return value;
+  }
+
+  std::string read_string()
+  {
+    uint32_t length       = read<uint32_t>();
+    const uint8_t * chars = take( length );
+    return chars ? std::string( reinterpret_cast<const char *>( chars ), length ) : std::string();
+  }
+
+  void read_code( CodeObject & code )
+  {
+    code.num_locals = read<uint16_t>();
+    code.max_stack  = read<uint16_t>();
+
+    uint32_t num_instructions    = read<uint32_t>();
+    const uint8_t * instructions = take( num_instructions );
+    if( instructions )
+    {
+      code.instructions.assign( instructions, instructions + num_instructions );
+    }
+
+    uint32_t num_names = read<uint32_t>();
+    for( uint32_t i = 0; i < num_names && m_ok; i++ )
+    {
+      code.names.push_back( read_string() );
+    }
+
+    uint32_t num_literals = read<uint32_t>();
+    for( uint32_t i = 0; i < num_literals && m_ok; i++ )
+    {
+      code.literals.push_back( read_literal( code ) );
+    }
+  }
+
+  Object read_literal( CodeObject & parent )
+  {
+    switch( read<uint8_t>() )
+    {
+      case Object::NIL :
+        return Object::Nil();
+      case Object::BOOLEAN :
+        return Object::Boolean( read<uint8_t>() != 0 );
+      case Object::INTEGER :
+        return Object::Integer( read<int32_t>() );
+      case Object::REAL :
+        return Object::Real( read<double>() );
+      case Object::STRING :
+        return Object::String( intern_string( m_gc, read_string().c_str() ) );
+      case Object::FUNCTION :
+        {
+          std::string name    = read_string();
+          uint8_t num_args    = read<uint8_t>();
+          FunctionObject * fn = m_gc.alloc<FunctionObject>( name.c_str(), num_args, &parent );
+          read_code( fn->code_object );
+          if( fn->code_object.num_locals < num_args )
+          {
+            m_ok = false; // the arguments are the first locals
+          }
+          return Object::Function( fn );
+        }
+      case Object::CLASS :
+        {
+          // a damaged count must not allocate more names than the file could hold
+          std::string name = read_string();
+          std::vector<std::string> fields( std::min<size_t>( read<uint32_t>(), remaining() ) );
+          for( std::string & field : fields )
+          {
+            field = read_string();
+          }
+          m_max_fields = std::max( m_max_fields, fields.size() );
+          return Object::Class( m_gc.alloc<ClassObject>( name.c_str(), fields ) );
+        }
+      default :
+        m_ok = false;
+        return Object::Nil();
+    }
+  }
+
+  size_t remaining() const
+  {
+    return m_end - m_pos;
+  }
+
+  // The most fields of any class in the file
+  size_t max_fields() const
+  {
+    return m_max_fields;
+  }
+
+private:
+  const uint8_t * m_pos;
+  const uint8_t * m_end;
+  GarbageCollector & m_gc;
+  bool m_ok           = true;
+  size_t m_max_fields = 0;
+
+  const uint8_t * take( size_t size )
+  {
+    if( !m_ok || remaining() < size )
+    {
+      m_ok = false;
+      return nullptr;
+    }
+    const uint8_t * bytes = m_pos;
+    m_pos += size;
+    return bytes;
+  }
+};
+
+// The VM does not check the operands of the instructions the compiler emits, so code
+// read from a file is checked for everything the compiler guarantees: opcodes that
+// are encoded, whole instructions, operands within the literals, locals, names and
+// fields, jumps to the start of an instruction and a stack height within max_stack.
+// Field slots can only be checked against the largest class of the program.
+static bool is_valid_code( const CodeObject & code, size_t num_names, size_t max_fields )
+{
+  const std::vector<uint8_t> & bytes = code.instructions;
+  std::vector<bool> is_start( bytes.size() + 1, false );
+  std::vector<size_t> targets;
+  int depth  = 0;
+  size_t pos = 0;
+  while( pos < bytes.size() )
+  {
+    is_start[pos] = true;
+    OpCode op     = static_cast<OpCode>( bytes[pos] );
+    if( OP_HALT <= op )
+    {
+      return false; // OP_HALT and the superinstructions only exist decoded
+    }
+
+    uint32_t arg = 0;
+    size_t next  = pos + 1;
+    if( has_operand( op ) )
+    {
+      if( bytes.size() < pos + INSTR_SIZE )
+      {
+        return false;
+      }
+      arg  = ( uint32_t( bytes[pos + 1] ) << 8 ) | uint32_t( bytes[pos + 2] );
+      next = pos + INSTR_SIZE;
+    }
+
+    bool in_range = true;
+    switch( op )
+    {
+      case OP_LOAD_CONST :
+        in_range = arg < code.literals.size();
+        break;
+      case OP_LOAD_GLOBAL :
+      case OP_STORE_GLOBAL :
+      case OP_GET_PROPERTY :
+      case OP_SET_PROPERTY :
+        in_range = arg < num_names;
+        break;
+      case OP_LOAD_LOCAL :
+      case OP_STORE_LOCAL :
+        in_range = arg < code.num_locals;
+        break;
+      case OP_GET_FIELD :
+      case OP_SET_FIELD :
+        in_range = arg < max_fields;
+        break;
+      case OP_JMP :
+      case OP_JMP_IF_FALSE :
+        targets.push_back( next + arg );
+        break;
+      case OP_LOOP :
+        in_range = arg <= next;
+        targets.push_back( next - std::min<size_t>( arg, next ) );
+        break;
+      default :
+        break;
+    }
+
+    depth += stack_effect( op, arg );
+    if( !in_range || depth < 0 || code.max_stack < depth )
+    {
+      return false;
+    }
+    pos = next;
+  }
+
+  is_start[bytes.size()] = true;
+  for( size_t target : targets )
+  {
+    if( bytes.size() < target || !is_start[target] )
+    {
+      return false;
+    }
+  }
+
+  for( const Object & literal : code.literals )
+  {
+    if( literal.is_function() && !is_valid_code( literal.as_function()->code_object, num_names, max_fields ) )
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+// A read only view of a whole file, mapped where mmap is available
+class MappedFile
+{
+public:
+  MappedFile( const std::string & path )
+  {
+#ifndef _WIN32
+    int fd = open( path.c_str(), O_RDONLY );
+    if( fd < 0 )
+    {
+      return;
+    }
+
+    struct stat st;
+    if( fstat( fd, &st ) == 0 && 0 < st.st_size )
+    {
+      void * data = mmap( nullptr, ( size_t ) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+      if( data != MAP_FAILED )
+      {
+        m_data = static_cast<const uint8_t *>( data );
+        m_size = ( size_t ) st.st_size;
+      }
+    }
+    close( fd );
+#else
+    std::ifstream file( path, std::ios::binary );
+    m_buffer.assign( std::istreambuf_iterator<char>( file ), std::istreambuf_iterator<char>() );
+    m_data = reinterpret_cast<const uint8_t *>( m_buffer.data() );
+    m_size = m_buffer.size();
+#endif
+  }
+
+  MappedFile( const MappedFile & )             = delete;
+  MappedFile & operator=( const MappedFile & ) = delete;
+
+  ~MappedFile()
+  {
+#ifndef _WIN32
+    if( m_data )
+    {
+      munmap( const_cast<uint8_t *>( m_data ), m_size );
+    }
+#endif
+  }
+
+  const uint8_t * data() const
+  {
+    return m_data;
+  }
+
+  size_t size() const
+  {
+    return m_size;
+  }
+
+private:
+  const uint8_t * m_data = nullptr;
+  size_t m_size          = 0;
+#ifdef _WIN32
+  std::vector<char> m_buffer;
+#endif
+};
+
+#ifndef _WIN32
+// Writes all bytes, write() may write less than asked for
+static bool write_all( int fd, const void * data, size_t size )
+{
+  const char * bytes = static_cast<const char *>( data );
+  while( 0 < size )
+  {
+    ssize_t written = write( fd, bytes, size );
+    if( written < 0 && errno != EINTR )
+    {
+      return false;
+    }
+    if( 0 < written )
+    {
+      bytes += written;
+      size -= ( size_t ) written;
+    }
+  }
+  return true;
+}
+#endif
+
+// Every writer uses a temporary file of its own, which is renamed to the cache. The
+// rename replaces the file at once, so concurrent runs never see a partly written
+// cache and the last writer wins.
+bool write_cache( const std::string & path, uint64_t key, const CodeObject & code )
+{
+  Writer body;
+  if( !body.write_code( code ) )
+  {
+    return false;
+  }
+
+  CacheHeader header;
+  memcpy( header.magic, MAGIC, sizeof( MAGIC ) );
+  header.version  = CACHE_VERSION;
+  header.key      = key;
+  header.checksum = hash_bytes( body.bytes.data(), body.bytes.size() );
+
+#ifndef _WIN32
+  std::string tmp_path = path + ".XXXXXX";
+  int fd               = mkstemp( tmp_path.data() );
+  if( fd < 0 )
+  {
+    return false;
+  }
+  ( void ) fchmod( fd, 0644 ); // mkstemp makes the file private to its owner
+  bool written = write_all( fd, &header, sizeof( header ) ) && write_all( fd, body.bytes.data(), body.bytes.size() );
+  written      = close( fd ) == 0 && written;
+#else
+  static std::atomic<uint32_t> counter{ 0 };
+  std::string tmp_path = path + "." + std::to_string( _getpid() ) + "." + std::to_string( counter++ ) + ".tmp";
+  bool written         = false;
+  {
+    std::ofstream file( tmp_path, std::ios::binary | std::ios::trunc );
+    file.write( reinterpret_cast<const char *>( &header ), sizeof( header ) );
+    file.write( body.bytes.data(), ( std::streamsize ) body.bytes.size() );
+    written = file.good();
+  }
+#endif
+
+  if( !written || std::rename( tmp_path.c_str(), path.c_str() ) != 0 )
+  {
+    std::remove( tmp_path.c_str() );
+    return false;
+  }
+  return true;
+}
+
+bool read_cache( const std::string & path, uint64_t key, GarbageCollector & gc, CodeObject * code )
+{
+  MappedFile file( path );
+  if( file.size() < sizeof( CacheHeader ) )
+  {
+    return false;
+  }
+
+  CacheHeader header;
+  memcpy( &header, file.data(), sizeof( header ) );
+  const uint8_t * body = file.data() + sizeof( header );
+  size_t body_size     = file.size() - sizeof( header );
+
+  if( memcmp( header.magic, MAGIC, sizeof( MAGIC ) ) != 0 || header.version != CACHE_VERSION || header.key != key ||
+      header.checksum != hash_bytes( reinterpret_cast<const char *>( body ), body_size ) )
+  {
+    return false;
+  }
+
+  Reader reader( body, body_size, gc );
+  reader.read_code( *code );
+  if( !reader.ok() || reader.remaining() != 0 || !is_valid_code( *code, code->names.size(), reader.max_fields() ) )
+  {
+    *code = CodeObject(); // the objects read so far are garbage now
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "bytecode.h"
+#include "gc.h"
+
+#include <cstdint>
+#include <string>
+
+// Compiled programs can be cached on disk, so running an unchanged script skips the
+// lexer, parser, type checker and compiler. A cache file holds the root CodeObject
+// and, through the function literals, every nested one. The header records the
+// format version, the key of the source and a checksum of the rest of the file.
+//
+// The file is mapped into memory while it is read. Literals are fixed up while
+// reading: strings are interned and functions and classes are allocated in the old
+// space of the collector, like the compiler does.
+constexpr uint32_t CACHE_VERSION = 1; // bump when the format or the opcodes change
+
+// Identifies the compiled code of a source, the optimizer changes the code
+uint64_t cache_key( const std::string & src, bool optimized );
+
+// The file name of the cache of a source in a cache directory
+std::string cache_file_name( uint64_t key );
+
+// Returns false if the file could not be written
+bool write_cache( const std::string & path, uint64_t key, const CodeObject & code );
+
+// Returns false if the file does not exist, is damaged or was written for another
+// key or version, code is not changed then. Reads into an empty code object.
+bool read_cache( const std::string & path, uint64_t key, GarbageCollector & gc, CodeObject * code );
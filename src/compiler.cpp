@@ -1,39 +1,35 @@
 #include "compiler.h"
 #include "ast.h"
 
-void compile( AstNode * ast, GarbageCollector & gc, CodeObject * code )
+void compile( AstNode * ast, GarbageCollector & gc, CodeObject * code, AtomTable & atoms )
 {
-  Compiler compiler( gc, code );
+  Compiler compiler( gc, code, atoms );
   ast->compile( compiler );
 }
 
 void Compiler::push_scope()
 {
-  scopes.push_back( {} );
+  scopes.push_scope();
 }
 
 void Compiler::pop_scope()
 {
-  scope_offset -= scopes.back().size();
-  scopes.pop_back();
+  scope_offset -= ( uint16_t ) scopes.scope_size();
+  scopes.pop_scope();
 }
 
-std::pair<uint16_t, bool> Compiler::find_var( const std::string & name )
+std::pair<uint16_t, bool> Compiler::find_var( Atom name )
 {
-  for( auto scope_it = scopes.rbegin(); scope_it != scopes.rend(); scope_it++ )
+  auto * symbol = scopes.find( name );
+  if( symbol )
   {
-    auto it = scope_it->find( name );
-    if( it != scope_it->end() )
-    {
-      bool is_global = scope_it == std::prev( scopes.rend() );
-      return std::make_pair( it->second, is_global );
-    }
+    return std::make_pair( symbol->value, scopes.is_global( symbol ) );
   }
 
   return std::make_pair( UNDEFINED, false );
 }
 
-uint16_t Compiler::define_var( const std::string & name )
+uint16_t Compiler::define_var( Atom name )
 {
   auto [index, is_global] = find_var( name );
 
@@ -43,33 +39,30 @@ uint16_t Compiler::define_var( const std::string & name )
   }
   else
   {
-    if( scopes.size() == 1 )
+    if( scopes.depth() == 1 )
     {
-      auto & scope = scopes.back();
-      uint16_t idx = code->emit_name( name );
-      scope[name]  = idx;
+      uint16_t idx = code->emit_name( atoms.name( name ) );
+      scopes.define( name, idx );
       return idx;
     }
     else
     {
       code->num_locals++;
-      auto & scope    = scopes.back();
       uint16_t offset = scope_offset++;
-      scope[name]     = offset;
+      scopes.define( name, offset );
       return offset;
     }
   }
 }
 
-uint16_t Compiler::define_global_var( const std::string & name )
+uint16_t Compiler::define_global_var( Atom name )
 {
-  auto & global_scope = scopes.front();
-  auto it = global_scope.find(name);
-  if (it != global_scope.end()){
-    return it->second;
+  auto * symbol = scopes.find_global( name );
+  if (symbol){
+    return symbol->value;
   } else {
     CodeObject* root = code->get_root();
-    uint16_t idx = root->emit_name(name);
+    uint16_t idx = root->emit_name(atoms.name(name));
     return idx;
   }
 }
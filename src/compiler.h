@@ -1,9 +1,8 @@
 #pragma once
+#include "atom.h"
 #include "bytecode.h"
 #include "gc.h"
 
-#include <list>
-#include <map>
 
 struct AstNode;
 
@@ -13,23 +12,24 @@ struct Compiler
 {
   GarbageCollector & gc;
   CodeObject * code;
+  AtomTable & atoms;
 
   uint16_t scope_offset;
-  std::list<std::map<std::string, uint16_t>> scopes;
+  ScopeTable<uint16_t> scopes; // the index of every global and local variable
 
-  Compiler( GarbageCollector & gc, CodeObject * code )
+  Compiler( GarbageCollector & gc, CodeObject * code, AtomTable & atoms )
       : gc( gc )
       , code( code )
+      , atoms( atoms )
       , scope_offset( 0 )
   {
-    scopes.push_back( {} ); // global scope
   }
 
   void push_scope();
   void pop_scope();
-  std::pair<uint16_t, bool> find_var( const std::string & name );
-  uint16_t define_var( const std::string & name );
-  uint16_t define_global_var(const std::string& name);
+  std::pair<uint16_t, bool> find_var( Atom name );
+  uint16_t define_var( Atom name );
+  uint16_t define_global_var( Atom name );
 };
 
-void compile( AstNode *, GarbageCollector & gc, CodeObject * );
+void compile( AstNode *, GarbageCollector & gc, CodeObject *, AtomTable & atoms );
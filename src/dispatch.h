@@ -0,0 +1,16 @@
+#pragma once
+
+// Shared by the interpreter loops in vm.cpp and register_vm.cpp
+
+#if defined( BRASS_COMPUTED_GOTO ) && ( defined( __GNUC__ ) || defined( __clang__ ) )
+#define USE_COMPUTED_GOTO 1
+#else
+#define USE_COMPUTED_GOTO 0
+#endif
+
+#define RUNTIME_ERROR( msg )       \
+  do                               \
+  {                                \
+    m_runtime_error_message = msg; \
+    goto label_runtime_error;      \
+  } while( 0 )
@@ -1 +1,294 @@
 #include "gc.h"
+#include <algorithm>
+#include <cassert>
+#include <limits>
+
+void PauseHistogram::record( std::chrono::nanoseconds pause )
+{
+  auto us       = std::chrono::duration_cast<std::chrono::microseconds>( pause ).count();
+  size_t bucket = 0;
+  while( bucket + 1 < NUM_BUCKETS && ( 1ll << bucket ) <= us )
+  {
+    bucket++;
+  }
+  m_buckets[bucket]++;
+  m_count++;
+  m_total += pause;
+  m_max = std::max( m_max, pause );
+}
+
+std::chrono::microseconds PauseHistogram::percentile( double p ) const
+{
+  size_t rank = ( size_t ) ( p / 100.0 * m_count );
+  size_t seen = 0;
+  for( size_t i = 0; i < NUM_BUCKETS; i++ )
+  {
+    seen += m_buckets[i];
+    if( seen > rank || seen == m_count )
+    {
+      return std::chrono::microseconds( 1ll << i );
+    }
+  }
+  return std::chrono::microseconds( 1ll << ( NUM_BUCKETS - 1 ) );
+}
+
+void PauseHistogram::print( std::ostream & os ) const
+{
+  os << "pauses: " << m_count << ", total: " << std::chrono::duration_cast<std::chrono::microseconds>( m_total ).count()
+     << "us, max: " << std::chrono::duration_cast<std::chrono::microseconds>( m_max ).count() << "us, p50 < "
+     << percentile( 50 ).count() << "us, p99 < " << percentile( 99 ).count() << "us\n";
+  for( size_t i = 0; i < NUM_BUCKETS; i++ )
+  {
+    if( m_buckets[i] )
+    {
+      os << "  < " << ( 1ll << i ) << "us: " << m_buckets[i] << "\n";
+    }
+  }
+}
+
+GarbageCollector::~GarbageCollector()
+{
+  for( size_t i = 0; i < m_heap.num_pages(); i++ )
+  {
+    SlabAllocator::Page * page = m_heap.page( i );
+    size_t num_slots           = page ? page->num_slots : 0;
+    for( size_t slot = 0; slot < num_slots; slot++ )
+    {
+      if( page->is_used( slot ) )
+      {
+        free_object( reinterpret_cast<GarbageCollected *>( page->slot( slot ) ) );
+      }
+    }
+  }
+}
+
+void GarbageCollector::add_to_heap( GarbageCollected * object )
+{
+  // while marking new objects are black. While sweeping they are black in the pages the
+  // sweeper did not reach yet, it makes them white again.
+  bool unswept     = m_phase == Phase::SWEEPING && !SlabAllocator::page_of( object )->swept;
+  object->m_marked = m_phase == Phase::MARKING || unswept;
+  m_num_objects++;
+  m_bytes_allocated += object->size();
+  m_allocated_since_slice += object->size();
+}
+
+void GarbageCollector::shade( GarbageCollected * object )
+{
+  // young objects are not part of a major collection, survivors are promoted black
+  if( object && !object->m_marked && !is_young( object ) )
+  {
+    object->mark();
+    m_gray.push_back( object );
+  }
+}
+
+void GarbageCollector::shade_interned()
+{
+  for( auto & [key, object] : m_interned )
+  {
+    shade( object );
+  }
+}
+
+void GarbageCollector::visit( GarbageCollected *& object )
+{
+  if( !object )
+  {
+    return;
+  }
+
+  if( m_minor )
+  {
+    // old objects are not traced by a minor collection
+    if( is_young( object ) )
+    {
+      object = object->m_forward ? object->m_forward : promote( object );
+    }
+  }
+  else
+  {
+    shade( object );
+  }
+}
+
+GarbageCollected * GarbageCollector::promote( GarbageCollected * object )
+{
+  void * memory           = m_heap.alloc( object->size() );
+  GarbageCollected * copy = object->copy_to( memory );
+  assert( copy && "object type can not be allocated in the nursery" );
+
+  object->m_forward = copy;
+  add_to_heap( copy );
+  m_promoted.push_back( copy );
+  return copy;
+}
+
+void GarbageCollector::begin_minor()
+{
+  m_minor       = true;
+  m_minor_start = Clock::now();
+}
+
+void GarbageCollector::collect_minor()
+{
+  assert( m_minor );
+  for( GarbageCollected * object : m_remembered )
+  {
+    object->m_remembered = false;
+    object->trace( *this );
+  }
+  m_remembered.clear();
+
+  // promoted objects may refer to other young objects
+  while( !m_promoted.empty() )
+  {
+    GarbageCollected * object = m_promoted.back();
+    m_promoted.pop_back();
+    object->trace( *this );
+  }
+
+  // everything left in the nursery is garbage and owns no other memory
+  m_nursery.reset();
+  m_nursery_full = false;
+  m_minor        = false;
+  m_minor_pauses.record( Clock::now() - m_minor_start );
+}
+
+void GarbageCollector::begin_major()
+{
+  assert( m_phase == Phase::IDLE && m_nursery.used() == 0 );
+  m_phase         = Phase::MARKING;
+  m_pause_start   = Clock::now();
+  m_pause_started = true;
+  shade_interned();
+}
+
+bool GarbageCollector::step()
+{
+  return run( m_options.work_budget, m_options.time_budget );
+}
+
+void GarbageCollector::collect()
+{
+  assert( !m_minor && m_nursery.used() == 0 );
+  if( m_phase == Phase::IDLE )
+  {
+    m_phase = Phase::MARKING;
+    shade_interned();
+  }
+  run( std::numeric_limits<size_t>::max(), std::chrono::microseconds( 0 ) );
+}
+
+bool GarbageCollector::run( size_t work_budget, std::chrono::microseconds time_budget )
+{
+  if( !m_pause_started )
+  {
+    m_pause_start = Clock::now();
+  }
+
+  // reading the clock is not free, so the time budget is only checked now and then
+  size_t work    = 0;
+  auto in_budget = [&]()
+  {
+    if( work_budget <= work )
+    {
+      return false;
+    }
+    if( time_budget.count() == 0 || work % 64 != 0 )
+    {
+      return true;
+    }
+    return Clock::now() - m_pause_start < time_budget;
+  };
+
+  if( m_phase == Phase::MARKING )
+  {
+    while( !m_gray.empty() && in_budget() )
+    {
+      GarbageCollected * object = m_gray.back();
+      m_gray.pop_back();
+      object->trace( *this );
+      work++;
+    }
+    if( m_gray.empty() )
+    {
+      m_phase = Phase::SWEEPING;
+      m_sweep = 0;
+      for( size_t i = 0; i < m_heap.num_pages(); i++ )
+      {
+        if( SlabAllocator::Page * page = m_heap.page( i ) )
+        {
+          page->swept = false;
+        }
+      }
+    }
+  }
+
+  // pages are swept as a whole. Pages created while sweeping count as swept, the
+  // objects in them are white already and must not be freed.
+  if( m_phase == Phase::SWEEPING )
+  {
+    while( m_sweep < m_heap.num_pages() && in_budget() )
+    {
+      SlabAllocator::Page * page = m_heap.page( m_sweep );
+      if( page && !page->swept )
+      {
+        work += sweep_page( page );
+      }
+      m_sweep++;
+    }
+    if( m_sweep == m_heap.num_pages() )
+    {
+      m_heap.compact();
+      m_phase     = Phase::IDLE;
+      m_threshold = std::max( m_options.threshold, m_bytes_allocated * GROWTH_FACTOR );
+    }
+  }
+
+  m_major_pauses.record( Clock::now() - m_pause_start );
+  m_pause_started         = false;
+  m_allocated_since_slice = 0;
+  return m_phase == Phase::IDLE;
+}
+
+// Returns the number of objects in the page
+size_t GarbageCollector::sweep_page( SlabAllocator::Page * page )
+{
+  // freeing the object of a large page releases the page, so nothing is read after that
+  page->swept        = true;
+  size_t num_objects = page->num_used;
+  size_t num_slots   = page->num_slots;
+  for( size_t slot = 0; slot < num_slots; slot++ )
+  {
+    if( !page->is_used( slot ) )
+    {
+      continue;
+    }
+
+    GarbageCollected * object = reinterpret_cast<GarbageCollected *>( page->slot( slot ) );
+    if( object->m_marked )
+    {
+      object->m_marked = false;
+    }
+    else
+    {
+      m_bytes_allocated -= object->size();
+      free_object( object );
+    }
+  }
+  return std::max<size_t>( num_objects, 1 );
+}
+
+void GarbageCollector::free_object( GarbageCollected * object )
+{
+  // an incremental sweep can free a garbage object that is still remembered
+  if( object->m_remembered )
+  {
+    m_remembered.erase( std::find( m_remembered.begin(), m_remembered.end(), object ) );
+  }
+  void * memory = dynamic_cast<void *>( object );
+  object->~GarbageCollected();
+  m_heap.free( memory );
+  m_num_objects--;
+}
@@ -1,12 +1,27 @@
 #pragma once
 
-#include <list>
+#include "allocator.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <new>
+#include <ostream>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class GarbageCollector;
 
 class GarbageCollected
 {
 public:
   GarbageCollected()
       : m_marked( false )
+      , m_remembered( false )
+      , m_forward( nullptr )
   {
   }
 
@@ -19,33 +34,316 @@ public:
     m_marked = true;
   }
 
+  // Report every object referenced by this object to the collector
+  virtual void trace( GarbageCollector & )
+  {
+  }
+
+  // Number of bytes owned by this object, used to decide when to collect
+  virtual size_t size() const
+  {
+    return sizeof( *this );
+  }
+
+  // Copy the object into memory of size() bytes, only needed for types that are
+  // allocated in the nursery. Those must not own memory outside of the object.
+  virtual GarbageCollected * copy_to( void * ) const
+  {
+    return nullptr;
+  }
+
+  // Number of bytes alloc() reserves for an object, types with an inline payload
+  // hide this with their own overload.
+  template <typename... Args>
+  static size_t allocation_size( const Args &... )
+  {
+    return 0;
+  }
+
+  bool is_marked() const
+  {
+    return m_marked;
+  }
+
 protected:
   bool m_marked;
+  bool m_remembered;
+  GarbageCollected * m_forward; // address in the old space after a minor collection
+
+  friend class GarbageCollector;
+};
+
+struct GCOptions
+{
+  size_t threshold   = 1024 * 1024; // bytes in the old space that start a major collection
+  size_t nursery     = 256 * 1024;  // size of the nursery in bytes
+  bool incremental   = false;       // spread major collections over many slices
+  size_t work_budget = 1024;        // objects traced or swept per slice
+  std::chrono::microseconds time_budget{ 0 }; // time limit of a slice, 0 for none
+};
+
+// Pause times in power of two buckets, bucket i counts pauses below 2^i microseconds
+class PauseHistogram
+{
+public:
+  static constexpr size_t NUM_BUCKETS = 24;
+
+  void record( std::chrono::nanoseconds );
+
+  // Upper bound of the bucket that contains the pause at percentile p (0-100)
+  std::chrono::microseconds percentile( double p ) const;
+
+  void print( std::ostream & ) const;
+
+  size_t count() const
+  {
+    return m_count;
+  }
+
+  size_t bucket( size_t i ) const
+  {
+    return m_buckets[i];
+  }
+
+  std::chrono::nanoseconds max() const
+  {
+    return m_max;
+  }
+
+  std::chrono::nanoseconds total() const
+  {
+    return m_total;
+  }
+
+private:
+  size_t m_buckets[NUM_BUCKETS] = {};
+  size_t m_count                = 0;
+  std::chrono::nanoseconds m_max{ 0 };
+  std::chrono::nanoseconds m_total{ 0 };
 };
 
+// Generational garbage collector. New objects are bump allocated in the nursery,
+// a minor collection copies the survivors into the old space which is collected
+// by mark and sweep.
+//
+// In incremental mode a major collection is done in slices of limited work, with
+// tri-color marking: white objects are unmarked, gray ones are marked and wait in
+// the worklist, black ones are marked and traced. The roots are marked gray when a
+// cycle starts (a snapshot), after that the write barrier shades the old value of
+// every overwritten field, so no object reachable from the snapshot is missed.
+// Objects allocated or promoted while marking are black.
+//
+// The collector does not know the roots, the owner of the roots (the VirtualMachine)
+// marks them and then calls collect_minor() or collect(). That only happens at safe
+// points of the VM, so objects that are only referenced from the parser or compiler
+// are never freed while they are still in use. Old objects that get a reference to a
+// young object have to be remembered, see write_barrier().
 class GarbageCollector
 {
 public:
+  static constexpr size_t GROWTH_FACTOR    = 2;
+  static constexpr size_t SLICE_ALLOCATION = 64 * 1024; // bytes allocated between two slices
+
+  // Allocate in the old space
   template <typename T, typename... Args>
   T * alloc( Args &&... args )
   {
-    T * object = new T( std::forward<Args>( args )... );
-    m_heap.push_back( object );
+    size_t bytes  = std::max( sizeof( T ), T::allocation_size( args... ) );
+    void * memory = m_heap.alloc( bytes );
+    T * object    = new( memory ) T( std::forward<Args>( args )... );
+    add_to_heap( object );
     return object;
   }
 
-  GarbageCollector()
+  // Allocate in the nursery, falls back to the old space when the nursery is full
+  template <typename T, typename... Args>
+  T * alloc_young( Args &&... args )
+  {
+    size_t bytes  = std::max( sizeof( T ), T::allocation_size( args... ) );
+    void * memory = m_nursery.try_alloc( bytes, alignof( T ) );
+    if( !memory )
+    {
+      m_nursery_full = true;
+      return alloc<T>( std::forward<Args>( args )... );
+    }
+    m_allocated_since_slice += bytes;
+    return new( memory ) T( std::forward<Args>( args )... );
+  }
+
+  GarbageCollector( GCOptions options = {} )
+      : m_options( options )
+      , m_nursery( options.nursery )
+      , m_bytes_allocated( 0 )
+      , m_threshold( options.threshold )
+  {
+  }
+
+  ~GarbageCollector();
+
+  // Checked at the safe points of the VM
+  bool should_collect() const
+  {
+    if( m_phase != Phase::IDLE )
+    {
+      return m_nursery_full || SLICE_ALLOCATION <= m_allocated_since_slice;
+    }
+    return m_nursery_full || m_threshold <= m_bytes_allocated;
+  }
+
+  // True if a major collection has to be started or continued
+  bool should_collect_major() const
+  {
+    return m_phase != Phase::IDLE || m_threshold <= m_bytes_allocated;
+  }
+
+  bool is_incremental() const
   {
+    return m_options.incremental;
   }
 
-  ~GarbageCollector()
+  // True while an incremental major collection is in progress
+  bool is_collecting() const
   {
-    for( GarbageCollected * gc_obj : m_heap )
+    return m_phase != Phase::IDLE;
+  }
+
+  bool is_young( const GarbageCollected * object ) const
+  {
+    return m_nursery.contains( object );
+  }
+
+  // Has to be called when an old object that owns memory outside of the heap grows,
+  // size() of the object includes the new bytes from then on
+  void grow( size_t bytes )
+  {
+    m_bytes_allocated += bytes;
+    m_allocated_since_slice += bytes;
+  }
+
+  // Has to be called when a reference to value is stored in owner, overwriting old_value
+  void write_barrier( GarbageCollected * owner, GarbageCollected * old_value, const GarbageCollected * value )
+  {
+    if( m_phase == Phase::MARKING )
+    {
+      shade( old_value );
+    }
+    if( is_young( value ) && !owner->m_remembered && !is_young( owner ) )
     {
-      delete gc_obj;
+      owner->m_remembered = true;
+      m_remembered.push_back( owner );
     }
   }
 
+  // Mark a reference as reachable, its references are traced by the next collection.
+  // During a minor collection a young object is copied to the old space instead and
+  // the reference is updated to its new address.
+  template <typename T>
+  void mark( T *& ref )
+  {
+    GarbageCollected * object = ref;
+    visit( object );
+    ref = static_cast<T *>( object );
+  }
+
+  // Start a minor collection, the roots that may refer to young objects are marked next
+  void begin_minor();
+
+  // Copy the young objects reachable from the marked roots and remembered objects to
+  // the old space and empty the nursery
+  void collect_minor();
+
+  // Start a major collection, the roots are marked next. The nursery has to be empty.
+  void begin_major();
+
+  // Do one slice of work of the current major collection, returns true when it is done
+  bool step();
+
+  // Trace all objects reachable from the marked ones and free the rest of the old space,
+  // finishes the current major collection at once. The nursery has to be empty.
+  void collect();
+
+  const PauseHistogram & minor_pauses() const
+  {
+    return m_minor_pauses;
+  }
+
+  const PauseHistogram & major_pauses() const
+  {
+    return m_major_pauses;
+  }
+
+  size_t num_objects() const
+  {
+    return m_num_objects;
+  }
+
+  size_t bytes_allocated() const
+  {
+    return m_bytes_allocated;
+  }
+
+  size_t nursery_used() const
+  {
+    return m_nursery.used();
+  }
+
+  // Objects with a unique key, like interned strings. The key has to point into the
+  // object. They have to be allocated in the old space and are roots of every major
+  // collection, so they are never freed.
+  GarbageCollected * find_interned( std::string_view key ) const
+  {
+    auto it = m_interned.find( key );
+    return it != m_interned.end() ? it->second : nullptr;
+  }
+
+  void add_interned( std::string_view key, GarbageCollected * object )
+  {
+    assert( !is_young( object ) );
+    m_interned.emplace( key, object );
+  }
+
+  size_t num_interned() const
+  {
+    return m_interned.size();
+  }
+
 private:
-  std::list<GarbageCollected *> m_heap;
+  using Clock = std::chrono::steady_clock;
+
+  enum class Phase
+  {
+    IDLE,
+    MARKING,
+    SWEEPING,
+  };
+
+  GCOptions m_options;
+  ArenaAllocator m_nursery;
+  bool m_nursery_full = false;
+  bool m_minor        = false;
+  Phase m_phase       = Phase::IDLE;
+  SlabAllocator m_heap; // the old space
+  size_t m_num_objects = 0;
+  size_t m_sweep       = 0; // next page to sweep
+  std::vector<GarbageCollected *> m_gray;     // marked, not yet traced
+  std::vector<GarbageCollected *> m_promoted; // copied by the current minor collection, not yet traced
+  std::vector<GarbageCollected *> m_remembered;
+  std::unordered_map<std::string_view, GarbageCollected *> m_interned;
+  size_t m_bytes_allocated;
+  size_t m_threshold;
+  size_t m_allocated_since_slice = 0;
+  Clock::time_point m_minor_start;
+  Clock::time_point m_pause_start;
+  bool m_pause_started = false;
+  PauseHistogram m_minor_pauses;
+  PauseHistogram m_major_pauses;
+
+  void add_to_heap( GarbageCollected * );
+  void shade( GarbageCollected * );
+  void shade_interned();
+  void visit( GarbageCollected *& );
+  GarbageCollected * promote( GarbageCollected * );
+  void free_object( GarbageCollected * );
+  size_t sweep_page( SlabAllocator::Page * );
+  bool run( size_t work_budget, std::chrono::microseconds time_budget );
 };
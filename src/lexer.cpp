@@ -2,64 +2,242 @@
 #include <algorithm>
 #include <cassert>
 #include <iostream>
-#include <map>
 
-std::string Token::to_string() const
+Token TokenList::operator[]( size_t i ) const
 {
-  return "TOKEN(" + std::to_string( type ) + " '" + lexeme + "')";
+  if( i >= m_types.size() )
+  {
+    return { END_OF_INPUT, ( uint32_t ) m_source.size(), 0, m_lines.empty() ? 1 : m_lines.back(), 0 };
+  }
+  return { m_types[i], m_offsets[i], m_lengths[i], m_lines[i], m_atoms[i] };
+}
+
+std::string_view TokenList::lexeme( size_t i ) const
+{
+  return i < m_types.size() ? m_source.substr( m_offsets[i], m_lengths[i] ) : std::string_view();
+}
+
+std::string TokenList::to_string( size_t i ) const
+{
+  return "TOKEN(" + std::to_string( type( i ) ) + " '" + std::string( lexeme( i ) ) + "')";
 }
 
-Lexer::Lexer( const std::string & src )
+void TokenList::push( const Token & token )
+{
+  m_types.push_back( token.type );
+  m_offsets.push_back( token.offset );
+  m_lengths.push_back( token.length );
+  m_lines.push_back( token.line );
+  m_atoms.push_back( token.atom );
+}
+
+Lexer::Lexer( std::string_view src, AtomTable & atoms )
     : m_source( src )
-    , m_pos( m_source.begin() )
+    , m_atoms( atoms )
+    , m_pos( src.data() )
+    , m_end( src.data() + src.size() )
 {
-  run();
 }
 
-std::vector<Token> Lexer::tokens() const
+Token Lexer::peek( size_t ahead )
 {
-  return m_tokens;
+  assert( ahead + 1 < RING_SIZE );
+  while( m_scanned <= m_consumed + ahead )
+  {
+    m_ring[m_scanned++ % RING_SIZE] = scan();
+  }
+  return m_ring[( m_consumed + ahead ) % RING_SIZE];
 }
 
-bool Lexer::is_finished() const
+Token Lexer::next()
 {
-  return m_pos == m_source.end();
+  Token token = peek();
+  m_consumed++;
+  return token;
 }
 
-// TODO: handle comments
-// TODO: keep track of lines + columns for error messages
-void Lexer::skip_whitespace()
+Token Lexer::previous() const
+{
+  assert( m_consumed > 0 );
+  return m_ring[( m_consumed - 1 ) % RING_SIZE];
+}
+
+bool Lexer::is_finished()
+{
+  return peek().type == END_OF_INPUT;
+}
+
+bool Lexer::at_end() const
+{
+  return m_pos == m_end;
+}
+
+// The classes of the characters, a character is in a class if its bit is set
+enum CharClass : uint8_t
+{
+  CC_DIGIT = 1,
+  CC_ALPHA = 2, // letters and the underscore
+  CC_SPACE = 4,
+  CC_IDENT = CC_DIGIT | CC_ALPHA,
+};
+
+struct CharTable
+{
+  uint8_t classes[256];
+};
+
+static constexpr CharTable make_char_table()
+{
+  CharTable table{};
+  for( int c = 0; c < 256; c++ )
+  {
+    bool alpha        = ( 'a' <= c && c <= 'z' ) || ( 'A' <= c && c <= 'Z' ) || c == '_';
+    bool space        = c == ' ' || ( '\t' <= c && c <= '\r' );
+    table.classes[c] = ( '0' <= c && c <= '9' ? CC_DIGIT : 0 ) | ( alpha ? CC_ALPHA : 0 ) | ( space ? CC_SPACE : 0 );
+  }
+  return table;
+}
+
+static constexpr CharTable CHAR_TABLE = make_char_table();
+
+static bool is_class( char c, uint8_t cls )
+{
+  return CHAR_TABLE.classes[( unsigned char ) c] & cls;
+}
+
+#ifdef BRASS_SSE2
+// Bit i is set if byte i of the chunk lies in [lo, hi]
+static uint32_t match_range( __m128i chunk, char lo, char hi )
+{
+  __m128i offset = _mm_sub_epi8( chunk, _mm_set1_epi8( lo ) );
+  __m128i in     = _mm_cmpeq_epi8( _mm_min_epu8( offset, _mm_set1_epi8( ( char ) ( hi - lo ) ) ), offset );
+  return ( uint32_t ) _mm_movemask_epi8( in );
+}
+
+static uint32_t match_byte( __m128i chunk, char c )
+{
+  return ( uint32_t ) _mm_movemask_epi8( _mm_cmpeq_epi8( chunk, _mm_set1_epi8( c ) ) );
+}
+
+static uint32_t match_class( __m128i chunk, uint8_t cls )
+{
+  uint32_t mask = 0;
+  if( cls & CC_DIGIT )
+  {
+    mask |= match_range( chunk, '0', '9' );
+  }
+  if( cls & CC_ALPHA )
+  {
+    mask |= match_range( _mm_or_si128( chunk, _mm_set1_epi8( 0x20 ) ), 'a', 'z' ) | match_byte( chunk, '_' );
+  }
+  if( cls & CC_SPACE )
+  {
+    mask |= match_range( chunk, '\t', '\r' ) | match_byte( chunk, ' ' );
+  }
+  return mask;
+}
+#endif
+
+// Skips the characters of a class, 16 at a time while they fit before the end. The
+// newlines skipped are added to lines.
+static const char * skip_class( const char * p, const char * end, uint8_t cls, uint32_t & lines )
+{
+#ifdef BRASS_SSE2
+  while( end - p >= 16 )
+  {
+    __m128i chunk = _mm_loadu_si128( reinterpret_cast<const __m128i *>( p ) );
+    uint32_t rest = ~match_class( chunk, cls ) & 0xffff;
+    size_t n      = rest ? lowest_bit( rest ) : 16;
+    if( cls & CC_SPACE )
+    {
+      lines += ( uint32_t ) count_bits( match_byte( chunk, '\n' ) & ( ( 1u << n ) - 1 ) );
+    }
+    p += n;
+    if( rest )
+    {
+      return p;
+    }
+  }
+#endif
+  while( p != end && is_class( *p, cls ) )
+  {
+    lines += *p == '\n';
+    p++;
+  }
+  return p;
+}
+
+// Finds the closing quote of a string, the characters after backslashes are
+// skipped. Returns end if the string is not terminated.
+static const char * find_string_end( const char * p, const char * end, uint32_t & lines )
 {
-  while( is_finished() == false )
+  while( p != end )
   {
-    if( isspace( peek() ) )
+#ifdef BRASS_SSE2
+    if( end - p >= 16 )
     {
-      ( void ) next();
+      __m128i chunk    = _mm_loadu_si128( reinterpret_cast<const __m128i *>( p ) );
+      uint32_t special = match_byte( chunk, '"' ) | match_byte( chunk, '\\' );
+      uint32_t newline = match_byte( chunk, '\n' );
+      if( !special )
+      {
+        lines += ( uint32_t ) count_bits( newline );
+        p += 16;
+        continue;
+      }
+      size_t n = lowest_bit( special );
+      lines += ( uint32_t ) count_bits( newline & ( ( 1u << n ) - 1 ) );
+      p += n;
     }
     else
+#endif
+    {
+      while( p != end && *p != '"' && *p != '\\' )
+      {
+        lines += *p++ == '\n';
+      }
+      if( p == end )
+      {
+        return end;
+      }
+    }
+
+    if( *p == '"' )
+    {
+      return p;
+    }
+    if( ++p == end ) // a backslash at the end
     {
-      break;
+      return end;
     }
+    lines += *p++ == '\n';
   }
+  return end;
+}
+
+// TODO: handle comments
+void Lexer::skip_whitespace()
+{
+  m_pos = skip_class( m_pos, m_end, CC_SPACE, m_line );
 }
 
-char Lexer::next()
+char Lexer::next_char()
 {
-  if( is_finished() )
+  if( at_end() )
     return '\0';
   return *( m_pos++ );
 }
 
-char Lexer::peek() const
+char Lexer::peek_char() const
 {
-  if( is_finished() )
+  if( at_end() )
     return '\0';
   return *( m_pos );
 }
 
-char Lexer::peek_next() const
+char Lexer::peek_next_char() const
 {
-  if( ( m_pos + 1 ) != m_source.end() )
+  if( m_pos != m_end && ( m_pos + 1 ) != m_end )
   {
     return *( m_pos + 1 );
   }
@@ -71,9 +249,9 @@ char Lexer::peek_next() const
 
 bool Lexer::match_next( char c )
 {
-  if( peek() == c )
+  if( peek_char() == c )
   {
-    ( void ) next();
+    ( void ) next_char();
     return true;
   }
   else
@@ -82,191 +260,218 @@ bool Lexer::match_next( char c )
   }
 }
 
-void Lexer::push_token( const Token & token )
+// The token spans from start to the current position
+Token Lexer::make_token( TokenType type, const char * start ) const
 {
-  m_tokens.push_back( token );
+  return { type, ( uint32_t ) ( start - m_source.data() ), ( uint32_t ) ( m_pos - start ), m_line, 0 };
 }
 
-bool Lexer::is_identifier( char c )
+Token Lexer::handle_number( const char * start )
 {
-  return isalnum( c ) || c == '_';
-}
+  uint32_t lines = 0;
+  m_pos          = skip_class( m_pos, m_end, CC_DIGIT, lines );
 
-bool Lexer::is_numeric( char c )
-{
-  return isdigit( c );
+  if( peek_char() == '.' && is_class( peek_next_char(), CC_DIGIT ) )
+  {
+    m_pos = skip_class( m_pos + 1, m_end, CC_DIGIT, lines );
+  }
+
+  return make_token( NUMBER, start );
 }
 
-void Lexer::handle_number()
+Token Lexer::handle_string()
 {
-  auto start = m_pos - 1;
-
-  while( std::isdigit( peek() ) )
+  uint32_t lines   = 0;
+  const char * end = find_string_end( m_pos, m_end, lines );
+  if( end == m_end )
   {
-    next();
+    std::cerr << "Expected \" at end of string" << std::endl;
+    m_pos = m_end;
+    return make_token( END_OF_INPUT, m_end );
   }
 
-  if( peek() == '.' && std::isdigit( peek_next() ) )
-  {
-    next();
-  }
+  Token token = { STRING, ( uint32_t ) ( m_pos - m_source.data() ), ( uint32_t ) ( end - m_pos ), m_line, 0 };
+  m_line += lines;
+  m_pos = end + 1;
+  return token;
+}
 
-  while( std::isdigit( peek() ) )
-  {
-    next();
-  }
+struct Keyword
+{
+  std::string_view name;
+  TokenType type;
+};
+
+static constexpr Keyword KEYWORDS[] = {
+    // clang-format off
+    { "fn", KW_FN },
+    { "if", KW_IF },
+    { "else", KW_ELSE },
+    { "for", KW_FOR },
+    { "while", KW_WHILE },
+    { "return", KW_RETURN },
+    { "print", KW_PRINT },
+    { "println", KW_PRINTLN },
+    { "var", KW_VAR },
+    { "class", KW_CLASS },
+    // clang-format on
+};
 
-  auto end = m_pos;
-  std::string number( start, end );
+constexpr size_t KEYWORD_SLOTS = 32;
 
-  push_token( Token( NUMBER, number ) );
+// A perfect hash of the keywords, checked when compiling
+static constexpr size_t keyword_hash( std::string_view name )
+{
+  return ( ( unsigned char ) name.front() + 5 * ( unsigned char ) name.back() + name.size() ) % KEYWORD_SLOTS;
 }
 
-void Lexer::handle_string()
+struct KeywordTable
 {
-  auto end = std::find( m_pos, m_source.cend(), '"' );
+  Keyword slots[KEYWORD_SLOTS];
+  bool perfect;
+};
 
-  if( end == m_source.cend() )
+static constexpr KeywordTable make_keyword_table()
+{
+  KeywordTable table{ {}, true };
+  for( const Keyword & keyword : KEYWORDS )
   {
-    std::cerr << "Expected \" at end of string" << std::endl;
-    assert( false );
+    Keyword & slot = table.slots[keyword_hash( keyword.name )];
+    table.perfect  = table.perfect && slot.name.empty();
+    slot           = keyword;
   }
+  return table;
+}
 
-  std::string str( m_pos, end );
+static constexpr KeywordTable KEYWORD_TABLE = make_keyword_table();
+static_assert( KEYWORD_TABLE.perfect, "two keywords have the same hash" );
 
-// un-escape newline literals
-#if 0
-  std::string::size_type pos = 0;
-  while( ( pos = str.find( "\\n", pos ) ) != std::string::npos )
+Token Lexer::handle_identifier( const char * start )
+{
+  uint32_t lines = 0;
+  m_pos          = skip_class( m_pos, m_end, CC_IDENT, lines );
+
+  std::string_view name   = std::string_view( start, m_pos - start );
+  const Keyword & keyword = KEYWORD_TABLE.slots[keyword_hash( name )];
+  if( keyword.name == name )
   {
-    str.replace( pos, 2, "\n" );
-    ++pos;
+    return make_token( keyword.type, start );
   }
-#endif
 
-  push_token( Token( STRING, str ) );
-  m_pos = end + 1;
+  Token token = make_token( IDENTIFIER, start );
+  token.atom  = m_atoms.intern( name );
+  return token;
 }
 
-void Lexer::handle_identifier()
-{
-  static const std::map<std::string, TokenType> keywords = {
-      // clang-format off
-      { "fn", KW_FN },
-      { "if", KW_IF },
-      { "else", KW_ELSE },
-      { "for", KW_FOR },
-      { "while", KW_WHILE },
-      { "return", KW_RETURN },
-      { "print", KW_PRINT },
-      { "println", KW_PRINTLN },
-      { "var", KW_VAR },
-      { "class", KW_CLASS },
-      // clang-format on
-  };
-
-  auto start = m_pos - 1;
-
-  while( is_identifier( peek() ) )
+// Scans a single token, after the last token or an error only END_OF_INPUT follows
+Token Lexer::scan()
+{
+  skip_whitespace();
+  if( at_end() )
   {
-    next();
+    return make_token( END_OF_INPUT, m_end );
   }
 
-  auto end = m_pos;
-
-  std::string identifier( start, end );
-
-  auto it = keywords.find( identifier );
-  if( it != keywords.end() )
-  {
-    push_token( Token( it->second, it->first ) );
-  }
-  else
+  const char * start = m_pos;
+  char c             = next_char();
+  switch( c )
   {
-    push_token( Token( IDENTIFIER, identifier ) );
+    case ';' :
+      return make_token( SEMICOLON, start );
+    case ',' :
+      return make_token( COMMA, start );
+    case '(' :
+      return make_token( LPAREN, start );
+    case ')' :
+      return make_token( RPAREN, start );
+    case '{' :
+      return make_token( LBRACE, start );
+    case '}' :
+      return make_token( RBRACE, start );
+    case '[' :
+      return make_token( LBRACKET, start );
+    case ']' :
+      return make_token( RBRACKET, start );
+    case '~' :
+      return make_token( TILDE, start );
+    case '.' :
+      return make_token( DOT, start );
+    case ':' :
+      return make_token( COLON, start );
+    case '*' :
+      return make_token( STAR, start );
+    case '/' :
+      return make_token( SLASH, start );
+    case '+' :
+      return make_token( match_next( '+' ) ? PLUS_PLUS : PLUS, start );
+    case '-' :
+      return make_token( match_next( '-' ) ? MINUS_MINUS : MINUS, start );
+    case '=' :
+      return make_token( match_next( '=' ) ? EQUAL_EQUAL : EQUAL, start );
+    case '\"' :
+      return handle_string();
+    default :
+      if( is_class( c, CC_DIGIT ) )
+      {
+        return handle_number( start );
+      }
+      else if( is_class( c, CC_ALPHA ) )
+      {
+        return handle_identifier( start );
+      }
+      std::cerr << "Unhandled character: '" << c << "'" << std::endl;
+      m_pos = m_end;
+      return make_token( END_OF_INPUT, m_end );
   }
-};
+}
 
-void Lexer::run()
+// The lexeme is decoded in a single pass
+std::string unescape( std::string_view lexeme )
 {
-  bool error = false;
-  while( !is_finished() && !error )
+  std::string str;
+  str.reserve( lexeme.size() );
+  for( size_t i = 0; i < lexeme.size(); i++ )
   {
-    skip_whitespace();
-    char c = next();
-    switch( c )
+    char c = lexeme[i];
+    if( c != '\\' || i + 1 == lexeme.size() )
     {
-      case '\0' :
-        break;
-      case ';' :
-        push_token( Token( SEMICOLON, c ) );
-        break;
-      case ',' :
-        push_token( Token( COMMA, c ) );
-        break;
-      case '(' :
-        push_token( Token( LPAREN, c ) );
-        break;
-      case ')' :
-        push_token( Token( RPAREN, c ) );
-        break;
-      case '{' :
-        push_token( Token( LBRACE, c ) );
-        break;
-      case '}' :
-        push_token( Token( RBRACE, c ) );
-        break;
-      case '~' :
-        push_token( Token( TILDE, c ) );
-        break;
-      case '.' :
-        push_token( Token( DOT, c ) );
-        break;
-      case ':' :
-        push_token( Token( COLON, c ) );
-        break;
-      case '*' :
-        push_token( Token( STAR, c ) );
+      str += c;
+      continue;
+    }
+
+    switch( lexeme[++i] )
+    {
+      case 'n' :
+        str += '\n';
         break;
-      case '/' :
-        push_token( Token( SLASH, c ) );
+      case 't' :
+        str += '\t';
         break;
-      case '+' :
-        push_token( match_next( '+' ) ? Token( PLUS_PLUS, "++" ) : Token( PLUS, c ) );
+      case 'r' :
+        str += '\r';
         break;
-      case '-' :
-        push_token( match_next( '-' ) ? Token( MINUS_MINUS, "--" ) : Token( MINUS, c ) );
+      case '"' :
+        str += '"';
         break;
-      case '=' :
-        push_token( match_next( '=' ) ? Token( EQUAL_EQUAL, "==" ) : Token( EQUAL, c ) );
+      case '\\' :
+        str += '\\';
         break;
-      case '\"' :
-        {
-          handle_string();
-          break;
-        }
       default :
-        {
-          if( is_numeric( c ) )
-          {
-            handle_number();
-          }
-          else if( is_identifier( c ) )
-          {
-            handle_identifier();
-          }
-          else
-          {
-            std::cerr << "Unhandled character: '" << c << "'" << std::endl;
-            error = true;
-          }
-        }
+        str += '\\';
+        str += lexeme[i];
+        break;
     }
   }
+  return str;
 }
 
-std::vector<Token> lex( const std::string & src )
+TokenList lex( std::string_view src, AtomTable & atoms )
 {
-  Lexer lexer( src );
-  return lexer.tokens();
+  TokenList tokens( src );
+  Lexer lexer( src, atoms );
+  while( !lexer.is_finished() )
+  {
+    tokens.push( lexer.next() );
+  }
+  return tokens;
 }
@@ -1,15 +1,20 @@
 #pragma once
 
+#include "atom.h"
 #include "utils.h"
+#include <cstdint>
 #include <string>
+#include <string_view>
 #include <vector>
 
-enum TokenType : uint
+enum TokenType : uint8_t
 {
   LPAREN,
   RPAREN,
   LBRACE,
   RBRACE,
+  LBRACKET,
+  RBRACKET,
   SEMICOLON,
   COMMA,
   TILDE,
@@ -39,52 +44,116 @@ enum TokenType : uint
   STRING,
 
   IDENTIFIER,
+
+  END_OF_INPUT, // returned when reading past the last token
 };
 
+// A token does not own its text, it is a range of the source it was read from. The
+// lexeme of a string literal is the text between the quotes, escape sequences are
+// decoded by the parser.
 struct Token
 {
-  const TokenType type;
-  const std::string lexeme;
+  TokenType type;
+  uint32_t offset;
+  uint32_t length;
+  uint32_t line;
+  Atom atom; // of an identifier, 0 for other tokens
+};
+
+// The tokens of a source, each field is stored in its own array. The source is not
+// copied, it has to outlive the token list.
+class TokenList
+{
+public:
+  TokenList( std::string_view source )
+      : m_source( source )
+  {
+  }
+
+  size_t size() const
+  {
+    return m_types.size();
+  }
 
-  Token( TokenType tt, const std::string & lx )
-      : type( tt )
-      , lexeme( lx )
+  bool empty() const
   {
+    return m_types.empty();
   }
 
-  Token( TokenType tt, char c )
-      : type( tt )
-      , lexeme( std::string( 1, c ) )
+  TokenType type( size_t i ) const
   {
+    return i < m_types.size() ? m_types[i] : END_OF_INPUT;
   }
 
-  std::string to_string() const;
+  Token operator[]( size_t i ) const;
+  std::string_view lexeme( size_t i ) const;
+  std::string to_string( size_t i ) const;
+
+  void push( const Token & token );
+
+private:
+  std::string_view m_source;
+  std::vector<TokenType> m_types;
+  std::vector<uint32_t> m_offsets;
+  std::vector<uint32_t> m_lengths;
+  std::vector<uint32_t> m_lines;
+  std::vector<Atom> m_atoms;
 };
 
+// Reads the tokens of a source on demand, a token is only scanned when the parser
+// looks at it. The scanned tokens are kept in a small ring buffer, which holds the
+// last consumed token and the lookahead. The source has to outlive the lexer.
 class Lexer
 {
 public:
-  Lexer( const std::string & src );
-  std::vector<Token> tokens() const;
+  static constexpr size_t RING_SIZE = 4; // a power of two
+
+  Lexer( std::string_view src, AtomTable & atoms );
+
+  // Looks ahead without consuming, ahead must be less than RING_SIZE - 1
+  Token peek( size_t ahead = 0 );
+  Token next();
+  Token previous() const;
+  bool is_finished();
+
+  std::string_view lexeme( const Token & token ) const
+  {
+    return m_source.substr( token.offset, token.length );
+  }
+
+  // The table the identifiers are interned in
+  AtomTable & atoms() const
+  {
+    return m_atoms;
+  }
 
 private:
-  const std::string m_source;
-  std::string::const_iterator m_pos;
-  std::vector<Token> m_tokens;
+  std::string_view m_source;
+  AtomTable & m_atoms;
+  const char * m_pos;
+  const char * m_end;
+  uint32_t m_line = 1;
 
-  void run();
-  void push_token( const Token & token );
-  bool is_finished() const;
+  Token m_ring[RING_SIZE];
+  size_t m_consumed = 0; // number of tokens taken with next()
+  size_t m_scanned  = 0; // number of tokens in the ring buffer or consumed
+
+  Token scan();
+  Token make_token( TokenType type, const char * start ) const;
+  bool at_end() const;
   void skip_whitespace();
-  bool is_identifier( char );
-  bool is_numeric( char );
-  void handle_identifier();
-  void handle_number();
-  void handle_string();
-  char next();
-  char peek() const;
-  char peek_next() const;
+  Token handle_identifier( const char * start );
+  Token handle_number( const char * start );
+  Token handle_string();
+  char next_char();
+  char peek_char() const;
+  char peek_next_char() const;
   bool match_next( char );
 };
 
-std::vector<Token> lex( const std::string & src );
+// Decodes the escape sequences of a string literal, \n \t \r \" and \\. Other
+// backslashes are kept.
+std::string unescape( std::string_view lexeme );
+
+// Scans the whole source at once
+TokenList lex( std::string_view src, AtomTable & atoms );
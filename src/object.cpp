@@ -1,168 +1,342 @@
 #include "object.h"
 #include "utils.h"
 #include <cassert>
+#include <algorithm>
 #include <cstring>
+#include <memory>
 
-Object::Object()
-    : type( NIL )
+bool Object::is_falsy() const
+{
+  return !is_truthy();
+}
+
+bool Object::is_truthy() const
+{
+  switch( type() )
+  {
+    case Object::NIL :
+      return false;
+    case Object::BOOLEAN :
+      return as_boolean();
+    case Object::INTEGER :
+      return as_integer() != 0;
+    case Object::REAL :
+      return as_real() != 0;
+    case Object::STRING :
+      return ( as_string() != nullptr ) && ( 0 < as_string()->length );
+    case Object::LIST :
+    case Object::MAP :
+    case Object::FUNCTION :
+    case Object::CLASS :
+    case Object::INSTANCE :
+    default :
+      return true;
+  }
+}
+
+FunctionObject::FunctionObject( const char * fn_name, uint8_t arity, CodeObject * ctx )
+    : name( reinterpret_cast<char *>( this + 1 ) )
+    , num_args( arity )
 {
+  strcpy( name, fn_name );
+  code_object.parent = ctx;
 }
 
-Object Object::Nil()
+size_t FunctionObject::allocation_size( const char * fn_name, uint8_t, CodeObject * )
 {
-  return Object();
+  return sizeof( FunctionObject ) + strlen( fn_name ) + 1;
 }
 
-Object Object::Boolean( bool value )
+ClassObject::ClassObject( const char * cl_name, const std::vector<std::string> & field_names )
+    : name( reinterpret_cast<char *>( this + 1 ) )
+    , fields( field_names )
 {
-  Object obj;
-  obj.type    = BOOLEAN;
-  obj.boolean = value;
-  return obj;
+  strcpy( name, cl_name );
+  slots.reserve( fields.size() );
+  for( size_t i = 0; i < fields.size(); i++ )
+  {
+    slots.set( fields[i].c_str(), ( int ) i );
+  }
 }
 
-Object Object::Integer( int value )
+size_t ClassObject::allocation_size( const char * cl_name, const std::vector<std::string> & )
 {
-  Object obj;
-  obj.type    = INTEGER;
-  obj.integer = value;
-  return obj;
+  return sizeof( ClassObject ) + strlen( cl_name ) + 1;
 }
 
-Object Object::Real( double value )
+int ClassObject::find_field( const char * field_name ) const
 {
-  Object obj;
-  obj.type = REAL;
-  obj.real = value;
-  return obj;
+  const int * slot = slots.find( field_name );
+  return slot ? *slot : -1;
 }
 
-Object Object::String( StringObject * value )
+size_t ClassObject::size() const
 {
-  Object obj;
-  obj.type   = STRING;
-  obj.string = value;
-  return obj;
+  return sizeof( *this ) + strlen( name ) + 1;
 }
 
-Object Object::Function( FunctionObject * fn )
+InstanceObject::InstanceObject( ClassObject * klass )
+    : klass( klass )
+    , num_fields( klass->fields.size() )
+    , fields( reinterpret_cast<Object *>( this + 1 ) )
 {
-  Object obj;
-  obj.type     = FUNCTION;
-  obj.function = fn;
-  return obj;
+  std::uninitialized_fill_n( fields, num_fields, Object() );
 }
 
-Object Object::Native( NativeFunction fn )
+void InstanceObject::trace( GarbageCollector & gc )
 {
-  Object obj;
-  obj.type   = NATIVE;
-  obj.native = fn;
-  return obj;
+  gc.mark( klass );
+  for( size_t i = 0; i < num_fields; i++ )
+  {
+    mark_object( gc, fields[i] );
+  }
 }
 
-Object Object::Class( ClassObject * c )
+size_t InstanceObject::size() const
 {
-  Object obj;
-  obj.type  = CLASS;
-  obj.klass = c;
-  return obj;
+  return sizeof( *this ) + num_fields * sizeof( Object );
 }
 
-Object Object::Instance( InstanceObject * i )
+GarbageCollected * InstanceObject::copy_to( void * memory ) const
 {
-  Object obj;
-  obj.type     = INSTANCE;
-  obj.instance = i;
-  return obj;
+  InstanceObject * copy = new( memory ) InstanceObject( klass );
+  std::copy_n( fields, num_fields, copy->fields );
+  return copy;
 }
 
-bool Object::is_falsy() const
+size_t InstanceObject::allocation_size( const ClassObject * klass )
 {
-  return !is_truthy();
+  return sizeof( InstanceObject ) + klass->fields.size() * sizeof( Object );
 }
 
-bool Object::is_truthy() const
+void FunctionObject::trace( GarbageCollector & gc )
+{
+  mark_code( gc, code_object );
+}
+
+size_t FunctionObject::size() const
+{
+  return sizeof( *this ) + strlen( name ) + 1;
+}
+
+ListObject::ListObject( const Object * values, size_t num_values )
+    : items( num_values ? new Object[num_values] : nullptr )
+    , count( num_values )
+    , capacity( num_values )
 {
-  switch( type )
+  std::copy_n( values, num_values, items );
+}
+
+ListObject::~ListObject()
+{
+  delete[] items;
+}
+
+void ListObject::trace( GarbageCollector & gc )
+{
+  for( size_t i = 0; i < count; i++ )
+  {
+    mark_object( gc, items[i] );
+  }
+}
+
+// The buffer is included, list_append() reports every growth to the collector
+size_t ListObject::size() const
+{
+  return sizeof( *this ) + capacity * sizeof( Object );
+}
+
+void list_append( GarbageCollector & gc, ListObject * list, const Object & value )
+{
+  if( list->count == list->capacity )
+  {
+    size_t capacity = std::max<size_t>( 8, 2 * list->capacity );
+    Object * items  = new Object[capacity];
+    std::copy_n( list->items, list->count, items );
+    delete[] list->items;
+    gc.grow( ( capacity - list->capacity ) * sizeof( Object ) );
+    list->items    = items;
+    list->capacity = capacity;
+  }
+  list->items[list->count++] = value;
+}
+
+// Keys that are not strings are hashed by address, so the table is rebuilt when a
+// minor collection moved one of them
+void MapObject::trace( GarbageCollector & gc )
+{
+  bool moved = false;
+  for_each(
+      [&gc, &moved]( Object & key, Object & value )
+      {
+        GarbageCollected * before = gc_object( key );
+        mark_object( gc, key );
+        mark_object( gc, value );
+        moved |= !key.is_string() && gc_object( key ) != before;
+      } );
+  if( moved )
+  {
+    rehash();
+  }
+}
+
+size_t HashTraits<Object>::hash( const Object & key )
+{
+  switch( key.type() )
   {
-    case Object::NIL :
-      return false;
     case Object::BOOLEAN :
-      return boolean;
+      return key.as_boolean() ? 1 : 2;
     case Object::INTEGER :
-      return integer != 0;
+      return std::hash<int>()( key.as_integer() );
     case Object::REAL :
-      return real != 0;
+      return std::hash<double>()( key.as_real() );
     case Object::STRING :
-      return ( string != nullptr ) && ( string->str != nullptr ) && ( 0 < strlen( string->str ) );
-    case Object::LIST :
-    case Object::MAP :
-    case Object::FUNCTION :
-    case Object::CLASS :
-    case Object::INSTANCE :
+      return key.as_string()->hash();
+    case Object::NATIVE :
+      return std::hash<void *>()( reinterpret_cast<void *>( key.as_native() ) );
     default :
-      return true;
+      return std::hash<void *>()( gc_object( key ) );
   }
 }
 
-FunctionObject::FunctionObject( const char * fn_name, uint8_t arity, CodeObject * ctx )
-    : name( STRDUP( fn_name ) )
-    , num_args( arity )
+bool HashTraits<Object>::equal( const Object & a, const Object & b )
 {
-  code_object.parent = ctx;
+  if( a.type() != b.type() )
+  {
+    return false;
+  }
+
+  switch( a.type() )
+  {
+    case Object::NIL :
+      return true;
+    case Object::BOOLEAN :
+      return a.as_boolean() == b.as_boolean();
+    case Object::INTEGER :
+      return a.as_integer() == b.as_integer();
+    case Object::REAL :
+      return a.as_real() == b.as_real();
+    case Object::STRING :
+      return a.as_string()->equals( b.as_string() );
+    case Object::NATIVE :
+      return a.as_native() == b.as_native();
+    default :
+      return gc_object( a ) == gc_object( b );
+  }
 }
 
-ClassObject::ClassObject( const char * cl_name )
-    : name( STRDUP( cl_name ) )
+StringObject * intern_string( GarbageCollector & gc, const char * str )
 {
+  if( GarbageCollected * interned = gc.find_interned( str ) )
+  {
+    return static_cast<StringObject *>( interned );
+  }
+
+  StringObject * string = gc.alloc<StringObject>( str );
+  string->interned      = true;
+  gc.add_interned( string->str, string );
+  return string;
 }
 
-ClassObject::~ClassObject()
+GarbageCollected * gc_object( const Object & obj )
 {
-  if( name )
+  switch( obj.type() )
   {
-    free( name );
-    name = nullptr;
+    case Object::Type::STRING :
+      return obj.as_string();
+    case Object::Type::LIST :
+      return obj.as_list();
+    case Object::Type::MAP :
+      return obj.as_map();
+    case Object::Type::FUNCTION :
+      return obj.as_function();
+    case Object::Type::CLASS :
+      return obj.as_class();
+    case Object::Type::INSTANCE :
+      return obj.as_instance();
+    default :
+      return nullptr;
   }
 }
 
-InstanceObject::InstanceObject( ClassObject * klass )
-    : klass( klass )
+// Marks the object of a value, a minor collection may have moved it
+template <typename T>
+static void mark_pointer( GarbageCollector & gc, Object & obj, T * ptr, Object ( *make )( T * ) )
+{
+  gc.mark( ptr );
+  obj = make( ptr );
+}
+
+void mark_object( GarbageCollector & gc, Object & obj )
 {
+  switch( obj.type() )
+  {
+    case Object::Type::STRING :
+      mark_pointer( gc, obj, obj.as_string(), &Object::String );
+      break;
+    case Object::Type::LIST :
+      mark_pointer( gc, obj, obj.as_list(), &Object::List );
+      break;
+    case Object::Type::MAP :
+      mark_pointer( gc, obj, obj.as_map(), &Object::Map );
+      break;
+    case Object::Type::FUNCTION :
+      mark_pointer( gc, obj, obj.as_function(), &Object::Function );
+      break;
+    case Object::Type::CLASS :
+      mark_pointer( gc, obj, obj.as_class(), &Object::Class );
+      break;
+    case Object::Type::INSTANCE :
+      mark_pointer( gc, obj, obj.as_instance(), &Object::Instance );
+      break;
+    default :
+      break;
+  }
 }
 
-InstanceObject::~InstanceObject()
+void mark_code( GarbageCollector & gc, CodeObject & code )
 {
+  for( Object & literal : code.literals )
+  {
+    mark_object( gc, literal );
+  }
 }
 
 std::ostream & operator<<( std::ostream & os, const Object & obj )
 {
-  switch( obj.type )
+  switch( obj.type() )
   {
     case Object::Type::NIL :
       os << "NIL";
       break;
     case Object::Type::BOOLEAN :
-      os << ( obj.boolean ? "true" : "false" );
+      os << ( obj.as_boolean() ? "true" : "false" );
       break;
     case Object::Type::INTEGER :
-      os << obj.integer;
+      os << obj.as_integer();
       break;
     case Object::Type::REAL :
-      os << obj.real;
+      os << obj.as_real();
       break;
     case Object::Type::STRING :
-      os << obj.string->str;
+      os << obj.as_string()->c_str();
+      break;
+    case Object::Type::LIST :
+      os << "[";
+      for( size_t i = 0; i < obj.as_list()->count; i++ )
+      {
+        os << ( i ? ", " : "" ) << obj.as_list()->items[i];
+      }
+      os << "]";
       break;
     case Object::Type::FUNCTION :
-      os << "function<" << obj.function->name << ">";
+      os << "function<" << obj.as_function()->name << ">";
       break;
     case Object::Type::CLASS :
-      os << "class<" << obj.klass->name << ">";
+      os << "class<" << obj.as_class()->name << ">";
       break;
     case Object::Type::INSTANCE :
-      os << "instance<" << obj.instance->klass->name << ">";
+      os << "instance<" << obj.as_instance()->klass->name << ">";
       break;
     default :
       assert( false );
@@ -172,15 +346,136 @@ std::ostream & operator<<( std::ostream & os, const Object & obj )
 }
 
 StringObject::StringObject( const char * s )
-    : str( STRDUP( s ) )
+    : str( reinterpret_cast<char *>( this + 1 ) )
+    , length( strlen( s ) )
+{
+  memcpy( str, s, length + 1 );
+}
+
+StringObject::StringObject( StringObject * lhs, StringObject * rhs )
+    : str( nullptr )
+    , length( lhs->length + rhs->length )
+    , m_rope( is_rope( lhs, rhs ) )
 {
+  if( m_rope )
+  {
+    left  = lhs;
+    right = rhs;
+  }
+  else
+  {
+    str = reinterpret_cast<char *>( this + 1 );
+    memcpy( str, lhs->c_str(), lhs->length );
+    memcpy( str + lhs->length, rhs->c_str(), rhs->length + 1 );
+  }
 }
 
 StringObject::~StringObject()
+{
+  if( m_rope )
+  {
+    delete[] str;
+  }
+}
+
+// The parts are copied from the right end of the buffer, with a work list instead of
+// recursion, ropes built in a loop are as deep as the loop is long
+const char * StringObject::c_str()
 {
   if( str )
   {
-    free( str );
-    str = nullptr;
+    return str;
+  }
+
+  char * chars = new char[length + 1];
+  size_t end   = length;
+  std::vector<StringObject *> parts = { left, right };
+  while( !parts.empty() )
+  {
+    StringObject * part = parts.back();
+    parts.pop_back();
+    if( part->str )
+    {
+      end -= part->length;
+      memcpy( chars + end, part->str, part->length );
+    }
+    else
+    {
+      parts.push_back( part->left );
+      parts.push_back( part->right );
+    }
+  }
+  assert( end == 0 );
+
+  chars[length] = '\0';
+  str           = chars;
+  left          = nullptr;
+  right         = nullptr;
+  return str;
+}
+
+size_t StringObject::hash()
+{
+  if( m_hash == 0 )
+  {
+    size_t hash = hash_bytes( c_str(), length );
+    m_hash      = hash ? hash : 1;
+  }
+  return m_hash;
+}
+
+bool StringObject::equals( StringObject * other )
+{
+  if( this == other )
+  {
+    return true;
+  }
+  if( ( interned && other->interned ) || length != other->length || hash() != other->hash() )
+  {
+    return false;
   }
+  return memcmp( c_str(), other->c_str(), length ) == 0;
+}
+
+void StringObject::trace( GarbageCollector & gc )
+{
+  gc.mark( left );
+  gc.mark( right );
+}
+
+// A rope counts the buffer c_str() may allocate from the start, so the size of an
+// object does not change while the collector accounts for it
+size_t StringObject::size() const
+{
+  return sizeof( *this ) + length + 1;
+}
+
+GarbageCollected * StringObject::copy_to( void * memory ) const
+{
+  assert( !m_rope && "ropes are not allocated in the nursery" );
+  return new( memory ) StringObject( str );
+}
+
+size_t StringObject::allocation_size( const char * s )
+{
+  return sizeof( StringObject ) + strlen( s ) + 1;
+}
+
+size_t StringObject::allocation_size( StringObject * lhs, StringObject * rhs )
+{
+  return is_rope( lhs, rhs ) ? sizeof( StringObject ) : sizeof( StringObject ) + lhs->length + rhs->length + 1;
+}
+
+StringObject * concat_strings( GarbageCollector & gc, StringObject * lhs, StringObject * rhs )
+{
+  if( !StringObject::is_rope( lhs, rhs ) )
+  {
+    return gc.alloc_young<StringObject>( lhs, rhs );
+  }
+
+  // an old rope that refers to young parts has to be remembered
+  StringObject * rope = gc.alloc<StringObject>( lhs, rhs );
+  gc.write_barrier( rope, nullptr, lhs );
+  gc.write_barrier( rope, nullptr, rhs );
+  return rope;
 }
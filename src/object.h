@@ -1,7 +1,10 @@
 #pragma once
 
+#include <cstdint>
+#include <cstring>
 #include <ostream>
 #include <string>
+#include <vector>
 
 #include "bytecode.h"
 #include "gc.h"
@@ -13,56 +16,116 @@ class VirtualMachine;
 
 typedef Object ( *NativeFunction )( VirtualMachine *, int, Object[] );
 
+// A flat string stores its characters right after the object. Long concatenations
+// are ropes instead, which only point to their two parts. The characters of a rope
+// are put together by c_str() when they are needed, in a buffer the rope owns, so
+// ropes are never allocated in the nursery. Interned strings are unique, see
+// intern_string().
 struct StringObject : public GarbageCollected
 {
-  char * str;
+  static constexpr size_t ROPE_LENGTH = 64; // shorter concatenations are copied
+
+  char * str; // nullptr for a rope until c_str() is called
+  size_t length;
+  bool interned        = false;
+  StringObject * left  = nullptr; // the parts of a rope until c_str() is called
+  StringObject * right = nullptr;
+
   StringObject( const char * s );
-  ~StringObject();
+  StringObject( StringObject * lhs, StringObject * rhs ); // the concatenation
+  ~StringObject() override;
+
+  const char * c_str();
+  size_t hash();
+  bool equals( StringObject * other );
+  bool is_rope() const
+  {
+    return m_rope;
+  }
+
+  void trace( GarbageCollector & ) override;
+  size_t size() const override;
+  GarbageCollected * copy_to( void * ) const override;
+  static size_t allocation_size( const char * s );
+  static size_t allocation_size( StringObject * lhs, StringObject * rhs );
+
+  // True if the concatenation of lhs and rhs becomes a rope
+  static bool is_rope( const StringObject * lhs, const StringObject * rhs )
+  {
+    return ROPE_LENGTH <= lhs->length + rhs->length;
+  }
+
+private:
+  size_t m_hash = 0; // 0 until hash() is called
+  bool m_rope   = false;
 };
 
+// The name is stored right after the object
 struct FunctionObject : public GarbageCollected
 {
   char * name;
   uint8_t num_args = 0;
   CodeObject code_object;
   FunctionObject( const char * fn_name, uint8_t arity, CodeObject * ctx );
-  ~FunctionObject()
-  {
-    if( name )
-    {
-      free( name );
-      name = nullptr;
-    }
-  }
+  void trace( GarbageCollector & ) override;
+  size_t size() const override;
+  static size_t allocation_size( const char * fn_name, uint8_t, CodeObject * );
 };
 
-struct ListObject
-    : public GarbageCollected
-    , public LinkedList<Object>
+// The elements are stored in a buffer the list owns, which doubles when it is full,
+// so lists are never allocated in the nursery. See list_append().
+struct ListObject : public GarbageCollected
 {
+  Object * items  = nullptr;
+  size_t count    = 0;
+  size_t capacity = 0;
+  ListObject( const Object * values, size_t num_values );
+  ~ListObject() override;
+  void trace( GarbageCollector & ) override;
+  size_t size() const override;
 };
 
+template <>
+struct HashTraits<Object>;
+
+// Strings are keys by value, all other objects by identity. The map owns its table,
+// so maps are never allocated in the nursery.
 struct MapObject
     : public GarbageCollected
-    , public HashMap<Object>
+    , public HashMap<Object, Object>
 {
+  void trace( GarbageCollector & ) override;
 };
 
+// The name is stored right after the object
 struct ClassObject : public GarbageCollected
 {
   char * name;
-  ClassObject( const char * cl_name );
-  ~ClassObject();
+  std::vector<std::string> fields; // field names, in slot order
+  HashMap<const char *, int> slots; // field name to slot, for lookups by name
+  ClassObject( const char * cl_name, const std::vector<std::string> & field_names = {} );
+  int find_field( const char * field_name ) const;
+  size_t size() const override;
+  static size_t allocation_size( const char * cl_name, const std::vector<std::string> & = {} );
 };
 
+// Instances have one slot per field of their class, the slot of a field is
+// resolved by the type checker. The slots are stored right after the object.
 struct InstanceObject : public GarbageCollected
 {
   ClassObject * klass;
-  HashMap<Object> fields;
+  size_t num_fields;
+  Object * fields;
   InstanceObject( ClassObject * klass );
-  ~InstanceObject();
+  void trace( GarbageCollector & ) override;
+  size_t size() const override;
+  GarbageCollected * copy_to( void * ) const override;
+  static size_t allocation_size( const ClassObject * klass );
 };
 
+// A value of the language. By default a type tag next to a payload (16 bytes), with
+// BRASS_NAN_BOXING a single 8 byte word: reals are stored as they are and all other
+// values in the payload bits of a quiet NaN. Both have the same interface.
 class Object
 {
 public:
@@ -88,28 +151,384 @@ public:
   static Object Integer( int );
   static Object Real( double );
   static Object String( StringObject * );
+  static Object List( ListObject * );
+  static Object Map( MapObject * );
   static Object Function( FunctionObject * );
   static Object Native( NativeFunction );
   static Object Class( ClassObject * );
   static Object Instance( InstanceObject * );
 
-  Type type;
-  union
-  {
-    bool boolean;
-    int integer;
-    double real;
-    StringObject * string;
-    ListObject * list;
-    MapObject * map;
-    FunctionObject * function;
-    NativeFunction native;
-    ClassObject * klass;
-    InstanceObject * instance;
-  };
+  Type type() const;
+
+  bool is_nil() const;
+  bool is_boolean() const;
+  bool is_integer() const;
+  bool is_real() const;
+  bool is_string() const;
+  bool is_list() const;
+  bool is_map() const;
+  bool is_function() const;
+  bool is_native() const;
+  bool is_class() const;
+  bool is_instance() const;
+
+  bool as_boolean() const;
+  int as_integer() const;
+  double as_real() const;
+  StringObject * as_string() const;
+  ListObject * as_list() const;
+  MapObject * as_map() const;
+  FunctionObject * as_function() const;
+  NativeFunction as_native() const;
+  ClassObject * as_class() const;
+  InstanceObject * as_instance() const;
 
   bool is_falsy() const;
   bool is_truthy() const;
+
+private:
+#if BRASS_NAN_BOXING
+  static constexpr uint64_t SIGN         = 0x8000000000000000;
+  static constexpr uint64_t QNAN         = 0x7ff8000000000000;
+  static constexpr uint64_t TAG_MASK     = 0xffff000000000000;
+  static constexpr uint64_t PAYLOAD_MASK = 0x0000ffffffffffff;
+
+  // The type is stored in the sign bit and the three bits below the quiet NaN.
+  // Tag 0 is the one NaN that is a real, every other NaN is stored as that one.
+  static constexpr uint64_t tag( Type type )
+  {
+    return QNAN | ( ( uint64_t( type + 1 ) & 8 ) << 60 ) | ( ( uint64_t( type + 1 ) & 7 ) << 48 );
+  }
+
+  static Object box( Type type, uint64_t payload )
+  {
+    Object obj;
+    obj.m_bits = tag( type ) | payload;
+    return obj;
+  }
+
+  template <typename T>
+  static Object box_pointer( Type type, T * ptr )
+  {
+    return box( type, reinterpret_cast<uint64_t>( ptr ) );
+  }
+
+  template <typename T>
+  T * unbox_pointer() const
+  {
+    return reinterpret_cast<T *>( m_bits & PAYLOAD_MASK );
+  }
+
+  bool has_tag( Type type ) const
+  {
+    return ( m_bits & TAG_MASK ) == tag( type );
+  }
+
+  uint64_t m_bits;
+#else
+  Type m_type;
+  union
+  {
+    bool m_boolean;
+    int m_integer;
+    double m_real;
+    StringObject * m_string;
+    ListObject * m_list;
+    MapObject * m_map;
+    FunctionObject * m_function;
+    NativeFunction m_native;
+    ClassObject * m_klass;
+    InstanceObject * m_instance;
+  };
+#endif
 };
 
+#if BRASS_NAN_BOXING
+
+static_assert( sizeof( void * ) == 8, "NaN-boxing needs 64 bit pointers" );
+
+inline Object::Object()
+    : m_bits( tag( NIL ) )
+{
+}
+
+inline Object Object::Nil()
+{
+  return Object();
+}
+
+inline Object Object::Boolean( bool value )
+{
+  return box( BOOLEAN, value );
+}
+
+inline Object Object::Integer( int value )
+{
+  return box( INTEGER, static_cast<uint32_t>( value ) );
+}
+
+inline Object Object::Real( double value )
+{
+  Object obj;
+  if( value != value )
+  {
+    obj.m_bits = QNAN;
+  }
+  else
+  {
+    memcpy( &obj.m_bits, &value, sizeof( value ) );
+  }
+  return obj;
+}
+
+inline Object Object::String( StringObject * value )
+{
+  return box_pointer( STRING, value );
+}
+
+inline Object Object::List( ListObject * value )
+{
+  return box_pointer( LIST, value );
+}
+
+inline Object Object::Map( MapObject * value )
+{
+  return box_pointer( MAP, value );
+}
+
+inline Object Object::Function( FunctionObject * value )
+{
+  return box_pointer( FUNCTION, value );
+}
+
+inline Object Object::Native( NativeFunction value )
+{
+  return box( NATIVE, reinterpret_cast<uint64_t>( value ) );
+}
+
+inline Object Object::Class( ClassObject * value )
+{
+  return box_pointer( CLASS, value );
+}
+
+inline Object Object::Instance( InstanceObject * value )
+{
+  return box_pointer( INSTANCE, value );
+}
+
+inline Object::Type Object::type() const
+{
+  if( is_real() )
+  {
+    return REAL;
+  }
+  return static_cast<Type>( ( ( ( m_bits >> 60 ) & 8 ) | ( ( m_bits >> 48 ) & 7 ) ) - 1 );
+}
+
+inline bool Object::is_real() const
+{
+  return ( m_bits & QNAN ) != QNAN || m_bits == QNAN;
+}
+
+inline bool Object::as_boolean() const
+{
+  return m_bits & 1;
+}
+
+inline int Object::as_integer() const
+{
+  return static_cast<int>( static_cast<uint32_t>( m_bits ) );
+}
+
+inline double Object::as_real() const
+{
+  double value;
+  memcpy( &value, &m_bits, sizeof( value ) );
+  return value;
+}
+
+inline StringObject * Object::as_string() const
+{
+  return unbox_pointer<StringObject>();
+}
+
+inline ListObject * Object::as_list() const
+{
+  return unbox_pointer<ListObject>();
+}
+
+inline MapObject * Object::as_map() const
+{
+  return unbox_pointer<MapObject>();
+}
+
+inline FunctionObject * Object::as_function() const
+{
+  return unbox_pointer<FunctionObject>();
+}
+
+inline NativeFunction Object::as_native() const
+{
+  return reinterpret_cast<NativeFunction>( m_bits & PAYLOAD_MASK );
+}
+
+inline ClassObject * Object::as_class() const
+{
+  return unbox_pointer<ClassObject>();
+}
+
+inline InstanceObject * Object::as_instance() const
+{
+  return unbox_pointer<InstanceObject>();
+}
+
+#define BRASS_OBJECT_PREDICATE( name, TYPE ) \
+  inline bool Object::name() const           \
+  {                                          \
+    return has_tag( TYPE );                  \
+  }
+
+#else
+
+inline Object::Object()
+    : m_type( NIL )
+{
+}
+
+inline Object Object::Nil()
+{
+  return Object();
+}
+
+#define BRASS_OBJECT_FACTORY( name, TYPE, param_type, member ) \
+  inline Object Object::name( param_type value )                \
+  {                                                            \
+    Object obj;                                                \
+    obj.m_type = TYPE;                                         \
+    obj.member = value;                                        \
+    return obj;                                                \
+  }
+
+BRASS_OBJECT_FACTORY( Boolean, BOOLEAN, bool, m_boolean )
+BRASS_OBJECT_FACTORY( Integer, INTEGER, int, m_integer )
+BRASS_OBJECT_FACTORY( Real, REAL, double, m_real )
+BRASS_OBJECT_FACTORY( String, STRING, StringObject *, m_string )
+BRASS_OBJECT_FACTORY( List, LIST, ListObject *, m_list )
+BRASS_OBJECT_FACTORY( Map, MAP, MapObject *, m_map )
+BRASS_OBJECT_FACTORY( Function, FUNCTION, FunctionObject *, m_function )
+BRASS_OBJECT_FACTORY( Native, NATIVE, NativeFunction, m_native )
+BRASS_OBJECT_FACTORY( Class, CLASS, ClassObject *, m_klass )
+BRASS_OBJECT_FACTORY( Instance, INSTANCE, InstanceObject *, m_instance )
+
+#undef BRASS_OBJECT_FACTORY
+
+inline Object::Type Object::type() const
+{
+  return m_type;
+}
+
+inline bool Object::is_real() const
+{
+  return m_type == REAL;
+}
+
+inline bool Object::as_boolean() const
+{
+  return m_boolean;
+}
+
+inline int Object::as_integer() const
+{
+  return m_integer;
+}
+
+inline double Object::as_real() const
+{
+  return m_real;
+}
+
+inline StringObject * Object::as_string() const
+{
+  return m_string;
+}
+
+inline ListObject * Object::as_list() const
+{
+  return m_list;
+}
+
+inline MapObject * Object::as_map() const
+{
+  return m_map;
+}
+
+inline FunctionObject * Object::as_function() const
+{
+  return m_function;
+}
+
+inline NativeFunction Object::as_native() const
+{
+  return m_native;
+}
+
+inline ClassObject * Object::as_class() const
+{
+  return m_klass;
+}
+
+inline InstanceObject * Object::as_instance() const
+{
+  return m_instance;
+}
+
+#define BRASS_OBJECT_PREDICATE( name, TYPE ) \
+  inline bool Object::name() const           \
+  {                                          \
+    return m_type == TYPE;                   \
+  }
+
+#endif
+
+BRASS_OBJECT_PREDICATE( is_nil, NIL )
+BRASS_OBJECT_PREDICATE( is_boolean, BOOLEAN )
+BRASS_OBJECT_PREDICATE( is_integer, INTEGER )
+BRASS_OBJECT_PREDICATE( is_string, STRING )
+BRASS_OBJECT_PREDICATE( is_list, LIST )
+BRASS_OBJECT_PREDICATE( is_map, MAP )
+BRASS_OBJECT_PREDICATE( is_function, FUNCTION )
+BRASS_OBJECT_PREDICATE( is_native, NATIVE )
+BRASS_OBJECT_PREDICATE( is_class, CLASS )
+BRASS_OBJECT_PREDICATE( is_instance, INSTANCE )
+
+#undef BRASS_OBJECT_PREDICATE
+
 std::ostream & operator<<( std::ostream &, const Object & );
+
+template <>
+struct HashTraits<Object>
+{
+  static size_t hash( const Object & key );
+  static bool equal( const Object & a, const Object & b );
+};
+
+// Concatenate two strings, short results are copied into a young string and long
+// ones become a rope in the old space
+StringObject * concat_strings( GarbageCollector &, StringObject * lhs, StringObject * rhs );
+
+// Append a value to a list, the collector is told when its buffer grows. The caller
+// has to call the write barrier.
+void list_append( GarbageCollector &, ListObject *, const Object & value );
+
+// The one StringObject with the given characters, it is created on first use and
+// lives as long as the collector
+StringObject * intern_string( GarbageCollector &, const char * );
+
+// The collected object a value refers to, or nullptr
+GarbageCollected * gc_object( const Object & );
+
+// Mark the object a value refers to, if any. A minor collection may update the value.
+void mark_object( GarbageCollector &, Object & );
+
+// Mark everything referenced from the literals of a CodeObject
+void mark_code( GarbageCollector &, CodeObject & );
@@ -0,0 +1,47 @@
+#include "optimizer.h"
+
+void optimize( Program * program, Optimizer & optimizer )
+{
+  program->count_writes( optimizer );
+  ( void ) program->optimize( optimizer );
+}
+
+void Optimizer::push_scope()
+{
+  scopes.push_scope();
+}
+
+void Optimizer::pop_scope()
+{
+  scopes.pop_scope();
+}
+
+void Optimizer::define_constant( Atom name, Literal * value )
+{
+  scopes.define( name, value );
+}
+
+Literal * Optimizer::find_constant( Atom name )
+{
+  auto * symbol = scopes.find( name );
+  return symbol ? symbol->value : nullptr;
+}
+
+void Optimizer::count_write( Atom name )
+{
+  int * count = writes.find( name );
+  if( count )
+  {
+    ( *count )++;
+  }
+  else
+  {
+    writes.set( name, 1 );
+  }
+}
+
+int Optimizer::num_writes( Atom name ) const
+{
+  const int * count = writes.find( name );
+  return count ? *count : 0;
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include "ast.h"
+
+// Rewrites the type checked AST before it is compiled: constant arithmetic is folded
+// and branches with a constant condition are dropped. Locals that are initialised
+// with a literal and never written again are replaced by the literal.
+//
+// A name counts as written by every declaration and assignment of it, in the whole
+// program, so a constant can not be shadowed or redeclared.
+struct Optimizer
+{
+  NodeAllocator & allocator;
+
+  HashMap<Atom, int> writes;
+  ScopeTable<Literal *> scopes; // the constant locals in scope
+
+  Optimizer( NodeAllocator & allocator )
+      : allocator( allocator )
+  {
+  }
+
+  void push_scope();
+  void pop_scope();
+  void define_constant( Atom name, Literal * value );
+  Literal * find_constant( Atom name );
+  void count_write( Atom name );
+  int num_writes( Atom name ) const;
+};
+
+void optimize( Program *, Optimizer & );
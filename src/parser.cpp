@@ -1,18 +1,19 @@
 #include "parser.h"
 #include "ast.h"
+#include <charconv>
 #include <iostream>
 
-Parser::Parser( const std::vector<Token> & tokens, NodeAllocator & arena, GarbageCollector & gc )
-    : m_tokens( tokens )
-    , m_pos( m_tokens.begin() )
+Parser::Parser( Lexer & lexer, NodeAllocator & arena, GarbageCollector & gc )
+    : m_lexer( lexer )
     , m_arena( arena )
     , m_gc( gc )
+    , m_append( lexer.atoms().intern( "append" ) )
 {
 }
 
 Result<Program> Parser::run()
 {
-  Program * prog = m_arena.alloc<Program>();
+  Program * prog = m_arena.alloc<Program>( &m_arena );
 
   do
   {
@@ -77,12 +78,12 @@ Result<Stmt> Parser::parse_fn_decl()
   if( !match( IDENTIFIER ) )
     return make_error<Stmt>( "Expected identifier after 'fn'" );
 
-  std::string fn_name = previous().lexeme;
+  Atom fn_name = previous().atom;
 
   if( !match( LPAREN ) )
     return make_error<Stmt>( "Expected '(' after function name" );
 
-  std::vector<FnArgDecl> args;
+  std::pmr::vector<FnArgDecl> args( &m_arena );
 
   do
   {
@@ -93,17 +94,16 @@ Result<Stmt> Parser::parse_fn_decl()
     if( !match( IDENTIFIER ) )
       return make_error<Stmt>( "Expected identifier" );
 
-    std::string arg_var_name = previous().lexeme;
+    Atom arg_var_name = previous().atom;
 
     if( !match( COLON ) )
       return make_error<Stmt>( "Expected ':'" );
 
-    if( !match( IDENTIFIER ) )
+    AstString arg_type_name( &m_arena );
+    if( !match_type( arg_type_name ) )
       return make_error<Stmt>( "Expected identifier" );
 
-    std::string arg_type_name = previous().lexeme;
-
-    args.push_back( { arg_var_name, arg_type_name } );
+    args.push_back( { arg_var_name, std::move( arg_type_name ) } );
 
     ( void ) match( COMMA );
   } while( !is_finished() );
@@ -114,11 +114,10 @@ Result<Stmt> Parser::parse_fn_decl()
   if( !match( COLON ) )
     return make_error<Stmt>( "Expected ':'" );
 
-  if( !match( IDENTIFIER ) )
+  AstString return_type( &m_arena );
+  if( !match_type( return_type ) )
     return make_error<Stmt>( "Expected return type identifier" );
 
-  std::string return_type = previous().lexeme;
-
   if( !match( LBRACE ) )
     return make_error<Stmt>( "Expected '{'" );
 
@@ -127,7 +126,7 @@ Result<Stmt> Parser::parse_fn_decl()
   if( !body.ok() )
     return make_error<Stmt>( body.error );
 
-  return make_result<Stmt>( m_arena.alloc<FnDecl>( fn_name, args, return_type, body.node ) );
+  return make_result<Stmt>( m_arena.alloc<FnDecl>( fn_name, std::move( args ), std::move( return_type ), body.node ) );
 }
 
 Result<Stmt> Parser::parse_var_decl()
@@ -135,15 +134,13 @@ Result<Stmt> Parser::parse_var_decl()
   if( !match( IDENTIFIER ) )
     return make_error<Stmt>( "Expected variable identifier in variable declaration" );
 
-  std::string var_name  = previous().lexeme;
-  std::string type_name = "";
+  Atom var_name = previous().atom;
+  AstString type_name( &m_arena );
 
   if( match( COLON ) )
   {
-    if( !match( IDENTIFIER ) )
+    if( !match_type( type_name ) )
       return make_error<Stmt>( "Expected type identifier after ':'" );
-
-    type_name = previous().lexeme;
   }
 
   if( !match( EQUAL ) )
@@ -156,7 +153,7 @@ Result<Stmt> Parser::parse_var_decl()
   if( !match( SEMICOLON ) )
     return make_error<Stmt>( "Expected ';' after variable declaration" );
 
-  return make_result<Stmt>( m_arena.alloc<VariableDecl>( var_name, type_name, expr.node ) );
+  return make_result<Stmt>( m_arena.alloc<VariableDecl>( var_name, std::move( type_name ), expr.node ) );
 }
 
 Result<Expr> Parser::parse_assignment()
@@ -179,6 +176,11 @@ Result<Expr> Parser::parse_assignment()
       Get * get = ( Get * ) expr.node;
       return make_result<Expr>( m_arena.alloc<Set>( get->object, get->property, value.node ) );
     }
+    else if( dynamic_cast<GetIndex *>( expr.node ) != nullptr )
+    {
+      GetIndex * get = ( GetIndex * ) expr.node;
+      return make_result<Expr>( m_arena.alloc<SetIndex>( get->list, get->index, value.node ) );
+    }
 
     return make_error<Expr>( "assigment not impelmented" );
   }
@@ -194,49 +196,76 @@ Result<Expr> Parser::parse_call()
   if( !expr.ok() )
     return make_error<Expr>( expr.error );
 
-  if( match( LPAREN ) )
+  Expr * node = expr.node;
+  for( ;; )
   {
-    std::vector<Expr *> args;
-
-    do
+    if( match( LPAREN ) )
     {
-      if( peek().type == RPAREN )
+      ExprList args( &m_arena );
+
+      do
       {
-        break;
+        if( peek().type == RPAREN )
+        {
+          break;
+        }
+
+        auto arg = parse_expression();
+        if( !arg.ok() )
+        {
+        }
+
+        args.push_back( arg.node );
+
+        ( void ) match( COMMA );
+      } while( !is_finished() );
+
+      if( !match( RPAREN ) )
+      {
+        return make_error<Expr>( "Expected ')'" );
       }
 
-      auto arg = parse_expression();
-      if( !arg.ok() )
+      node = m_arena.alloc<Call>( node, std::move( args ) );
+    }
+    else if( match( DOT ) )
+    {
+      if( !match( IDENTIFIER ) )
       {
+        return make_error<Expr>( "expected identifier" );
       }
 
-      args.push_back( arg.node );
+      Atom name = previous().atom;
+      if( name == m_append && match( LPAREN ) )
+      {
+        auto value = parse_expression();
+        if( !value.ok() )
+          return make_error<Expr>( value.error );
 
-      ( void ) match( COMMA );
-    } while( !is_finished() );
+        if( !match( RPAREN ) )
+          return make_error<Expr>( "Expected ')' after appended value" );
 
-    if( !match( RPAREN ) )
-    {
-      return make_error<Expr>( "Expected ')'" );
+        node = m_arena.alloc<Append>( node, value.node );
+      }
+      else
+      {
+        node = m_arena.alloc<Get>( node, name );
+      }
     }
+    else if( match( LBRACKET ) )
+    {
+      auto index = parse_expression();
+      if( !index.ok() )
+        return make_error<Expr>( index.error );
 
-    Call * fn_call = m_arena.alloc<Call>( expr.node, args );
-    return make_result<Expr>( fn_call );
-  }
-  else if( match( DOT ) )
-  {
-    if( !match( IDENTIFIER ) )
+      if( !match( RBRACKET ) )
+        return make_error<Expr>( "Expected ']' after index" );
+
+      node = m_arena.alloc<GetIndex>( node, index.node );
+    }
+    else
     {
-      return make_error<Expr>( "expected identifier" );
+      return make_result( node );
     }
-
-    std::string name = previous().lexeme;
-    Get * get        = m_arena.alloc<Get>( expr.node, name );
-    return make_result<Expr>( get );
-  }
-  else
-  {
-    return expr;
   }
 }
 
@@ -265,12 +294,12 @@ Result<Stmt> Parser::parse_class_decl()
   if( !match( IDENTIFIER ) )
     return make_error<Stmt>( "Expected class name" );
 
-  std::string name = previous().lexeme;
+  Atom name = previous().atom;
 
   if( !match( LBRACE ) )
     return make_error<Stmt>( "Expected '{' after class name" );
 
-  std::vector<ClassFieldDecl> fields;
+  std::pmr::vector<ClassFieldDecl> fields( &m_arena );
 
   do
   {
@@ -279,30 +308,29 @@ Result<Stmt> Parser::parse_class_decl()
 
     if( match( IDENTIFIER ) )
     {
-      std::string field_name = previous().lexeme;
+      Atom field_name = previous().atom;
 
       if( !match( COLON ) )
         return make_error<Stmt>( "Expected ':' after field name" );
 
-      if( !match( IDENTIFIER ) )
+      AstString field_type( &m_arena );
+      if( !match_type( field_type ) )
         return make_error<Stmt>( "Expected field name identifier" );
 
-      std::string field_type = previous().lexeme;
-
       if( !match( SEMICOLON ) )
         return make_error<Stmt>( "Expected ';' after field declaration" );
 
-      fields.push_back( { field_name, field_type } );
+      fields.push_back( { field_name, std::move( field_type ) } );
     }
 
   } while( !is_finished() );
 
-  return make_result<Stmt>( m_arena.alloc<ClassDecl>( name.c_str(), fields ) );
+  return make_result<Stmt>( m_arena.alloc<ClassDecl>( name, std::move( fields ) ) );
 }
 
 Result<Stmt> Parser::parse_block()
 {
-  Block * block = m_arena.alloc<Block>();
+  Block * block = m_arena.alloc<Block>( &m_arena );
   do
   {
     if( match( RBRACE ) )
@@ -395,22 +423,61 @@ Result<Expr> Parser::parse_primary()
 {
   if( match( NUMBER ) )
   {
-    int value         = std::stoi( previous().lexeme );
-    Literal * literal = m_arena.alloc<Literal>( Object::Integer( value ) );
+    // numbers are converted in place, without copying the lexeme
+    std::string_view lexeme = previous_lexeme();
+    const char * end        = lexeme.data() + lexeme.size();
+    Object value;
+    std::from_chars_result result;
+    if( lexeme.find( '.' ) == std::string_view::npos )
+    {
+      int32_t integer = 0;
+      result          = std::from_chars( lexeme.data(), end, integer );
+      value           = Object::Integer( integer );
+    }
+    else
+    {
+      double real = 0.0;
+      result      = std::from_chars( lexeme.data(), end, real );
+      value       = Object::Real( real );
+    }
+    if( result.ec != std::errc() )
+      return make_error<Expr>( "Number out of range: " + std::string( lexeme ) );
+
+    Literal * literal = m_arena.alloc<Literal>( value );
     return make_result<Expr>( literal );
   }
   else if( match( STRING ) )
   {
-    std::string str        = previous().lexeme;
-    StringObject * str_obj = m_gc.alloc<StringObject>( str.c_str() );
+    std::string str = unescape( previous_lexeme() );
+    StringObject * str_obj = intern_string( m_gc, str.c_str() );
     Literal * literal      = m_arena.alloc<Literal>( Object::String( str_obj ) );
     return make_result<Expr>( literal );
   }
   else if( match( IDENTIFIER ) )
   {
-    Variable * var = m_arena.alloc<Variable>( previous().lexeme );
+    Variable * var = m_arena.alloc<Variable>( previous().atom );
     return make_result<Expr>( var );
   }
+  else if( match( LBRACKET ) )
+  {
+    ExprList elements( &m_arena );
+    while( !is_finished() && peek().type != RBRACKET )
+    {
+      auto element = parse_expression();
+      if( !element.ok() )
+        return make_error<Expr>( element.error );
+
+      elements.push_back( element.node );
+
+      if( !match( COMMA ) )
+        break;
+    }
+
+    if( !match( RBRACKET ) )
+      return make_error<Expr>( "Expected ']' after list elements" );
+
+    return make_result<Expr>( m_arena.alloc<ListLiteral>( std::move( elements ) ) );
+  }
   else
   {
     return make_error<Expr>( "Not Implemented" );
@@ -422,7 +489,7 @@ Result<Expr> Parser::parse_unary()
 #if 0
   if( match( MINUS ) )
   {
-    std::string op = previous().lexeme;
+    std::string op( previous_lexeme() );
 
     auto right     = parse_unary();
     if( !right.ok() )
@@ -445,13 +512,13 @@ Result<Expr> Parser::parse_term()
 
   while( match( PLUS ) || match( MINUS ) )
   {
-    std::string op = previous().lexeme;
+    AstString op( previous_lexeme(), &m_arena );
 
     auto right = parse_factor();
     if( !right.ok() )
       return make_error<Expr>( right.error );
 
-    expr = m_arena.alloc<Binary>( op, expr, right.node );
+    expr = m_arena.alloc<Binary>( std::move( op ), expr, right.node );
   }
 
   return make_result( expr );
@@ -467,31 +534,36 @@ Result<Expr> Parser::parse_factor()
 
   while( match( STAR ) || match( SLASH ) )
   {
-    std::string op = previous().lexeme;
+    AstString op( previous_lexeme(), &m_arena );
 
     auto right = parse_unary();
     if( !right.ok() )
       return make_error<Expr>( right.error );
 
-    expr = m_arena.alloc<Binary>( op, expr, right.node );
+    expr = m_arena.alloc<Binary>( std::move( op ), expr, right.node );
   }
 
   return make_result( expr );
 }
 
-const Token & Parser::previous()
+Token Parser::previous()
 {
-  return *( m_pos - 1 );
+  return m_lexer.previous();
 }
 
-const Token & Parser::peek()
+Token Parser::peek()
 {
-  return *( m_pos );
+  return m_lexer.peek();
 }
 
-const Token & Parser::next()
+Token Parser::next()
 {
-  return *( m_pos++ );
+  return m_lexer.next();
+}
+
+std::string_view Parser::previous_lexeme()
+{
+  return m_lexer.lexeme( m_lexer.previous() );
 }
 
 bool Parser::match( TokenType type )
@@ -507,13 +579,39 @@ bool Parser::match( TokenType type )
   }
 }
 
+// A type name is an identifier, or a type name in brackets for a list
+bool Parser::match_type( AstString & type_name )
+{
+  if( match( IDENTIFIER ) )
+  {
+    type_name = previous_lexeme();
+    return true;
+  }
+
+  AstString element_type( &m_arena );
+  if( match( LBRACKET ) && match_type( element_type ) && match( RBRACKET ) )
+  {
+    type_name = "[";
+    type_name += element_type;
+    type_name += "]";
+    return true;
+  }
+  return false;
+}
+
 bool Parser::is_finished()
 {
-  return m_pos == m_tokens.end();
+  return m_lexer.is_finished();
 }
 
-Result<Program> parse( const std::vector<Token> & tokens, NodeAllocator & allocator, GarbageCollector & gc )
+Result<Program> parse( Lexer & lexer, NodeAllocator & allocator, GarbageCollector & gc )
 {
-  Parser parser( tokens, allocator, gc );
+  Parser parser( lexer, allocator, gc );
   return parser.run();
 }
+
+Result<Program> parse( std::string_view src, AtomTable & atoms, NodeAllocator & allocator, GarbageCollector & gc )
+{
+  Lexer lexer( src, atoms );
+  return parse( lexer, allocator, gc );
+}
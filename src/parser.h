@@ -10,14 +10,15 @@
 class Parser
 {
 public:
-  Parser( const std::vector<Token> & tokens, NodeAllocator & arena, GarbageCollector & gc );
+  // Tokens are pulled from the lexer while parsing, the source must outlive the parser
+  Parser( Lexer & lexer, NodeAllocator & arena, GarbageCollector & gc );
   Result<Program> run();
 
 private:
-  const std::vector<Token> m_tokens;
-  std::vector<Token>::const_iterator m_pos;
+  Lexer & m_lexer;
   NodeAllocator & m_arena;
   GarbageCollector & m_gc;
+  Atom m_append; // the method of lists
 
   Result<Stmt> parse_statement();
   Result<Stmt> parse_fn_decl();
@@ -37,11 +38,14 @@ private:
   Result<Expr> parse_assignment();
   Result<Expr> parse_call();
 
-  const Token & peek();
-  const Token & previous();
-  const Token & next();
+  Token peek();
+  Token previous();
+  Token next();
+  std::string_view previous_lexeme();
   bool match( TokenType type );
+  bool match_type( AstString & type_name );
   bool is_finished();
 };
 
-Result<Program> parse( const std::vector<Token> & tokens, NodeAllocator & allocator, GarbageCollector & gc );
+Result<Program> parse( Lexer & lexer, NodeAllocator & allocator, GarbageCollector & gc );
+Result<Program> parse( std::string_view src, AtomTable & atoms, NodeAllocator & allocator, GarbageCollector & gc );
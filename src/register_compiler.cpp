@@ -0,0 +1,443 @@
+#include "register_compiler.h"
+#include "object.h"
+#include <algorithm>
+#include <cassert>
+#include <limits>
+
+constexpr size_t NO_DEPTH = std::numeric_limits<size_t>::max();
+
+static bool is_jump( OpCode op )
+{
+  return op == OP_JMP || op == OP_JMP_IF_FALSE || op == OP_LOOP;
+}
+
+static RegOpCode arithmetic( OpCode op )
+{
+  switch( op )
+  {
+    case OP_ADD_INT :
+      return ROP_ADD_INT;
+    case OP_SUB_INT :
+      return ROP_SUB_INT;
+    case OP_MULT_INT :
+      return ROP_MULT_INT;
+    case OP_DIV_INT :
+      return ROP_DIV_INT;
+    case OP_ADD_FLOAT :
+      return ROP_ADD_FLOAT;
+    case OP_SUB_FLOAT :
+      return ROP_SUB_FLOAT;
+    case OP_MULT_FLOAT :
+      return ROP_MULT_FLOAT;
+    case OP_DIV_FLOAT :
+      return ROP_DIV_FLOAT;
+    case OP_CONCAT_STR :
+      return ROP_CONCAT_STR;
+    default :
+      assert( false && "Unreachable" );
+      return ROP_NOP;
+  }
+}
+
+bool compile_registers( CodeObject * code, std::string & error )
+{
+  RegisterCompiler compiler( code );
+  if( !compiler.run( error ) )
+  {
+    return false;
+  }
+
+  for( const Object & literal : code->literals )
+  {
+    if( literal.is_function() )
+    {
+      CodeObject * fn_code = &literal.as_function()->code_object;
+      if( fn_code->reg_instructions.empty() && !compile_registers( fn_code, error ) )
+      {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+RegisterCompiler::RegisterCompiler( CodeObject * code )
+    : m_code( code )
+    , m_base( code->num_locals )
+    , m_max_depth( 0 )
+    , m_block_start( 0 )
+{
+}
+
+bool RegisterCompiler::run( std::string & error )
+{
+  m_code->decode();
+
+  const std::vector<Instr> & in = m_code->decoded;
+  std::vector<RegInstr> & out   = m_code->reg_instructions;
+  out.clear();
+
+  // RK operands use the top bit to tell constants from registers
+  if( m_code->literals.size() > RK_CONSTANT )
+  {
+    error = "Too many constants in a function for the register engine";
+    return false;
+  }
+
+  std::vector<bool> is_label( in.size(), false );
+  for( const Instr & instr : in )
+  {
+    if( instr.op == OP_LOAD_LOCAL || instr.op == OP_STORE_LOCAL )
+    {
+      m_base = std::max( m_base, uint16_t( instr.arg + 1 ) );
+    }
+    else if( is_jump( instr.op ) )
+    {
+      is_label[instr.arg] = true;
+    }
+  }
+
+  // stack depth at each jump target, the smallest depth of all jumps to it
+  std::vector<size_t> label_depth( in.size(), NO_DEPTH );
+  // index of the first register instruction for every stack instruction
+  std::vector<uint32_t> position( in.size(), 0 );
+  std::vector<size_t> jumps;
+  bool reachable = true;
+
+  for( size_t i = 0; i < in.size(); i++ )
+  {
+    const Instr & instr = in[i];
+
+    if( is_label[i] )
+    {
+      size_t depth = label_depth[i];
+      if( reachable )
+      {
+        flush();
+        depth = std::min( depth, m_stack.size() );
+      }
+
+      // values that are only on the stack on some paths are never used after the join
+      m_stack.resize( depth == NO_DEPTH ? 0 : depth );
+      for( size_t k = 0; k < m_stack.size(); k++ )
+      {
+        m_stack[k] = { Operand::TEMP, uint16_t( m_base + k ) };
+      }
+
+      m_block_start = out.size();
+      reachable     = true;
+    }
+
+    position[i] = ( uint32_t ) out.size();
+
+    switch( instr.op )
+    {
+      case OP_NOP :
+        break;
+      case OP_LOAD_CONST :
+        push( Operand::CONST, instr.arg );
+        break;
+      case OP_LOAD_LOCAL :
+        push( Operand::LOCAL, instr.arg );
+        break;
+      case OP_STORE_LOCAL :
+        {
+          Operand value = pop();
+
+          // pending reads of the local must see the old value
+          bool aliased = false;
+          for( size_t k = 0; k < m_stack.size(); k++ )
+          {
+            if( m_stack[k].kind == Operand::LOCAL && m_stack[k].index == instr.arg )
+            {
+              materialize( k );
+              aliased = true;
+            }
+          }
+
+          if( aliased || value.kind != Operand::TEMP || !retarget( value.index, instr.arg ) )
+          {
+            emit( ROP_MOVE, instr.arg, rk( value ) );
+          }
+          break;
+        }
+      case OP_LOAD_GLOBAL :
+        emit( ROP_LOAD_GLOBAL, next_register(), instr.arg );
+        push_temp();
+        break;
+      case OP_STORE_GLOBAL :
+        {
+          Operand value = pop();
+          emit( ROP_STORE_GLOBAL, instr.arg, rk( value ) );
+          break;
+        }
+      case OP_ADD_INT :
+      case OP_SUB_INT :
+      case OP_MULT_INT :
+      case OP_DIV_INT :
+      case OP_ADD_FLOAT :
+      case OP_SUB_FLOAT :
+      case OP_MULT_FLOAT :
+      case OP_DIV_FLOAT :
+      case OP_CONCAT_STR :
+        {
+          Operand lhs = pop();
+          Operand rhs = pop();
+          emit( arithmetic( instr.op ), next_register(), rk( lhs ), rk( rhs ) );
+          push_temp();
+          break;
+        }
+      case OP_PRINT :
+      case OP_PRINTLN :
+        {
+          Operand value = pop();
+          emit( instr.op == OP_PRINT ? ROP_PRINT : ROP_PRINTLN, rk( value ) );
+          break;
+        }
+      case OP_CALL :
+        {
+          // callee and arguments have to be in consecutive registers
+          size_t num_args = instr.arg;
+          assert( num_args < m_stack.size() );
+          size_t first = m_stack.size() - num_args - 1;
+          for( size_t k = first; k < m_stack.size(); k++ )
+          {
+            materialize( k );
+          }
+          m_stack.resize( first );
+          emit( ROP_CALL, next_register(), ( uint16_t ) num_args );
+          push_temp();
+          break;
+        }
+      case OP_RETURN :
+        {
+          Operand value = pop();
+          emit( ROP_RETURN, rk( value ) );
+          reachable = false;
+          break;
+        }
+      case OP_GET_PROPERTY :
+        {
+          Operand object = pop();
+          emit( ROP_GET_PROPERTY, next_register(), rk( object ), instr.arg );
+          push_temp();
+          break;
+        }
+      case OP_SET_PROPERTY :
+        {
+          Operand object = pop();
+          Operand value  = pop();
+          emit( ROP_SET_PROPERTY, rk( object ), instr.arg, rk( value ) );
+          break;
+        }
+      case OP_GET_FIELD :
+        {
+          Operand object = pop();
+          emit( ROP_GET_FIELD, next_register(), rk( object ), instr.arg );
+          push_temp();
+          break;
+        }
+      case OP_SET_FIELD :
+        {
+          Operand object = pop();
+          Operand value  = pop();
+          emit( ROP_SET_FIELD, rk( object ), instr.arg, rk( value ) );
+          break;
+        }
+      case OP_BUILD_LIST :
+        {
+          // the elements have to be in consecutive registers, like call arguments
+          size_t num_values = instr.arg;
+          assert( num_values <= m_stack.size() );
+          size_t first = m_stack.size() - num_values;
+          for( size_t k = first; k < m_stack.size(); k++ )
+          {
+            materialize( k );
+          }
+          m_stack.resize( first );
+          emit( ROP_BUILD_LIST, next_register(), ( uint16_t ) num_values );
+          push_temp();
+          break;
+        }
+      case OP_INDEX_GET :
+        {
+          Operand index = pop();
+          Operand list  = pop();
+          emit( ROP_INDEX_GET, next_register(), rk( list ), rk( index ) );
+          push_temp();
+          break;
+        }
+      case OP_INDEX_SET :
+        {
+          Operand index = pop();
+          Operand list  = pop();
+          Operand value = pop();
+          emit( ROP_INDEX_SET, rk( list ), rk( index ), rk( value ) );
+          break;
+        }
+      case OP_APPEND :
+        {
+          Operand list  = pop();
+          Operand value = pop();
+          emit( ROP_APPEND, rk( list ), rk( value ) );
+          break;
+        }
+      case OP_JMP :
+      case OP_LOOP :
+      case OP_JMP_IF_FALSE :
+        {
+          Operand cond = { Operand::TEMP, 0 };
+          if( instr.op == OP_JMP_IF_FALSE )
+          {
+            cond = pop();
+          }
+
+          flush();
+          label_depth[instr.arg] = std::min( label_depth[instr.arg], m_stack.size() );
+          jumps.push_back( out.size() );
+
+          if( instr.op == OP_JMP_IF_FALSE )
+          {
+            emit( ROP_JMP_IF_FALSE, rk( cond ), ( uint16_t ) instr.arg );
+          }
+          else
+          {
+            emit( ROP_JMP, ( uint16_t ) instr.arg );
+            reachable = false;
+          }
+          break;
+        }
+      case OP_POP :
+        ( void ) pop();
+        break;
+      case OP_HALT :
+        emit( ROP_HALT );
+        reachable = false;
+        break;
+      default :
+        assert( false && "Superinstructions can not be lowered" );
+        break;
+    }
+  }
+
+  if( RK_CONSTANT <= m_base + m_max_depth )
+  {
+    out.clear();
+    error = "Too many registers in a function for the register engine";
+    return false;
+  }
+  if( out.size() > std::numeric_limits<uint16_t>::max() )
+  {
+    out.clear();
+    error = "Function too long for the jumps of the register engine";
+    return false;
+  }
+
+  // jump targets are still indices into the stack instructions
+  for( size_t j : jumps )
+  {
+    RegInstr & jump = out[j];
+    if( jump.op == ROP_JMP )
+    {
+      jump.a = ( uint16_t ) position[jump.a];
+    }
+    else
+    {
+      jump.b = ( uint16_t ) position[jump.b];
+    }
+  }
+
+  m_code->num_registers = ( uint16_t ) ( m_base + m_max_depth );
+  return true;
+}
+
+void RegisterCompiler::emit( RegOpCode op, uint16_t a, uint16_t b, uint16_t c )
+{
+  m_code->reg_instructions.push_back( { op, a, b, c } );
+}
+
+void RegisterCompiler::push( Operand::Kind kind, uint16_t index )
+{
+  m_stack.push_back( { kind, index } );
+  m_max_depth = std::max( m_max_depth, m_stack.size() );
+}
+
+void RegisterCompiler::push_temp()
+{
+  push( Operand::TEMP, next_register() );
+}
+
+RegisterCompiler::Operand RegisterCompiler::pop()
+{
+  assert( !m_stack.empty() );
+  Operand operand = m_stack.back();
+  m_stack.pop_back();
+  return operand;
+}
+
+uint16_t RegisterCompiler::rk( const Operand & operand ) const
+{
+  return operand.kind == Operand::CONST ? ( operand.index | RK_CONSTANT ) : operand.index;
+}
+
+uint16_t RegisterCompiler::next_register() const
+{
+  return ( uint16_t ) ( m_base + m_stack.size() );
+}
+
+// Copy a pending local or constant into the register of its stack slot.
+void RegisterCompiler::materialize( size_t depth )
+{
+  Operand & operand = m_stack[depth];
+  if( operand.kind != Operand::TEMP )
+  {
+    uint16_t reg = ( uint16_t ) ( m_base + depth );
+    emit( ROP_MOVE, reg, rk( operand ) );
+    operand = { Operand::TEMP, reg };
+  }
+}
+
+void RegisterCompiler::flush()
+{
+  for( size_t k = 0; k < m_stack.size(); k++ )
+  {
+    materialize( k );
+  }
+}
+
+// If the previous instruction computed the temporary, let it write to the local directly.
+bool RegisterCompiler::retarget( uint16_t temp, uint16_t local )
+{
+  std::vector<RegInstr> & out = m_code->reg_instructions;
+  if( out.size() <= m_block_start )
+  {
+    return false;
+  }
+
+  RegInstr & last = out.back();
+  switch( last.op )
+  {
+    case ROP_MOVE :
+    case ROP_LOAD_GLOBAL :
+    case ROP_ADD_INT :
+    case ROP_SUB_INT :
+    case ROP_MULT_INT :
+    case ROP_DIV_INT :
+    case ROP_ADD_FLOAT :
+    case ROP_SUB_FLOAT :
+    case ROP_MULT_FLOAT :
+    case ROP_DIV_FLOAT :
+    case ROP_CONCAT_STR :
+    case ROP_GET_PROPERTY :
+    case ROP_GET_FIELD :
+    case ROP_INDEX_GET :
+      if( last.a == temp )
+      {
+        last.a = local;
+        return true;
+      }
+      return false;
+    default :
+      return false;
+  }
+}
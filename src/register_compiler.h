@@ -0,0 +1,51 @@
+#pragma once
+
+#include "bytecode.h"
+
+#include <string>
+#include <vector>
+
+// Lowers the stack based instructions of a CodeObject into three-address register
+// instructions. The operand stack is simulated at compile time, every stack slot
+// maps to a register above the locals. Locals and constants are not copied into
+// registers, instructions refer to them directly.
+class RegisterCompiler
+{
+public:
+  RegisterCompiler( CodeObject * code );
+  bool run( std::string & error );
+
+private:
+  struct Operand
+  {
+    enum Kind
+    {
+      TEMP,
+      LOCAL,
+      CONST,
+    };
+
+    Kind kind;
+    uint16_t index;
+  };
+
+  CodeObject * m_code;
+  uint16_t m_base; // first register after the locals
+  size_t m_max_depth;
+  size_t m_block_start;
+  std::vector<Operand> m_stack;
+
+  void emit( RegOpCode op, uint16_t a = 0, uint16_t b = 0, uint16_t c = 0 );
+  void push( Operand::Kind, uint16_t index );
+  void push_temp();
+  Operand pop();
+  uint16_t rk( const Operand & ) const;
+  uint16_t next_register() const;
+  void materialize( size_t depth );
+  void flush();
+  bool retarget( uint16_t temp, uint16_t local );
+};
+
+// Compiles the code and every function in its literals that is not compiled yet, so
+// that a function too large for the 16 bit operands is rejected before running.
+bool compile_registers( CodeObject *, std::string & error );
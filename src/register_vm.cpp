@@ -0,0 +1,380 @@
+#include "builtin.h"
+#include "dispatch.h"
+#include "object.h"
+#include "register_compiler.h"
+#include "vm.h"
+#include <algorithm>
+#include <cassert>
+#include <iomanip>
+
+#if USE_COMPUTED_GOTO
+#define CASE( op ) \
+  case op :        \
+  label_##op :
+#define DISPATCH()                    \
+  do                                  \
+  {                                   \
+    instr = ip++;                     \
+    goto * dispatch_table[instr->op]; \
+  } while( 0 )
+#else
+#define CASE( op ) case op :
+#define DISPATCH() break
+#endif
+
+#define RK( x ) ( ( ( x ) & RK_CONSTANT ) ? K[( x ) & ~RK_CONSTANT] : R[x] )
+
+// Make the frame on top of m_register_frames the current one.
+#define LOAD_FRAME()                             \
+  do                                             \
+  {                                              \
+    frame = &m_register_frames.back();           \
+    ip    = frame->ip;                           \
+    R     = m_stack.data() + frame->bp;          \
+    K     = frame->code_object->literals.data(); \
+  } while( 0 )
+
+int VirtualMachine::run_registers( CodeObject * co )
+{
+#if USE_COMPUTED_GOTO
+  static const void * const dispatch_table[] = {
+      // clang-format off
+      &&label_ROP_NOP,
+      &&label_ROP_MOVE,
+      &&label_ROP_LOAD_GLOBAL,
+      &&label_ROP_STORE_GLOBAL,
+      &&label_ROP_ADD_INT,
+      &&label_ROP_SUB_INT,
+      &&label_ROP_MULT_INT,
+      &&label_ROP_DIV_INT,
+      &&label_ROP_ADD_FLOAT,
+      &&label_ROP_SUB_FLOAT,
+      &&label_ROP_MULT_FLOAT,
+      &&label_ROP_DIV_FLOAT,
+      &&label_ROP_CONCAT_STR,
+      &&label_ROP_PRINT,
+      &&label_ROP_PRINTLN,
+      &&label_ROP_CALL,
+      &&label_ROP_RETURN,
+      &&label_ROP_GET_PROPERTY,
+      &&label_ROP_SET_PROPERTY,
+      &&label_ROP_GET_FIELD,
+      &&label_ROP_SET_FIELD,
+      &&label_ROP_BUILD_LIST,
+      &&label_ROP_INDEX_GET,
+      &&label_ROP_INDEX_SET,
+      &&label_ROP_APPEND,
+      &&label_ROP_JMP,
+      &&label_ROP_JMP_IF_FALSE,
+      &&label_ROP_HALT,
+      // clang-format on
+  };
+  static_assert( sizeof( dispatch_table ) / sizeof( dispatch_table[0] ) == ROP_HALT + 1 );
+#endif
+
+  bind_globals( co );
+  if( !compile_registers( co, m_runtime_error_message ) )
+  {
+    m_err << "COMPILE ERROR: " << m_runtime_error_message << std::endl;
+    return 1;
+  }
+  if( m_options.stack_size < co->num_registers )
+  {
+    m_err << "RUNTIME ERROR: Stack overflow" << std::endl;
+    return 1;
+  }
+  m_stack.resize( co->num_registers );
+  m_register_frames.reserve( m_options.max_call_depth );
+  m_register_frames.push_back( { co, co->reg_instructions.data(), 0 } );
+
+  RegisterFrame * frame  = nullptr;
+  const RegInstr * ip    = nullptr;
+  const RegInstr * instr = nullptr;
+  Object * R             = nullptr;
+  const Object * K       = nullptr;
+  LOAD_FRAME();
+
+  for( ;; )
+  {
+    instr = ip++;
+    switch( instr->op )
+    {
+      CASE( ROP_NOP )
+      {
+        DISPATCH();
+      }
+      CASE( ROP_MOVE )
+      {
+        R[instr->a] = RK( instr->b );
+        DISPATCH();
+      }
+      CASE( ROP_LOAD_GLOBAL )
+      {
+        R[instr->a] = m_globals[instr->b];
+        DISPATCH();
+      }
+      CASE( ROP_STORE_GLOBAL )
+      {
+        store_global( instr->a, RK( instr->b ) );
+        DISPATCH();
+      }
+      CASE( ROP_ADD_INT )
+      {
+        R[instr->a] = Object::Integer( RK( instr->b ).as_integer() + RK( instr->c ).as_integer() );
+        DISPATCH();
+      }
+      CASE( ROP_SUB_INT )
+      {
+        R[instr->a] = Object::Integer( RK( instr->b ).as_integer() - RK( instr->c ).as_integer() );
+        DISPATCH();
+      }
+      CASE( ROP_MULT_INT )
+      {
+        R[instr->a] = Object::Integer( RK( instr->b ).as_integer() * RK( instr->c ).as_integer() );
+        DISPATCH();
+      }
+      CASE( ROP_DIV_INT )
+      {
+        int rhs = RK( instr->c ).as_integer();
+        if( rhs == 0 )
+        {
+          RUNTIME_ERROR( "Division by zero" );
+        }
+        R[instr->a] = Object::Integer( RK( instr->b ).as_integer() / rhs );
+        DISPATCH();
+      }
+      CASE( ROP_ADD_FLOAT )
+      {
+        R[instr->a] = Object::Real( RK( instr->b ).as_real() + RK( instr->c ).as_real() );
+        DISPATCH();
+      }
+      CASE( ROP_SUB_FLOAT )
+      {
+        R[instr->a] = Object::Real( RK( instr->b ).as_real() - RK( instr->c ).as_real() );
+        DISPATCH();
+      }
+      CASE( ROP_MULT_FLOAT )
+      {
+        R[instr->a] = Object::Real( RK( instr->b ).as_real() * RK( instr->c ).as_real() );
+        DISPATCH();
+      }
+      CASE( ROP_DIV_FLOAT )
+      {
+        R[instr->a] = Object::Real( RK( instr->b ).as_real() / RK( instr->c ).as_real() );
+        DISPATCH();
+      }
+      CASE( ROP_CONCAT_STR )
+      {
+        R[instr->a] = Object::String( concat_strings( m_gc, RK( instr->b ).as_string(), RK( instr->c ).as_string() ) );
+        if( m_gc.should_collect() )
+        {
+          collect_garbage();
+        }
+        DISPATCH();
+      }
+      CASE( ROP_PRINT )
+      {
+        m_out << RK( instr->a );
+        DISPATCH();
+      }
+      CASE( ROP_PRINTLN )
+      {
+        m_out << RK( instr->a ) << std::endl;
+        DISPATCH();
+      }
+      CASE( ROP_CALL )
+      {
+        Object callee = R[instr->a + instr->b];
+        if( callee.is_function() )
+        {
+          if( m_register_frames.size() == m_options.max_call_depth )
+          {
+            RUNTIME_ERROR( "Stack overflow" );
+          }
+
+          CodeObject * code = &callee.as_function()->code_object;
+          if( code->reg_instructions.empty() && !compile_registers( code, m_runtime_error_message ) )
+          {
+            goto label_runtime_error;
+          }
+
+          // the register file grows up to stack_size slots, the registers of the callee
+          // after its arguments may still hold values of a returned frame
+          size_t bp  = frame->bp + instr->a;
+          size_t top = bp + code->num_registers;
+          if( m_options.stack_size < top )
+          {
+            RUNTIME_ERROR( "Stack overflow" );
+          }
+          if( m_stack.size() < top )
+          {
+            m_stack.resize( top );
+          }
+          std::fill( m_stack.data() + bp + instr->b, m_stack.data() + top, Object() );
+
+          frame->ip = ip;
+          m_register_frames.push_back( { code, code->reg_instructions.data(), bp } );
+          LOAD_FRAME();
+        }
+        else if( callee.is_class() )
+        {
+          InstanceObject * instance = m_gc.alloc_young<InstanceObject>( callee.as_class() );
+          R[instr->a]               = Object::Instance( instance );
+          if( m_gc.should_collect() )
+          {
+            collect_garbage();
+          }
+        }
+        else if( callee.is_native() )
+        {
+          R[instr->a] = callee.as_native()( this, instr->b, &R[instr->a] );
+          if( m_gc.should_collect() )
+          {
+            collect_garbage();
+          }
+        }
+        else
+        {
+          RUNTIME_ERROR( "Error: not a callable object" );
+        }
+        DISPATCH();
+      }
+      CASE( ROP_RETURN )
+      {
+        Object value = RK( instr->a );
+        size_t bp    = frame->bp;
+        m_register_frames.pop_back();
+        m_stack[bp] = value;
+        LOAD_FRAME();
+        DISPATCH();
+      }
+      CASE( ROP_GET_PROPERTY )
+      {
+        Object obj = RK( instr->b );
+        if( obj.is_instance() )
+        {
+          CodeObject * global = frame->code_object->get_root();
+          int slot            = obj.as_instance()->klass->find_field( global->names[instr->c].c_str() );
+          R[instr->a]         = slot < 0 ? Object::Nil() : obj.as_instance()->fields[slot];
+        }
+        else
+        {
+          RUNTIME_ERROR( "not a object" );
+        }
+        DISPATCH();
+      }
+      CASE( ROP_SET_PROPERTY )
+      {
+        Object obj = RK( instr->a );
+        if( obj.is_instance() )
+        {
+          const std::string & name = frame->code_object->get_root()->names[instr->b];
+          int slot                 = obj.as_instance()->klass->find_field( name.c_str() );
+          if( slot < 0 )
+          {
+            RUNTIME_ERROR( "Undefined field '" + name + "'" );
+          }
+          store_field( obj.as_instance(), slot, RK( instr->c ) );
+        }
+        else
+        {
+          RUNTIME_ERROR( "Can only set properties on instances" );
+        }
+        DISPATCH();
+      }
+      CASE( ROP_GET_FIELD )
+      {
+        Object obj = RK( instr->b );
+        if( !obj.is_instance() )
+        {
+          RUNTIME_ERROR( "not a object" );
+        }
+        R[instr->a] = obj.as_instance()->fields[instr->c];
+        DISPATCH();
+      }
+      CASE( ROP_SET_FIELD )
+      {
+        Object obj = RK( instr->a );
+        if( !obj.is_instance() )
+        {
+          RUNTIME_ERROR( "not a object" );
+        }
+        store_field( obj.as_instance(), instr->b, RK( instr->c ) );
+        DISPATCH();
+      }
+      // The type checker only lets lists and int indices through
+      CASE( ROP_BUILD_LIST )
+      {
+        ListObject * list = m_gc.alloc<ListObject>( &R[instr->a], instr->b );
+        for( size_t i = 0; i < list->count; i++ )
+        {
+          m_gc.write_barrier( list, nullptr, gc_object( list->items[i] ) );
+        }
+        R[instr->a] = Object::List( list );
+        if( m_gc.should_collect() )
+        {
+          collect_garbage();
+        }
+        DISPATCH();
+      }
+      CASE( ROP_INDEX_GET )
+      {
+        ListObject * list = RK( instr->b ).as_list();
+        int index         = RK( instr->c ).as_integer();
+        if( index < 0 || list->count <= ( size_t ) index )
+        {
+          RUNTIME_ERROR( "List index out of range" );
+        }
+        R[instr->a] = list->items[index];
+        DISPATCH();
+      }
+      CASE( ROP_INDEX_SET )
+      {
+        ListObject * list = RK( instr->a ).as_list();
+        int index         = RK( instr->b ).as_integer();
+        if( index < 0 || list->count <= ( size_t ) index )
+        {
+          RUNTIME_ERROR( "List index out of range" );
+        }
+        store_element( list, index, RK( instr->c ) );
+        DISPATCH();
+      }
+      CASE( ROP_APPEND )
+      {
+        append_element( RK( instr->a ).as_list(), RK( instr->b ) );
+        if( m_gc.should_collect() )
+        {
+          collect_garbage();
+        }
+        DISPATCH();
+      }
+      CASE( ROP_JMP )
+      {
+        ip = frame->code_object->reg_instructions.data() + instr->a;
+        DISPATCH();
+      }
+      CASE( ROP_JMP_IF_FALSE )
+      {
+        if( RK( instr->a ).is_falsy() )
+        {
+          ip = frame->code_object->reg_instructions.data() + instr->b;
+        }
+        DISPATCH();
+      }
+      CASE( ROP_HALT )
+      {
+        m_register_frames.pop_back();
+        return 0;
+      }
+      default :
+        m_err << "Unhandled instruction: 0x" << std::hex << std::setw( 2 ) << std::setfill( '0' )
+              << static_cast<int>( instr->op ) << "\n";
+        goto label_runtime_error;
+    }
+  }
+
+label_runtime_error:
+  m_err << "RUNTIME ERROR: " << m_runtime_error_message << std::endl;
+  m_register_frames.clear();
+  return 1;
+}
@@ -0,0 +1,148 @@
+#include "superinstructions.h"
+#include <algorithm>
+
+// Frequencies are the dynamic counts of the sequences in tests/programs/*.bs, summed
+// over the output of `brass --profile-sequences <program>` with the default options.
+// Measure them again when the compiler or the optimizer change the emitted code.
+// To add a superinstruction, add an entry here and a handler in VirtualMachine::run_stack().
+static std::vector<Superinstruction> make_table()
+{
+  std::vector<Superinstruction> table = {
+      // clang-format off
+      { OP_ADD_LL,             3, { OP_LOAD_LOCAL, OP_LOAD_LOCAL, OP_ADD_INT },                   1000000 },
+      { OP_ADD_LL_STORE,       4, { OP_LOAD_LOCAL, OP_LOAD_LOCAL, OP_ADD_INT, OP_STORE_LOCAL },   1000000 },
+      { OP_SUB_KL,             3, { OP_LOAD_CONST, OP_LOAD_LOCAL, OP_SUB_INT },                   1000005 },
+      { OP_SUB_KL_STORE,       4, { OP_LOAD_CONST, OP_LOAD_LOCAL, OP_SUB_INT, OP_STORE_LOCAL },   1000000 },
+      { OP_JMP_IF_LOCAL_FALSE, 2, { OP_LOAD_LOCAL, OP_JMP_IF_FALSE },                        1000007 },
+      { OP_STORE_GLOBAL_CONST, 2, { OP_LOAD_CONST, OP_STORE_GLOBAL },                        4 },
+      { OP_CALL_GLOBAL,        2, { OP_LOAD_GLOBAL, OP_CALL },                                9 },
+      // clang-format on
+  };
+
+  // a superinstruction saves (length - 1) dispatches every time it is executed
+  std::stable_sort(
+      table.begin(),
+      table.end(),
+      []( const Superinstruction & a, const Superinstruction & b )
+      { return a.frequency * ( a.length - 1 ) > b.frequency * ( b.length - 1 ); } );
+
+  return table;
+}
+
+const std::vector<Superinstruction> & superinstructions()
+{
+  static const std::vector<Superinstruction> table = make_table();
+  return table;
+}
+
+static bool matches( const std::vector<Instr> & code, size_t pos, const Superinstruction & super )
+{
+  if( code.size() < pos + super.length )
+  {
+    return false;
+  }
+
+  for( size_t i = 0; i < super.length; i++ )
+  {
+    if( code[pos + i].op != super.sequence[i] )
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+void fuse_superinstructions( std::vector<Instr> & code )
+{
+  const std::vector<Superinstruction> & table = superinstructions();
+
+  size_t pos = 0;
+  while( pos < code.size() )
+  {
+    size_t length = 1;
+    for( const Superinstruction & super : table )
+    {
+      if( matches( code, pos, super ) )
+      {
+        code[pos].op = super.fused;
+        length       = super.length;
+        break;
+      }
+    }
+    pos += length;
+  }
+}
+
+void SequenceProfile::record( const Instr * instr )
+{
+  if( !m_previous || instr != m_previous + 1 )
+  {
+    m_length = 0;
+  }
+  m_previous = instr;
+  m_window   = ( m_window << 8 ) | ( instr->op + 1u );
+  m_length   = std::min<size_t>( m_length + 1, 4 );
+
+  for( size_t length = 2; length <= m_length; length++ )
+  {
+    uint64_t key = m_window & ( ( 1ull << ( 8 * length ) ) - 1 );
+    if( uint64_t * count = m_counts.find( key ) )
+    {
+      ( *count )++;
+    }
+    else
+    {
+      m_counts.set( key, 1 );
+    }
+  }
+}
+
+uint64_t SequenceProfile::count( const std::vector<OpCode> & sequence ) const
+{
+  uint64_t key = 0;
+  for( OpCode op : sequence )
+  {
+    key = ( key << 8 ) | ( op + 1u );
+  }
+  const uint64_t * count = m_counts.find( key );
+  return count ? *count : 0;
+}
+
+void SequenceProfile::print( std::ostream & out, size_t n ) const
+{
+  struct Entry
+  {
+    uint64_t key;
+    uint64_t count;
+    uint64_t saved;
+  };
+
+  std::vector<Entry> entries;
+  m_counts.for_each(
+      [&entries]( const uint64_t & key, const uint64_t & count )
+      {
+        size_t length = 0;
+        for( uint64_t rest = key; rest; rest >>= 8 )
+        {
+          length++;
+        }
+        entries.push_back( { key, count, count * ( length - 1 ) } );
+      } );
+  std::sort( entries.begin(),
+             entries.end(),
+             []( const Entry & a, const Entry & b )
+             { return a.saved != b.saved ? a.saved > b.saved : a.key < b.key; } );
+
+  for( size_t i = 0; i < entries.size() && i < n; i++ )
+  {
+    for( int shift = 24; shift >= 0; shift -= 8 )
+    {
+      uint64_t op = ( entries[i].key >> shift ) & 0xff;
+      if( op )
+      {
+        out << op_name( ( OpCode ) ( op - 1 ) ) << " ";
+      }
+    }
+    out << entries[i].count << "\n";
+  }
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "bytecode.h"
+#include "utils.h"
+
+#include <array>
+#include <ostream>
+#include <vector>
+
+struct Superinstruction
+{
+  OpCode fused;
+  size_t length;
+  std::array<OpCode, 4> sequence;
+  uint64_t frequency; // number of times the sequence was executed in the benchmark programs
+};
+
+// Dynamic counts of the sequences of 2 to 4 adjacent instructions executed by the stack
+// engine, collected when VMOptions::profile is set. Instructions are only adjacent if
+// they follow each other in the code, a jump, call or return starts a new sequence.
+// The frequencies of the table in superinstructions.cpp are measured with it.
+class SequenceProfile
+{
+public:
+  void record( const Instr * instr );
+  uint64_t count( const std::vector<OpCode> & sequence ) const;
+
+  // The n sequences fusion would save the most dispatches for, one per line
+  void print( std::ostream &, size_t n ) const;
+
+private:
+  HashMap<uint64_t, uint64_t> m_counts; // by sequence, one opcode + 1 per byte
+  const Instr * m_previous = nullptr;
+  uint64_t m_window        = 0; // the last opcodes + 1, the latest in the low byte
+  size_t m_length          = 0;
+};
+
+// Candidate superinstructions, most profitable first.
+const std::vector<Superinstruction> & superinstructions();
+
+// Replace the first instruction of every matched sequence with its superinstruction.
+// The rest of the sequence is left in place so that the fused handler can read the
+// operands from there and jumps into the middle of a sequence still work.
+void fuse_superinstructions( std::vector<Instr> & );
@@ -1,8 +1,16 @@
 #pragma once
 
+#include <cstdint>
 #include <cstring>
+#include <functional>
+#include <new>
 #include <string>
 
+#if defined( __SSE2__ ) || defined( _M_X64 )
+#define BRASS_SSE2
+#include <emmintrin.h>
+#endif
+
 using uint = unsigned int;
 
 #ifdef WIN32
@@ -38,162 +46,410 @@ Result<T> make_error( const std::string & error )
   return r;
 }
 
-template <typename T>
-class LinkedList
+// Hashing and equality of the keys of a HashMap. C strings are compared by their
+// characters, the map does not copy them so they have to outlive it.
+template <typename K>
+struct HashTraits
 {
-public:
-  struct Node
+  static size_t hash( const K & key )
   {
-    T value;
-    Node * next;
-    Node( const T & v, Node * n )
-        : value( v )
-        , next( n )
-    {
-    }
-  };
+    return std::hash<K>()( key );
+  }
 
-  LinkedList()
-      : m_head( nullptr )
-      , m_tail( nullptr )
+  static bool equal( const K & a, const K & b )
   {
+    return a == b;
   }
+};
 
-  ~LinkedList()
+// The index of the lowest set bit, mask must not be zero
+inline size_t lowest_bit( uint32_t mask )
+{
+#if defined( __GNUC__ )
+  return ( size_t ) __builtin_ctz( mask );
+#else
+  size_t i = 0;
+  while( !( mask & 1 ) )
   {
-    Node * curr = m_head;
-    while( curr )
-    {
-      Node * tmp = curr;
-      curr       = curr->next;
-      delete tmp;
-    }
-    m_head = nullptr;
-    m_tail = nullptr;
+    mask >>= 1;
+    i++;
   }
+  return i;
+#endif
+}
 
-  void push_back( const T & value )
+inline size_t count_bits( uint32_t mask )
+{
+#if defined( __GNUC__ )
+  return ( size_t ) __builtin_popcount( mask );
+#else
+  size_t n = 0;
+  for( ; mask; mask &= mask - 1 )
   {
-    push_back( new Node( value, nullptr ) );
+    n++;
   }
+  return n;
+#endif
+}
 
-  void push_back( Node * node )
+// FNV-1a
+inline size_t hash_bytes( const char * bytes, size_t length )
+{
+  size_t hash = 14695981039346656037ull;
+  for( size_t i = 0; i < length; i++ )
   {
-    if( !m_head )
-      m_head = node;
-
-    if( m_tail )
-      m_tail->next = node;
-
-    m_tail = node;
+    hash = ( hash ^ ( unsigned char ) bytes[i] ) * 1099511628211ull;
   }
+  return hash;
+}
 
-  Node * head()
+template <>
+struct HashTraits<const char *>
+{
+  static size_t hash( const char * key )
   {
-    return m_head;
+    size_t hash = 14695981039346656037ull;
+    for( ; *key; key++ )
+    {
+      hash = ( hash ^ ( unsigned char ) *key ) * 1099511628211ull;
+    }
+    return hash;
   }
 
-  Node * tail()
+  static bool equal( const char * a, const char * b )
   {
-    return m_tail;
+    return a == b || strcmp( a, b ) == 0;
   }
-
-private:
-  Node * m_head;
-  Node * m_tail;
 };
 
-template <typename T>
+// An open addressing hash table in the style of a swiss table. Every slot has a
+// control byte, which is either EMPTY, DELETED or the low 7 bits of the hash of its
+// key. The control bytes are probed a group of 16 at a time, with SSE2 when it is
+// available, so most lookups compare a single key. The groups are probed in
+// triangular order, which visits every group of a power of two table.
+//
+// The table grows to the next power of two when more than 7/8 of its slots are in
+// use. Erased slots become DELETED and are reclaimed when the table is rebuilt.
+template <typename K, typename V, typename Traits = HashTraits<K>>
 class HashMap
 {
 public:
-  HashMap( size_t capacity = 256 )
+  static constexpr size_t GROUP_SIZE = 16;
+
+  HashMap( size_t capacity = GROUP_SIZE )
   {
-    m_capacity = capacity;
-    m_table    = new Entry *[m_capacity];
-    for( size_t i = 0; i < m_capacity; i++ )
+    allocate( round_capacity( capacity ) );
+  }
+
+  HashMap( const HashMap & )             = delete;
+  HashMap & operator=( const HashMap & ) = delete;
+
+  ~HashMap()
+  {
+    destroy();
+  }
+
+  void set( const K & key, const V & value )
+  {
+    size_t hash = mix( Traits::hash( key ) );
+    if( V * found = find( key, hash ) )
     {
-      m_table[i] = nullptr;
+      *found = value;
+      return;
     }
+
+    if( m_growth_left == 0 )
+    {
+      // rebuild at the same size if that frees enough tombstones
+      rehash( m_size + 1 <= max_load( m_capacity ) / 2 ? m_capacity : m_capacity * 2 );
+    }
+    insert( key, value, hash );
   }
 
-  ~HashMap()
+  bool get( const K & key, V & value )
   {
-    clear();
-    delete[] m_table;
+    if( V * found = find( key ) )
+    {
+      value = *found;
+      return true;
+    }
+    return false;
+  }
+
+  V * find( const K & key )
+  {
+    return find( key, mix( Traits::hash( key ) ) );
+  }
+
+  const V * find( const K & key ) const
+  {
+    return const_cast<HashMap *>( this )->find( key );
+  }
+
+  bool erase( const K & key )
+  {
+    size_t hash = mix( Traits::hash( key ) );
+    size_t slot = find_slot( key, hash );
+    if( slot == NOT_FOUND )
+    {
+      return false;
+    }
+
+    m_slots[slot].~Slot();
+    m_ctrl[slot] = DELETED;
+    m_size--;
+    return true;
   }
 
-  void set( const char * key, const T & value )
+  template <typename F>
+  void for_each( F fn )
   {
-    size_t idx   = hash( key );
-    Entry * curr = m_table[idx];
-    while( curr )
+    for( size_t i = 0; i < m_capacity; i++ )
     {
-      if( strcmp( curr->key, key ) == 0 )
+      if( is_full( m_ctrl[i] ) )
       {
-        curr->value = value;
-        return;
+        fn( m_slots[i].key, m_slots[i].value );
       }
-      curr = curr->next;
     }
-    m_table[idx] = new Entry( key, value, m_table[idx] );
   }
 
-  bool get( const char * key, T & value )
+  template <typename F>
+  void for_each( F fn ) const
   {
-    size_t idx   = hash( key );
-    Entry * curr = m_table[idx];
-    while( curr )
+    for( size_t i = 0; i < m_capacity; i++ )
     {
-      if( strcmp( curr->key, key ) == 0 )
+      if( is_full( m_ctrl[i] ) )
       {
-        value = curr->value;
-        return true;
+        fn( m_slots[i].key, ( const V & ) m_slots[i].value );
       }
-      curr = curr->next;
     }
-    return false;
+  }
+
+  // Recompute the position of every key, needed when the hash of a key changed
+  void rehash()
+  {
+    rehash( m_capacity );
+  }
+
+  void reserve( size_t count )
+  {
+    if( max_load( m_capacity ) < count )
+    {
+      rehash( round_capacity( count + count / 7 + 1 ) );
+    }
+  }
+
+  void clear()
+  {
+    destroy();
+    allocate( GROUP_SIZE );
+  }
+
+  size_t size() const
+  {
+    return m_size;
+  }
+
+  size_t capacity() const
+  {
+    return m_capacity;
   }
 
 private:
-  struct Entry
+  static constexpr int8_t EMPTY     = -128;
+  static constexpr int8_t DELETED   = -2;
+  static constexpr size_t NOT_FOUND = ~size_t( 0 );
+
+  struct Slot
   {
-    char * key;
-    T value;
-    Entry * next;
-    Entry( const char * k, T v, Entry * nxt )
-        : key( STRDUP( k ) )
-        , value( v )
-        , next( nxt )
+    K key;
+    V value;
+  };
+
+  int8_t * m_ctrl;
+  Slot * m_slots;
+  size_t m_capacity;    // a power of two, at least GROUP_SIZE
+  size_t m_size;        // full slots
+  size_t m_growth_left; // empty slots that can be filled before the table is rebuilt
+
+  // The control bytes of GROUP_SIZE consecutive slots, bit i of a match is set if
+  // control byte i matches
+  struct Group
+  {
+#ifdef BRASS_SSE2
+    __m128i ctrl;
+
+    explicit Group( const int8_t * bytes )
+        : ctrl( _mm_load_si128( reinterpret_cast<const __m128i *>( bytes ) ) )
+    {
+    }
+
+    uint32_t match( int8_t value ) const
+    {
+      return ( uint32_t ) _mm_movemask_epi8( _mm_cmpeq_epi8( ctrl, _mm_set1_epi8( value ) ) );
+    }
+
+    // the sign bit is only set for EMPTY and DELETED
+    uint32_t match_empty_or_deleted() const
+    {
+      return ( uint32_t ) _mm_movemask_epi8( ctrl );
+    }
+#else
+    const int8_t * ctrl;
+
+    explicit Group( const int8_t * bytes )
+        : ctrl( bytes )
     {
     }
+
+    uint32_t match( int8_t value ) const
+    {
+      uint32_t mask = 0;
+      for( size_t i = 0; i < GROUP_SIZE; i++ )
+      {
+        mask |= uint32_t( ctrl[i] == value ) << i;
+      }
+      return mask;
+    }
+
+    uint32_t match_empty_or_deleted() const
+    {
+      uint32_t mask = 0;
+      for( size_t i = 0; i < GROUP_SIZE; i++ )
+      {
+        mask |= uint32_t( ctrl[i] < 0 ) << i;
+      }
+      return mask;
+    }
+#endif
   };
 
-  size_t m_capacity;
-  Entry ** m_table;
+  static bool is_full( int8_t ctrl )
+  {
+    return 0 <= ctrl;
+  }
 
-  size_t hash( const char * str ) const
+  // Spread the entropy of the hash over all bits, C string and pointer hashes have
+  // weak low bits
+  static size_t mix( size_t hash )
   {
-    size_t hash = 5381;
-    int c;
-    while( ( c = *str++ ) )
-      hash = ( ( hash << 5 ) + hash ) + c; // hash * 33 + c
-    return hash % m_capacity;
+    uint64_t h = ( uint64_t ) hash * 0x9e3779b97f4a7c15ull;
+    return ( size_t ) ( h ^ ( h >> 32 ) );
   }
 
-  void clear()
+  static int8_t h2( size_t hash )
+  {
+    return ( int8_t ) ( hash & 0x7f );
+  }
+
+  static size_t max_load( size_t capacity )
+  {
+    return capacity - capacity / 8;
+  }
+
+  static size_t round_capacity( size_t capacity )
+  {
+    size_t rounded = GROUP_SIZE;
+    while( rounded < capacity )
+    {
+      rounded *= 2;
+    }
+    return rounded;
+  }
+
+  V * find( const K & key, size_t hash )
+  {
+    size_t slot = find_slot( key, hash );
+    return slot == NOT_FOUND ? nullptr : &m_slots[slot].value;
+  }
+
+  size_t find_slot( const K & key, size_t hash ) const
+  {
+    size_t num_groups = m_capacity / GROUP_SIZE;
+    size_t group      = ( hash >> 7 ) & ( num_groups - 1 );
+    for( size_t step = 1; step <= num_groups; step++ )
+    {
+      Group ctrl( m_ctrl + group * GROUP_SIZE );
+      for( uint32_t mask = ctrl.match( h2( hash ) ); mask != 0; mask &= mask - 1 )
+      {
+        size_t slot = group * GROUP_SIZE + lowest_bit( mask );
+        if( Traits::equal( m_slots[slot].key, key ) )
+        {
+          return slot;
+        }
+      }
+      if( ctrl.match( EMPTY ) != 0 )
+      {
+        return NOT_FOUND;
+      }
+      group = ( group + step ) & ( num_groups - 1 );
+    }
+    return NOT_FOUND;
+  }
+
+  // The key must not be in the table yet
+  void insert( const K & key, const V & value, size_t hash )
+  {
+    size_t num_groups = m_capacity / GROUP_SIZE;
+    size_t group      = ( hash >> 7 ) & ( num_groups - 1 );
+    for( size_t step = 1;; step++ )
+    {
+      uint32_t mask = Group( m_ctrl + group * GROUP_SIZE ).match_empty_or_deleted();
+      if( mask != 0 )
+      {
+        size_t slot = group * GROUP_SIZE + lowest_bit( mask );
+        if( m_ctrl[slot] == EMPTY )
+        {
+          m_growth_left--;
+        }
+        m_ctrl[slot] = h2( hash );
+        new( &m_slots[slot] ) Slot{ key, value };
+        m_size++;
+        return;
+      }
+      group = ( group + step ) & ( num_groups - 1 );
+    }
+  }
+
+  void allocate( size_t capacity )
+  {
+    m_capacity    = capacity;
+    m_size        = 0;
+    m_growth_left = max_load( capacity );
+    m_ctrl        = static_cast<int8_t *>( ::operator new( capacity, std::align_val_t( GROUP_SIZE ) ) );
+    m_slots       = static_cast<Slot *>( ::operator new( capacity * sizeof( Slot ) ) );
+    memset( m_ctrl, EMPTY, capacity );
+  }
+
+  void destroy()
   {
     for( size_t i = 0; i < m_capacity; i++ )
     {
-      Entry * curr = m_table[i];
-      while( curr )
+      if( is_full( m_ctrl[i] ) )
+      {
+        m_slots[i].~Slot();
+      }
+    }
+    ::operator delete( m_ctrl, std::align_val_t( GROUP_SIZE ) );
+    ::operator delete( m_slots );
+  }
+
+  void rehash( size_t capacity )
+  {
+    int8_t * ctrl       = m_ctrl;
+    Slot * slots        = m_slots;
+    size_t old_capacity = m_capacity;
+
+    allocate( capacity );
+    for( size_t i = 0; i < old_capacity; i++ )
+    {
+      if( is_full( ctrl[i] ) )
       {
-        Entry * tmp = curr;
-        curr        = curr->next;
-        free( tmp->key );
-        delete tmp;
+        insert( slots[i].key, slots[i].value, mix( Traits::hash( slots[i].key ) ) );
+        slots[i].~Slot();
       }
-      m_table[i] = nullptr;
     }
+    ::operator delete( ctrl, std::align_val_t( GROUP_SIZE ) );
+    ::operator delete( slots );
   }
 };
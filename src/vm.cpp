@@ -1,269 +1,551 @@
 #include "vm.h"
 #include "builtin.h"
+#include "dispatch.h"
 #include "object.h"
+#include "superinstructions.h"
+#include <algorithm>
 #include <cassert>
 #include <iomanip>
 
-#define RUNTIME_ERROR( msg )       \
-  do                               \
-  {                                \
-    m_runtime_error_message = msg; \
-    goto label_runtime_error;      \
+// With computed gotos every handler jumps directly to the next one, otherwise
+// the handlers are cases of a switch statement.
+#if USE_COMPUTED_GOTO
+#define CASE( op ) \
+  case op :        \
+  label_##op :
+#define DISPATCH()         \
+  do                       \
+  {                        \
+    instr = ip++;          \
+    goto * instr->handler; \
   } while( 0 )
+#else
+#define CASE( op ) case op :
+#define DISPATCH() break
+#endif
 
+// Make the frame on top of m_frames the current one and cache its state.
+#define LOAD_FRAME()                                \
+  do                                                \
+  {                                                 \
+    frame    = &m_frames[m_frame_count - 1];        \
+    ip       = frame->ip;                           \
+    locals   = frame->locals;                       \
+    code     = frame->code_object->decoded.data();  \
+    literals = frame->code_object->literals.data(); \
+  } while( 0 )
 
+// While profiling, every instruction dispatches to the handler at the end of the table
+constexpr size_t PROFILE_HANDLER = OP_CALL_GLOBAL + 1;
 
-VirtualMachine::VirtualMachine( std::ostream & out, std::ostream & err, GarbageCollector & gc )
+VirtualMachine::VirtualMachine( std::ostream & out, std::ostream & err, GarbageCollector & gc, VMOptions options )
     : m_out( out )
     , m_err( err )
     , m_gc( gc )
+    , m_options( options )
+    , m_frames( options.max_call_depth )
 {
-  m_globals.insert( std::make_pair( "typeof", Object::Native( f_typeof ) ) );
 }
 
 int VirtualMachine::run( CodeObject * co )
 {
-  m_frames.push( Frame( co ) );
-  m_stack.resize( co->num_locals );
+  m_root = co->get_root();
+  if( m_options.engine == Engine::REGISTER )
+  {
+    return run_registers( co );
+  }
+  else
+  {
+    return run_stack( co );
+  }
+}
+
+int VirtualMachine::run_stack( CodeObject * co )
+{
+#if USE_COMPUTED_GOTO
+  static const void * const dispatch_table[] = {
+      // clang-format off
+      &&label_OP_NOP,
+      &&label_OP_LOAD_CONST,
+      &&label_OP_LOAD_GLOBAL,
+      &&label_OP_STORE_GLOBAL,
+      &&label_OP_LOAD_LOCAL,
+      &&label_OP_STORE_LOCAL,
+      &&label_OP_CALL,
+      &&label_OP_SET_PROPERTY,
+      &&label_OP_GET_PROPERTY,
+      &&label_OP_RETURN,
+      &&label_OP_ADD_INT,
+      &&label_OP_SUB_INT,
+      &&label_OP_DIV_INT,
+      &&label_OP_MULT_INT,
+      &&label_OP_ADD_FLOAT,
+      &&label_OP_SUB_FLOAT,
+      &&label_OP_DIV_FLOAT,
+      &&label_OP_MULT_FLOAT,
+      &&label_OP_CONCAT_STR,
+      &&label_OP_PRINT,
+      &&label_OP_PRINTLN,
+      &&label_OP_JMP,
+      &&label_OP_JMP_IF_FALSE,
+      &&label_OP_LOOP,
+      &&label_OP_POP,
+      &&label_OP_GET_FIELD,
+      &&label_OP_SET_FIELD,
+      &&label_OP_BUILD_LIST,
+      &&label_OP_INDEX_GET,
+      &&label_OP_INDEX_SET,
+      &&label_OP_APPEND,
+      &&label_OP_HALT,
+      &&label_OP_ADD_LL,
+      &&label_OP_ADD_LL_STORE,
+      &&label_OP_SUB_KL,
+      &&label_OP_SUB_KL_STORE,
+      &&label_OP_JMP_IF_LOCAL_FALSE,
+      &&label_OP_STORE_GLOBAL_CONST,
+      &&label_OP_CALL_GLOBAL,
+      &&label_profile,
+      // clang-format on
+  };
+  static_assert( sizeof( dispatch_table ) / sizeof( dispatch_table[0] ) == PROFILE_HANDLER + 1 );
+  m_dispatch_table = dispatch_table;
+#endif
+
+  bind_globals( co );
+  prepare( co );
+  // the whole operand stack is allocated up front, so push() and pop() need no checks
+  // and pointers into it stay valid. Calls check that the callee fits.
+  m_stack.resize( m_options.stack_size );
+  if( m_stack.size() < ( size_t ) co->num_locals + co->max_stack )
+  {
+    m_err << "RUNTIME ERROR: Stack overflow" << std::endl;
+    return 1;
+  }
+  std::fill_n( m_stack.data(), co->num_locals, Object() );
+  m_sp                      = m_stack.data() + co->num_locals;
+  m_frame_count             = 0;
+  m_frames[m_frame_count++] = { co, co->decoded.data(), m_stack.data() };
 
-  while( !m_exit && ( current_frame().ip != current_frame().code_object->instructions.end() ) )
+  // the state of the current frame is cached in locals, it is written back
+  // to the frame before a call
+  Frame * frame           = nullptr;
+  const Instr * ip        = nullptr;
+  const Instr * code      = nullptr;
+  const Object * literals = nullptr;
+  Object * locals         = nullptr;
+  const Instr * instr     = nullptr;
+  LOAD_FRAME();
+
+  for( ;; )
   {
-    auto [op, arg] = next_instr();
-    switch( op )
+    instr = ip++;
+    if( m_options.profile )
+    {
+      m_options.profile->record( instr );
+    }
+    switch( instr->op )
     {
-      case OP_LOAD_CONST :
+      CASE( OP_NOP )
+      {
+        DISPATCH();
+      }
+      CASE( OP_LOAD_CONST )
+      {
+        Object obj = literals[instr->arg];
+        push( obj );
+        DISPATCH();
+      }
+      CASE( OP_LOAD_GLOBAL )
+      {
+        assert( instr->arg < m_globals.size() );
+        push( m_globals[instr->arg] );
+        DISPATCH();
+      }
+      CASE( OP_STORE_GLOBAL )
+      {
+        assert( instr->arg < m_globals.size() );
+        store_global( instr->arg, pop() );
+        DISPATCH();
+      }
+      CASE( OP_LOAD_LOCAL )
+      {
+        assert( instr->arg < frame->code_object->num_locals );
+        push( locals[instr->arg] );
+        DISPATCH();
+      }
+      CASE( OP_STORE_LOCAL )
+      {
+        assert( instr->arg < frame->code_object->num_locals );
+        locals[instr->arg] = pop();
+        DISPATCH();
+      }
+      CASE( OP_ADD_INT )
+      {
+        Object lhs    = pop();
+        Object rhs    = pop();
+        Object result = Object::Integer( lhs.as_integer() + rhs.as_integer() );
+        push( result );
+        DISPATCH();
+      }
+      CASE( OP_SUB_INT )
+      {
+        Object lhs    = pop();
+        Object rhs    = pop();
+        Object result = Object::Integer( lhs.as_integer() - rhs.as_integer() );
+        push( result );
+        DISPATCH();
+      }
+      CASE( OP_MULT_INT )
+      {
+        Object lhs    = pop();
+        Object rhs    = pop();
+        Object result = Object::Integer( lhs.as_integer() * rhs.as_integer() );
+        push( result );
+        DISPATCH();
+      }
+      CASE( OP_DIV_INT )
+      {
+        Object lhs = pop();
+        Object rhs = pop();
+        if( rhs.as_integer() == 0 )
         {
-          Object obj = current_frame().code_object->literals[arg];
-          push( obj );
-          break;
+          RUNTIME_ERROR( "Division by zero" );
         }
-      case OP_LOAD_GLOBAL :
+        Object result = Object::Integer( lhs.as_integer() / rhs.as_integer() );
+        push( result );
+        DISPATCH();
+      }
+      CASE( OP_ADD_FLOAT )
+      {
+        Object lhs = pop();
+        Object rhs = pop();
+        push( Object::Real( lhs.as_real() + rhs.as_real() ) );
+        DISPATCH();
+      }
+      CASE( OP_SUB_FLOAT )
+      {
+        Object lhs = pop();
+        Object rhs = pop();
+        push( Object::Real( lhs.as_real() - rhs.as_real() ) );
+        DISPATCH();
+      }
+      CASE( OP_MULT_FLOAT )
+      {
+        Object lhs = pop();
+        Object rhs = pop();
+        push( Object::Real( lhs.as_real() * rhs.as_real() ) );
+        DISPATCH();
+      }
+      CASE( OP_DIV_FLOAT )
+      {
+        Object lhs = pop();
+        Object rhs = pop();
+        push( Object::Real( lhs.as_real() / rhs.as_real() ) );
+        DISPATCH();
+      }
+      CASE( OP_CONCAT_STR )
+      {
+        Object lhs = pop();
+        Object rhs = pop();
+        push( Object::String( concat_strings( m_gc, lhs.as_string(), rhs.as_string() ) ) );
+        if( m_gc.should_collect() )
         {
-          CodeObject * current = current_frame().code_object;
-          CodeObject * global  = current->get_root(); // something is not right here
-
-          assert( global != nullptr );
-          assert( arg < global->names.size() );
-
-          std::string var = global->names[arg]; // this throws an error
-          auto it         = m_globals.find( var );
-          if( it != m_globals.end() )
-          {
-            push( it->second );
-          }
-          else
-          {
-            push( Object::Nil() );
-          }
-          break;
+          collect_garbage();
         }
-      case OP_STORE_GLOBAL :
+        DISPATCH();
+      }
+      CASE( OP_PRINT )
+      {
+        Object obj = pop();
+        m_out << obj;
+        DISPATCH();
+      }
+      CASE( OP_PRINTLN )
+      {
+        Object obj = pop();
+        m_out << obj << std::endl;
+        DISPATCH();
+      }
+      CASE( OP_CALL )
+      {
+      label_call:
+        Object obj = pop();
+        if( obj.is_function() )
         {
-          CodeObject * current = current_frame().code_object;
-          CodeObject * global  = current->get_root();
-
-          assert( global != nullptr );
-          assert( arg < global->names.size() );
-
-          std::string var = global->names[arg];
-          Object obj      = pop(); // when we get the function with pop it is corrupted
-          m_globals[var]  = obj;
-          break;
+          frame->ip = ip;
+          if( !call_fn( obj.as_function() ) )
+          {
+            RUNTIME_ERROR( "Stack overflow" );
+          }
+          LOAD_FRAME();
         }
-      case OP_LOAD_LOCAL :
+        else if( obj.is_class() )
         {
-          size_t slot = current_frame().bp + arg;
-          if( !( slot < m_stack.size() ) )
+          call_ctor( obj.as_class() );
+          if( m_gc.should_collect() )
           {
-            RUNTIME_ERROR( "OP_LOAD_LOCAL: Variable not declard" );
+            collect_garbage();
           }
-          Object obj = m_stack[slot];
-          push( obj );
-          break;
         }
-      case OP_STORE_LOCAL :
+        else if( obj.is_native() )
         {
-          Object obj  = pop();
-          size_t slot = current_frame().bp + arg;
-          if( !( slot < m_stack.size() ) )
+          NativeFunction fn = obj.as_native();
+          size_t fn_arity   = instr->arg;
+          Object * fn_args  = m_sp - fn_arity;
+
+          Object retval = fn( this, fn_arity, fn_args );
+          m_sp          = fn_args;
+          push( retval );
+          if( m_gc.should_collect() )
           {
-            RUNTIME_ERROR( "OP_STORE_LOCAL: Variable not declard" );
+            collect_garbage();
           }
-          m_stack[slot] = obj;
-          break;
         }
-      case OP_ADD :
+        else
         {
-          Object lhs    = pop();
-          Object rhs    = pop();
-          Object result = Object::Integer( lhs.integer + rhs.integer );
-          push( result );
-          break;
+          RUNTIME_ERROR( "Error: not a callable object" );
         }
-      case OP_SUB :
+        DISPATCH();
+      }
+      CASE( OP_RETURN )
+      {
+        Object obj = pop();
+        m_sp       = locals;
+        m_frame_count--;
+        push( obj );
+        LOAD_FRAME();
+        DISPATCH();
+      }
+      CASE( OP_GET_PROPERTY )
+      {
+        CodeObject * global      = frame->code_object->get_root();
+        const std::string & name = global->names[instr->arg];
+        Object obj               = pop();
+
+        if( obj.is_instance() )
         {
-          Object lhs    = pop();
-          Object rhs    = pop();
-          Object result = Object::Integer( lhs.integer - rhs.integer );
-          push( result );
-          break;
+          int slot = obj.as_instance()->klass->find_field( name.c_str() );
+          push( slot < 0 ? Object::Nil() : obj.as_instance()->fields[slot] );
         }
-      case OP_MULT :
+        else
         {
-          Object lhs    = pop();
-          Object rhs    = pop();
-          Object result = Object::Integer( lhs.integer * rhs.integer );
-          push( result );
-          break;
-          break;
+          RUNTIME_ERROR( "not a object" );
         }
-      case OP_DIV :
+        DISPATCH();
+      }
+      CASE( OP_SET_PROPERTY )
+      {
+        CodeObject * global      = frame->code_object->get_root();
+        const std::string & name = global->names[instr->arg];
+
+        Object obj      = pop();
+        Object property = pop();
+        if( obj.is_instance() )
         {
-          Object lhs = pop();
-          Object rhs = pop();
-          if( rhs.integer == 0 )
+          int slot = obj.as_instance()->klass->find_field( name.c_str() );
+          if( slot < 0 )
           {
-            RUNTIME_ERROR( "Division by zero" );
+            RUNTIME_ERROR( "Undefined field '" + name + "'" );
           }
-          Object result = Object::Integer( lhs.integer / rhs.integer );
-          push( result );
-          break;
-          break;
+          store_field( obj.as_instance(), slot, property );
         }
-      case OP_PRINT :
+        else
         {
-          Object obj = pop();
-          m_out << obj;
-          break;
+          RUNTIME_ERROR( "asdf" );
         }
-      case OP_PRINTLN :
+        DISPATCH();
+      }
+      CASE( OP_GET_FIELD )
+      {
+        Object obj = pop();
+        if( !obj.is_instance() )
         {
-          Object obj = pop();
-          m_out << obj << std::endl;
-          break;
+          RUNTIME_ERROR( "not a object" );
         }
-      case OP_CALL :
+        push( obj.as_instance()->fields[instr->arg] );
+        DISPATCH();
+      }
+      CASE( OP_SET_FIELD )
+      {
+        Object obj      = pop();
+        Object property = pop();
+        if( !obj.is_instance() )
         {
-          Object obj = pop();
-          if( obj.type == Object::Type::FUNCTION )
-          {
-            call_fn( obj.function );
-          }
-          else if( obj.type == Object::Type::CLASS )
-          {
-            call_ctor( obj.klass );
-          }
-          else if( obj.type == Object::Type::NATIVE )
-          {
-            NativeFunction fn = obj.native;
-            size_t fn_arity   = arg;
-
-            size_t stack_size = m_stack.size();
-            size_t bp         = stack_size - fn_arity;
-            Object * fn_args  = &m_stack[bp];
-
-            Object retval = fn( this, fn_arity, fn_args );
-            push( retval );
-          }
-          else
-          {
-            RUNTIME_ERROR( "Error: not a callable object" );
-          }
-          break;
+          RUNTIME_ERROR( "not a object" );
         }
-      case OP_RETURN :
+        store_field( obj.as_instance(), instr->arg, property );
+        DISPATCH();
+      }
+      // The type checker only lets lists and int indices through
+      CASE( OP_BUILD_LIST )
+      {
+        m_sp -= instr->arg;
+        ListObject * list = m_gc.alloc<ListObject>( m_sp, instr->arg );
+        for( size_t i = 0; i < list->count; i++ )
         {
-          Object obj    = pop();
-          Frame & frame = m_frames.top();
-          m_stack.resize( frame.bp );
-          m_frames.pop();
-          push( obj );
-          break;
+          m_gc.write_barrier( list, nullptr, gc_object( list->items[i] ) );
         }
-      case OP_GET_PROPERTY :
+        push( Object::List( list ) );
+        if( m_gc.should_collect() )
         {
-          CodeObject * global = global_code_object();
-          std::string name    = global->names[arg];
-          Object obj          = pop();
-
-          if( obj.type == Object::Type::INSTANCE )
-          {
-            Object property = Object::Nil();
-            obj.instance->fields.get( name.c_str(), property );
-            push( property );
-          }
-          else
-          {
-            RUNTIME_ERROR( "not a object" );
-          }
-          break;
+          collect_garbage();
         }
-      case OP_SET_PROPERTY :
+        DISPATCH();
+      }
+      CASE( OP_INDEX_GET )
+      {
+        int index         = pop().as_integer();
+        ListObject * list = pop().as_list();
+        if( index < 0 || list->count <= ( size_t ) index )
         {
-          CodeObject * global = global_code_object();
-          std::string name    = global->names[arg];
-
-          Object obj      = pop();
-          Object property = pop();
-          if( obj.type == Object::Type::INSTANCE )
-          {
-            obj.instance->fields.set( name.c_str(), property );
-          }
-          else
-          {
-            RUNTIME_ERROR( "asdf" );
-          }
-          break;
+          RUNTIME_ERROR( "List index out of range" );
         }
-      case OP_JMP :
+        push( list->items[index] );
+        DISPATCH();
+      }
+      CASE( OP_INDEX_SET )
+      {
+        int index         = pop().as_integer();
+        ListObject * list = pop().as_list();
+        Object value      = pop();
+        if( index < 0 || list->count <= ( size_t ) index )
         {
-          current_frame().ip += arg;
-          break;
+          RUNTIME_ERROR( "List index out of range" );
         }
-      case OP_JMP_IF_FALSE :
+        store_element( list, index, value );
+        DISPATCH();
+      }
+      CASE( OP_APPEND )
+      {
+        ListObject * list = pop().as_list();
+        append_element( list, pop() );
+        if( m_gc.should_collect() )
         {
-          Object obj = pop();
-          if( obj.is_falsy() )
-          {
-            current_frame().ip += arg;
-          }
-          break;
+          collect_garbage();
         }
-      case OP_LOOP :
+        DISPATCH();
+      }
+      CASE( OP_JMP )
+      {
+        ip = code + instr->arg;
+        DISPATCH();
+      }
+      CASE( OP_JMP_IF_FALSE )
+      {
+        Object obj = pop();
+        if( obj.is_falsy() )
         {
-          current_frame().ip -= arg;
-          break;
+          ip = code + instr->arg;
         }
+        DISPATCH();
+      }
+      CASE( OP_LOOP )
+      {
+        ip = code + instr->arg;
+        DISPATCH();
+      }
+      CASE( OP_POP )
+      {
+        ( void ) pop();
+        DISPATCH();
+      }
+      CASE( OP_HALT )
+      {
+        m_frame_count--;
+        return 0;
+      }
+      // The operands of a superinstruction are in the instructions it replaces, ip[0] is
+      // the second instruction of the sequence.
+      CASE( OP_ADD_LL )
+      {
+        Object rhs = locals[instr->arg];
+        Object lhs = locals[ip[0].arg];
+        push( Object::Integer( lhs.as_integer() + rhs.as_integer() ) );
+        ip += 2;
+        DISPATCH();
+      }
+      CASE( OP_ADD_LL_STORE )
+      {
+        Object rhs        = locals[instr->arg];
+        Object lhs        = locals[ip[0].arg];
+        locals[ip[2].arg] = Object::Integer( lhs.as_integer() + rhs.as_integer() );
+        ip += 3;
+        DISPATCH();
+      }
+      CASE( OP_SUB_KL )
+      {
+        Object rhs = literals[instr->arg];
+        Object lhs = locals[ip[0].arg];
+        push( Object::Integer( lhs.as_integer() - rhs.as_integer() ) );
+        ip += 2;
+        DISPATCH();
+      }
+      CASE( OP_SUB_KL_STORE )
+      {
+        Object rhs        = literals[instr->arg];
+        Object lhs        = locals[ip[0].arg];
+        locals[ip[2].arg] = Object::Integer( lhs.as_integer() - rhs.as_integer() );
+        ip += 3;
+        DISPATCH();
+      }
+      CASE( OP_JMP_IF_LOCAL_FALSE )
+      {
+        if( locals[instr->arg].is_falsy() )
+        {
+          ip = code + ip[0].arg;
+        }
+        else
+        {
+          ip += 1;
+        }
+        DISPATCH();
+      }
+      CASE( OP_STORE_GLOBAL_CONST )
+      {
+        m_globals[ip[0].arg] = literals[instr->arg];
+        ip += 1;
+        DISPATCH();
+      }
+      CASE( OP_CALL_GLOBAL )
+      {
+        push( m_globals[instr->arg] );
+        instr = ip++;
+        goto label_call;
+      }
+#if USE_COMPUTED_GOTO
+      label_profile :
+      {
+        m_options.profile->record( instr );
+        goto * m_dispatch_table[instr->op];
+      }
+#endif
       default :
         m_err << "Unhandled instruction: 0x" << std::hex << std::setw( 2 ) << std::setfill( '0' )
-              << static_cast<int>( op ) << "\n";
-        m_exit = true;
+              << static_cast<int>( instr->op ) << "\n";
         goto label_runtime_error;
-        break;
     }
   }
-  return 0;
 
 label_runtime_error:
   m_err << "RUNTIME ERROR: " << m_runtime_error_message << std::endl;
+  m_frame_count = 0;
+  m_sp          = m_stack.data();
   return 1;
 }
 
 void VirtualMachine::push( Object obj )
 {
-  m_stack.push_back( obj );
+  *m_sp++ = obj;
 }
 
 Object VirtualMachine::pop()
 {
-  Object obj = m_stack.back();
-  m_stack.pop_back();
-  return obj;
+  return *--m_sp;
 }
 
 Frame & VirtualMachine::current_frame()
 {
-  return m_frames.top();
+  return m_frames[m_frame_count - 1];
 }
 
 CodeObject * VirtualMachine::current_code_object()
@@ -276,44 +558,118 @@ CodeObject * VirtualMachine::global_code_object()
   return current_code_object()->get_root();
 }
 
-std::pair<OpCode, uint16_t> VirtualMachine::next_instr()
+// Globals live in a flat array, indexed by the slot the compiler assigned to them,
+// which is their index in the names of the root CodeObject. In the REPL every line
+// can declare new globals, so the array is extended before running new code.
+void VirtualMachine::bind_globals( CodeObject * co )
 {
-  OpCode op = static_cast<OpCode>( *( current_frame().ip++ ) );
-  switch( op )
+  CodeObject * root = co->get_root();
+  for( size_t slot = m_globals.size(); slot < root->names.size(); slot++ )
   {
-    case OP_LOAD_CONST :
-    case OP_LOAD_GLOBAL :
-    case OP_STORE_GLOBAL :
-    case OP_LOAD_LOCAL :
-    case OP_STORE_LOCAL :
-    case OP_GET_PROPERTY :
-    case OP_SET_PROPERTY :
-    case OP_JMP :
-    case OP_JMP_IF_FALSE :
-    case OP_LOOP :
-    case OP_CALL :
-      {
-        uint8_t hi   = *( current_frame().ip++ );
-        uint8_t lo   = *( current_frame().ip++ );
-        uint16_t arg = ( uint16_t( hi ) << 8 ) | ( uint16_t( lo ) );
-        return std::make_pair( op, arg );
-      }
-    default :
-      return std::make_pair( op, 0xffff );
+    NativeFunction fn = find_builtin( root->names[slot] );
+    m_globals.push_back( fn ? Object::Native( fn ) : Object::Nil() );
+    m_global_remembered.push_back( false );
   }
 }
 
-void VirtualMachine::call_fn( FunctionObject * fn )
+void VirtualMachine::prepare( CodeObject * co )
 {
-  size_t stack_size     = m_stack.size();
-  size_t new_stack_size = stack_size + ( fn->code_object.num_locals - fn->num_args );
-  size_t bp             = stack_size - fn->num_args;
-  m_stack.resize( new_stack_size );
-  m_frames.push( Frame( &fn->code_object, bp ) );
+  co->decode();
+  if( m_options.superinstructions && !m_options.profile )
+  {
+    fuse_superinstructions( co->decoded );
+  }
+  for( Instr & instr : co->decoded )
+  {
+    size_t handler = m_options.profile ? PROFILE_HANDLER : static_cast<size_t>( instr.op );
+    instr.handler  = m_dispatch_table ? m_dispatch_table[handler] : nullptr;
+  }
+}
+
+// The arguments on top of the stack become the first locals of the callee. Returns
+// false if the frame or the operand stack of the callee do not fit.
+bool VirtualMachine::call_fn( FunctionObject * fn )
+{
+  CodeObject * code  = &fn->code_object;
+  Object * locals    = m_sp - fn->num_args;
+  size_t available   = m_stack.data() + m_stack.size() - locals;
+  if( m_frame_count == m_frames.size() || available < ( size_t ) code->num_locals + code->max_stack )
+  {
+    return false;
+  }
+
+  // the slots may still hold values of a returned frame, which the collector must not see
+  std::fill( m_sp, locals + code->num_locals, Object() );
+  m_sp = locals + code->num_locals;
+  if( code->decoded.empty() )
+  {
+    prepare( code );
+  }
+  m_frames[m_frame_count++] = { code, code->decoded.data(), locals };
+  return true;
 }
 
 void VirtualMachine::call_ctor( ClassObject * cls )
 {
-  InstanceObject * instance = m_gc.alloc<InstanceObject>( cls );
+  InstanceObject * instance = m_gc.alloc_young<InstanceObject>( cls );
   push( Object::Instance( instance ) );
 }
+
+// Only called at safe points, where every live object is reachable from the
+// operand stack (or register file), the globals or the literals of the code.
+// Literals are never young, so a minor collection only needs the stack and the
+// globals the write barrier remembered.
+void VirtualMachine::collect_garbage()
+{
+  m_gc.begin_minor();
+  mark_stack();
+  for( uint32_t slot : m_remembered_globals )
+  {
+    mark_object( m_gc, m_globals[slot] );
+    m_global_remembered[slot] = false;
+  }
+  m_remembered_globals.clear();
+  m_gc.collect_minor();
+
+  if( !m_gc.should_collect_major() )
+  {
+    return;
+  }
+
+  // an incremental collection only marks the roots when it starts
+  if( !m_gc.is_collecting() )
+  {
+    m_gc.begin_major();
+    mark_stack();
+    for( Object & obj : m_globals )
+    {
+      mark_object( m_gc, obj );
+    }
+    mark_code( m_gc, *m_root );
+  }
+
+  if( m_gc.is_incremental() )
+  {
+    m_gc.step();
+  }
+  else
+  {
+    m_gc.collect();
+  }
+}
+
+// The stack engine only uses the operand stack up to the stack pointer, the
+// register engine up to the last register of the innermost frame.
+void VirtualMachine::mark_stack()
+{
+  Object * top = m_sp;
+  if( m_options.engine == Engine::REGISTER )
+  {
+    const RegisterFrame & frame = m_register_frames.back();
+    top                         = m_stack.data() + frame.bp + frame.code_object->num_registers;
+  }
+  for( Object * obj = m_stack.data(); obj != top; obj++ )
+  {
+    mark_object( m_gc, *obj );
+  }
+}
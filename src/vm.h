@@ -4,49 +4,114 @@
 #include "gc.h"
 #include "object.h"
 
-#include <map>
 #include <ostream>
-#include <stack>
-
+#include <vector>
 
+class SequenceProfile;
 
 struct Frame
+{
+  CodeObject * code_object = nullptr;
+  const Instr * ip         = nullptr;
+  Object * locals          = nullptr; // local 0 in the operand stack
+};
+
+struct RegisterFrame
 {
   CodeObject * code_object;
-  std::vector<uint8_t>::const_iterator ip;
-  size_t bp;
+  const RegInstr * ip;
+  size_t bp; // index of register 0 in the register file
+};
 
-  Frame( CodeObject * co, size_t bp = 0 )
-      : code_object( co )
-      , ip( code_object->instructions.begin() )
-      , bp( bp )
-  {
-  }
+enum class Engine
+{
+  STACK,
+  REGISTER,
+};
+
+struct VMOptions
+{
+  Engine engine             = Engine::STACK;
+  bool superinstructions    = true;  // only used by the stack engine
+  bool optimize             = true;  // fold constants in the AST before compiling
+  bool gc_stats             = false; // print the pause times of the collector after eval()
+  size_t max_call_depth     = 10000; // deeper calls are a runtime error
+  size_t stack_size         = 64 * 1024; // slots of the operand stack or the register file
+  SequenceProfile * profile = nullptr;   // count executed sequences instead of fusing them
+  GCOptions gc              = {};        // used by eval() and repl() to set up the collector
 };
 
 class VirtualMachine
 {
 public:
-  VirtualMachine( std::ostream & out, std::ostream & err, GarbageCollector & gc );
+  VirtualMachine( std::ostream & out, std::ostream & err, GarbageCollector & gc, VMOptions options = {} );
   int run( CodeObject * );
   GarbageCollector& gc() { return m_gc; }
 
 private:
-  bool m_exit = false;
   std::ostream & m_out;
   std::ostream & m_err;
   GarbageCollector & m_gc;
-  std::stack<Frame> m_frames;
-  std::vector<Object> m_stack;
-  std::map<std::string, Object> m_globals;
+  VMOptions m_options;
+  std::vector<Frame> m_frames; // fixed capacity of max_call_depth
+  size_t m_frame_count = 0;
+  std::vector<Object> m_stack; // doubles as register file for the register engine
+  Object * m_sp = nullptr;     // top of the operand stack of the stack engine
+  std::vector<RegisterFrame> m_register_frames;
+  std::vector<Object> m_globals;
+  std::vector<uint32_t> m_remembered_globals; // global slots that may point into the nursery
+  std::vector<bool> m_global_remembered;
+  CodeObject * m_root = nullptr;
   std::string m_runtime_error_message;
+  const void * const * m_dispatch_table = nullptr;
 
+  int run_stack( CodeObject * );
+  int run_registers( CodeObject * );
   void push( Object );
   Object pop();
   Frame & current_frame();
   CodeObject * current_code_object();
   CodeObject * global_code_object();
-  std::pair<OpCode, uint16_t> next_instr();
-  void call_fn( FunctionObject * );
+  void bind_globals( CodeObject * );
+  void prepare( CodeObject * );
+  bool call_fn( FunctionObject * );
   void call_ctor( ClassObject * );
+  void collect_garbage();
+  void mark_stack();
+  void store_global( uint32_t slot, const Object & value );
+  void store_field( InstanceObject *, size_t slot, const Object & value );
+  void store_element( ListObject *, size_t index, const Object & value );
+  void append_element( ListObject *, const Object & value );
 };
+
+// Stores with a write barrier, the globals and the old objects that get a reference
+// to a young object are remembered as roots for the next minor collection. While an
+// incremental collection is marking, the overwritten value of a field is shaded.
+// Globals and locals are roots that are marked when the collection starts.
+inline void VirtualMachine::store_global( uint32_t slot, const Object & value )
+{
+  m_globals[slot] = value;
+  if( m_gc.is_young( gc_object( value ) ) && !m_global_remembered[slot] )
+  {
+    m_global_remembered[slot] = true;
+    m_remembered_globals.push_back( slot );
+  }
+}
+
+inline void VirtualMachine::store_field( InstanceObject * instance, size_t slot, const Object & value )
+{
+  m_gc.write_barrier( instance, gc_object( instance->fields[slot] ), gc_object( value ) );
+  instance->fields[slot] = value;
+}
+
+inline void VirtualMachine::store_element( ListObject * list, size_t index, const Object & value )
+{
+  m_gc.write_barrier( list, gc_object( list->items[index] ), gc_object( value ) );
+  list->items[index] = value;
+}
+
+inline void VirtualMachine::append_element( ListObject * list, const Object & value )
+{
+  m_gc.write_barrier( list, nullptr, gc_object( value ) );
+  list_append( m_gc, list, value );
+}
@@ -1,14 +1,541 @@
 #include <gtest/gtest.h>
 
+#include <cmath>
+#include <limits>
+#include <memory_resource>
+
 #include "object.h"
 #include "utils.h"
 #include "allocator.h"
+#include "atom.h"
 #include "ast.h"
+#include "lexer.h"
+#include "parser.h"
 
 TEST(misc, test_alloc_00)
 {
+  GarbageCollector gc;
+  StringObject * a = gc.alloc<StringObject>( "a" );
+  gc.alloc<StringObject>( "b" );
+  gc.alloc<StringObject>( "c" );
+  EXPECT_EQ( gc.num_objects(), 3 );
+
+  gc.mark( a );
+  gc.collect();
+  EXPECT_EQ( gc.num_objects(), 1 );
+  EXPECT_STREQ( a->str, "a" );
+
+  gc.collect();
+  EXPECT_EQ( gc.num_objects(), 0 );
+  EXPECT_EQ( gc.bytes_allocated(), 0 );
 }
 
 TEST(misc, test_alloc_01)
 {
-}
\ No newline at end of file
+  // everything reachable from a root survives
+  GarbageCollector gc;
+  ClassObject * cls       = gc.alloc<ClassObject>( "Pair", std::vector<std::string>{ "first", "second" } );
+  InstanceObject * pair   = gc.alloc<InstanceObject>( cls );
+  pair->fields[0]         = Object::String( gc.alloc<StringObject>( "first" ) );
+  pair->fields[1]         = Object::Instance( gc.alloc<InstanceObject>( cls ) );
+  gc.alloc<StringObject>( "garbage" );
+  EXPECT_EQ( gc.num_objects(), 5 );
+
+  Object root = Object::Instance( pair );
+  mark_object( gc, root );
+  gc.collect();
+  EXPECT_EQ( gc.num_objects(), 4 );
+  EXPECT_STREQ( pair->fields[0].as_string()->str, "first" );
+  EXPECT_EQ( pair->fields[1].as_instance()->klass, cls );
+}
+TEST(misc, test_alloc_02)
+{
+  // a minor collection copies the reachable young objects to the old space
+  GarbageCollector gc;
+  Object root = Object::String( gc.alloc_young<StringObject>( "young" ) );
+  gc.alloc_young<StringObject>( "garbage" );
+  EXPECT_TRUE( gc.is_young( root.as_string() ) );
+  EXPECT_EQ( gc.num_objects(), 0 );
+
+  gc.begin_minor();
+  mark_object( gc, root );
+  gc.collect_minor();
+  EXPECT_FALSE( gc.is_young( root.as_string() ) );
+  EXPECT_STREQ( root.as_string()->str, "young" );
+  EXPECT_EQ( gc.num_objects(), 1 );
+  EXPECT_EQ( gc.nursery_used(), 0 );
+}
+
+TEST(misc, test_alloc_03)
+{
+  // old objects that refer to young objects are remembered by the write barrier
+  GarbageCollector gc;
+  ClassObject * cls     = gc.alloc<ClassObject>( "Box", std::vector<std::string>{ "item" } );
+  InstanceObject * box  = gc.alloc<InstanceObject>( cls );
+  StringObject * item   = gc.alloc_young<StringObject>( "item" );
+  box->fields[0]        = Object::String( item );
+  gc.write_barrier( box, nullptr, item );
+
+  gc.begin_minor();
+  gc.collect_minor();
+  EXPECT_FALSE( gc.is_young( box->fields[0].as_string() ) );
+  EXPECT_STREQ( box->fields[0].as_string()->str, "item" );
+  EXPECT_EQ( gc.num_objects(), 3 );
+}
+
+TEST(misc, test_alloc_04)
+{
+  // the write barrier keeps everything that was reachable when marking started
+  GarbageCollector gc( { 1024, 1024, true, 1 } );
+  ClassObject * cls    = gc.alloc<ClassObject>( "Box", std::vector<std::string>{ "item" } );
+  InstanceObject * box = gc.alloc<InstanceObject>( cls );
+  StringObject * item  = gc.alloc<StringObject>( "item" );
+  box->fields[0]       = Object::String( item );
+  gc.alloc<StringObject>( "garbage" );
+
+  gc.begin_major();
+  gc.mark( box );
+
+  // box is still gray, the item would not be found without the barrier
+  gc.write_barrier( box, item, nullptr );
+  box->fields[0] = Object::Nil();
+  while( !gc.step() )
+  {
+  }
+  EXPECT_EQ( gc.num_objects(), 3 );
+  EXPECT_TRUE( gc.major_pauses().count() > 2 );
+}
+
+TEST(misc, test_intern_00)
+{
+  // interned strings are unique and survive collections without other roots
+  GarbageCollector gc;
+  StringObject * a = intern_string( gc, "key" );
+  StringObject * b = gc.alloc<StringObject>( "key" );
+  EXPECT_EQ( intern_string( gc, "key" ), a );
+  EXPECT_NE( intern_string( gc, "other" ), a );
+  EXPECT_TRUE( a->equals( b ) );
+  EXPECT_FALSE( a->equals( intern_string( gc, "other" ) ) );
+  EXPECT_EQ( gc.num_interned(), 2 );
+
+  gc.collect();
+  EXPECT_EQ( gc.num_objects(), 2 );
+  EXPECT_EQ( intern_string( gc, "key" ), a );
+  EXPECT_STREQ( a->str, "key" );
+}
+
+TEST(misc, test_string_00)
+{
+  // long concatenations are ropes, flattened on first use
+  GarbageCollector gc;
+  StringObject * a    = gc.alloc<StringObject>( std::string( 40, 'a' ).c_str() );
+  StringObject * b    = gc.alloc<StringObject>( std::string( 40, 'b' ).c_str() );
+  StringObject * ab   = concat_strings( gc, a, b );
+  StringObject * abab = concat_strings( gc, ab, ab );
+  EXPECT_TRUE( abab->is_rope() );
+  EXPECT_EQ( abab->str, nullptr );
+  EXPECT_EQ( abab->length, 160 );
+
+  std::string expected = std::string( 40, 'a' ) + std::string( 40, 'b' );
+  expected += expected;
+  StringObject * flat = gc.alloc<StringObject>( expected.c_str() );
+  EXPECT_EQ( abab->hash(), flat->hash() );
+  EXPECT_TRUE( abab->equals( flat ) );
+  EXPECT_STREQ( abab->c_str(), expected.c_str() );
+  EXPECT_EQ( abab->left, nullptr );
+
+  // short ones are copied
+  StringObject * x  = gc.alloc<StringObject>( "x" );
+  StringObject * xx = concat_strings( gc, x, x );
+  EXPECT_FALSE( xx->is_rope() );
+  EXPECT_STREQ( xx->str, "xx" );
+  EXPECT_FALSE( xx->equals( x ) );
+}
+
+TEST(misc, test_hashmap_00)
+{
+  // the table grows past its load factor and reuses erased slots
+  std::vector<std::string> keys;
+  for( int i = 0; i < 1000; i++ )
+  {
+    keys.push_back( "key" + std::to_string( i ) );
+  }
+
+  HashMap<const char *, int> map;
+  EXPECT_EQ( map.capacity(), 16 );
+  for( int i = 0; i < 1000; i++ )
+  {
+    map.set( keys[i].c_str(), i );
+  }
+  EXPECT_EQ( map.size(), 1000 );
+  EXPECT_EQ( map.capacity(), 2048 );
+
+  int value = 0;
+  EXPECT_TRUE( map.get( "key999", value ) );
+  EXPECT_EQ( value, 999 );
+  EXPECT_FALSE( map.get( "key1000", value ) );
+
+  for( int i = 0; i < 1000; i += 2 )
+  {
+    EXPECT_TRUE( map.erase( keys[i].c_str() ) );
+  }
+  EXPECT_FALSE( map.erase( "key0" ) );
+  EXPECT_EQ( map.size(), 500 );
+  EXPECT_EQ( map.find( "key10" ), nullptr );
+  EXPECT_EQ( *map.find( "key11" ), 11 );
+
+  for( int round = 0; round < 10; round++ )
+  {
+    for( int i = 0; i < 1000; i += 2 )
+    {
+      map.set( keys[i].c_str(), i );
+    }
+    for( int i = 0; i < 1000; i += 2 )
+    {
+      map.erase( keys[i].c_str() );
+    }
+  }
+  EXPECT_EQ( map.size(), 500 );
+  EXPECT_EQ( map.capacity(), 2048 );
+}
+
+TEST(misc, test_map_00)
+{
+  // strings are keys by value, other objects by identity, also after they moved
+  GarbageCollector gc;
+  MapObject * map        = gc.alloc<MapObject>();
+  StringObject * key     = gc.alloc_young<StringObject>( "key" );
+  ClassObject * cls      = gc.alloc<ClassObject>( "A", std::vector<std::string>{ "x", "y" } );
+  InstanceObject * young = gc.alloc_young<InstanceObject>( cls );
+
+  map->set( Object::String( key ), Object::Integer( 1 ) );
+  map->set( Object::Instance( young ), Object::Integer( 2 ) );
+  map->set( Object::Integer( 3 ), Object::Real( 3.5 ) );
+  gc.write_barrier( map, nullptr, key );
+  gc.write_barrier( map, nullptr, young );
+
+  Object value;
+  EXPECT_TRUE( map->get( Object::String( gc.alloc<StringObject>( "key" ) ), value ) );
+  EXPECT_EQ( value.as_integer(), 1 );
+  EXPECT_TRUE( map->get( Object::Integer( 3 ), value ) );
+  EXPECT_EQ( value.as_real(), 3.5 );
+  EXPECT_FALSE( map->get( Object::Instance( gc.alloc_young<InstanceObject>( cls ) ), value ) );
+
+  gc.begin_minor();
+  gc.collect_minor();
+  InstanceObject * moved = nullptr;
+  map->for_each(
+      [&moved]( Object & key, Object & )
+      {
+        if( key.is_instance() )
+        {
+          moved = key.as_instance();
+        }
+      } );
+  ASSERT_NE( moved, nullptr );
+  EXPECT_NE( moved, young );
+  EXPECT_TRUE( map->get( Object::Instance( moved ), value ) );
+  EXPECT_EQ( value.as_integer(), 2 );
+  EXPECT_EQ( cls->find_field( "y" ), 1 );
+  EXPECT_EQ( cls->find_field( "z" ), -1 );
+}
+
+TEST(misc, test_list_00)
+{
+  // the buffer of a list doubles and counts towards the allocated bytes
+  GarbageCollector gc;
+  Object values[]   = { Object::Integer( 1 ), Object::Integer( 2 ) };
+  ListObject * list = gc.alloc<ListObject>( values, 2 );
+  EXPECT_EQ( list->capacity, 2 );
+  EXPECT_EQ( gc.bytes_allocated(), list->size() );
+
+  for( int i = 0; i < 18; i++ )
+  {
+    list_append( gc, list, Object::Integer( i ) );
+  }
+  EXPECT_EQ( list->count, 20 );
+  EXPECT_EQ( list->capacity, 32 );
+  EXPECT_EQ( list->items[1].as_integer(), 2 );
+  EXPECT_EQ( list->items[19].as_integer(), 17 );
+  EXPECT_EQ( gc.bytes_allocated(), sizeof( ListObject ) + 32 * sizeof( Object ) );
+
+  gc.collect();
+  EXPECT_EQ( gc.num_objects(), 0 );
+  EXPECT_EQ( gc.bytes_allocated(), 0 );
+}
+
+TEST(misc, test_pause_histogram_00)
+{
+  PauseHistogram histogram;
+  for( int i = 0; i < 99; i++ )
+  {
+    histogram.record( std::chrono::microseconds( 3 ) );
+  }
+  histogram.record( std::chrono::microseconds( 100 ) );
+
+  EXPECT_EQ( histogram.count(), 100 );
+  EXPECT_EQ( histogram.bucket( 2 ), 99 );
+  EXPECT_EQ( histogram.percentile( 50 ).count(), 4 );
+  EXPECT_EQ( histogram.percentile( 99.5 ).count(), 128 );
+  EXPECT_EQ( histogram.max(), std::chrono::microseconds( 100 ) );
+}
+
+TEST(misc, test_slab_00)
+{
+  SlabAllocator slab;
+  void * a = slab.alloc( 24 );
+  void * b = slab.alloc( 24 );
+  void * c = slab.alloc( 100 );
+  EXPECT_EQ( SlabAllocator::page_of( a ), SlabAllocator::page_of( b ) );
+  EXPECT_NE( SlabAllocator::page_of( a ), SlabAllocator::page_of( c ) );
+  EXPECT_EQ( SlabAllocator::page_of( a )->slot_size, 32 );
+  EXPECT_EQ( SlabAllocator::page_of( a )->num_used, 2 );
+
+  // freed slots are reused first
+  slab.free( a );
+  EXPECT_EQ( slab.alloc( 32 ), a );
+
+  // large objects get a page of their own
+  void * large = slab.alloc( 3 * SlabAllocator::PAGE_SIZE );
+  EXPECT_EQ( slab.num_pages(), 3 );
+  memset( large, 0, 3 * SlabAllocator::PAGE_SIZE );
+  slab.free( large );
+  EXPECT_EQ( slab.page( 2 ), nullptr );
+  slab.compact();
+  EXPECT_EQ( slab.num_pages(), 2 );
+}
+
+TEST(misc, test_object_00)
+{
+  // both representations of Object round trip every kind of value
+  EXPECT_TRUE( Object().is_nil() );
+  EXPECT_EQ( Object::Nil().type(), Object::NIL );
+  EXPECT_TRUE( Object::Boolean( true ).as_boolean() );
+  EXPECT_FALSE( Object::Boolean( false ).as_boolean() );
+  EXPECT_EQ( Object::Integer( -42 ).as_integer(), -42 );
+  EXPECT_EQ( Object::Integer( 2147483647 ).as_integer(), 2147483647 );
+  EXPECT_TRUE( Object::Integer( 0 ).is_integer() );
+  EXPECT_DOUBLE_EQ( Object::Real( -1.5 ).as_real(), -1.5 );
+  EXPECT_TRUE( Object::Real( std::numeric_limits<double>::infinity() ).is_real() );
+  EXPECT_TRUE( Object::Real( std::nan( "" ) ).is_real() );
+  EXPECT_TRUE( Object::Real( -std::nan( "" ) ).is_real() );
+
+  GarbageCollector gc;
+  StringObject * str = gc.alloc<StringObject>( "str" );
+  EXPECT_TRUE( Object::String( str ).is_string() );
+  EXPECT_EQ( Object::String( str ).as_string(), str );
+  EXPECT_EQ( Object::String( str ).type(), Object::STRING );
+
+  ClassObject * cls = gc.alloc<ClassObject>( "Point" );
+  EXPECT_TRUE( Object::Class( cls ).is_class() );
+  EXPECT_FALSE( Object::Class( cls ).is_instance() );
+  EXPECT_EQ( Object::Class( cls ).as_class(), cls );
+
+  InstanceObject * instance = gc.alloc<InstanceObject>( cls );
+  EXPECT_EQ( Object::Instance( instance ).type(), Object::INSTANCE );
+  EXPECT_EQ( Object::Instance( instance ).as_instance(), instance );
+
+#if BRASS_NAN_BOXING
+  EXPECT_EQ( sizeof( Object ), 8 );
+#endif
+}
+
+TEST(misc, test_lexer_00)
+{
+  // tokens are ranges of the source, a string token excludes the quotes
+  AtomTable atoms;
+  std::string src  = "var x = 1.5;\nprint \"a\nb\" == x;\n--x";
+  TokenList tokens = lex( src, atoms );
+  ASSERT_EQ( tokens.size(), 12 );
+
+  EXPECT_EQ( tokens.type( 0 ), KW_VAR );
+  EXPECT_EQ( tokens.lexeme( 1 ), "x" );
+  EXPECT_EQ( tokens.lexeme( 3 ), "1.5" );
+  EXPECT_EQ( tokens[3].offset, 8 );
+  EXPECT_EQ( tokens[3].length, 3 );
+  EXPECT_EQ( tokens.lexeme( 3 ).data(), src.data() + 8 );
+
+  EXPECT_EQ( tokens.type( 6 ), STRING );
+  EXPECT_EQ( tokens.lexeme( 6 ), "a\nb" );
+  EXPECT_EQ( tokens[6].line, 2 );
+  EXPECT_EQ( tokens.type( 7 ), EQUAL_EQUAL );
+  EXPECT_EQ( tokens[7].line, 3 );
+  EXPECT_EQ( tokens.type( 10 ), MINUS_MINUS );
+  EXPECT_EQ( tokens.lexeme( 10 ), "--" );
+
+  EXPECT_EQ( tokens.type( 12 ), END_OF_INPUT );
+  EXPECT_EQ( tokens.lexeme( 12 ), "" );
+}
+
+TEST(misc, test_lexer_01)
+{
+  // tokens are scanned when they are looked at, the last consumed one is kept
+  AtomTable atoms;
+  std::string src = "x = y + 1; @";
+  Lexer lexer( src, atoms );
+  EXPECT_EQ( lexer.peek( 2 ).type, IDENTIFIER );
+  EXPECT_EQ( lexer.lexeme( lexer.peek( 2 ) ), "y" );
+
+  EXPECT_EQ( lexer.next().type, IDENTIFIER );
+  EXPECT_EQ( lexer.next().type, EQUAL );
+  EXPECT_EQ( lexer.previous().type, EQUAL );
+  EXPECT_EQ( lexer.peek().type, IDENTIFIER );
+  EXPECT_EQ( lexer.peek( 1 ).type, PLUS );
+
+  for( int i = 0; i < 4; i++ )
+  {
+    lexer.next();
+  }
+  EXPECT_EQ( lexer.previous().type, SEMICOLON );
+  EXPECT_EQ( lexer.previous().offset, 9 );
+
+  // an unknown character ends the input
+  testing::internal::CaptureStderr();
+  EXPECT_TRUE( lexer.is_finished() );
+  EXPECT_EQ( lexer.next().type, END_OF_INPUT );
+  EXPECT_EQ( lexer.peek().type, END_OF_INPUT );
+  testing::internal::GetCapturedStderr();
+}
+
+TEST(misc, test_lexer_02)
+{
+  // runs longer than a 16 byte chunk, keywords and prefixes of keywords
+  std::string src = "printlnx println                  \n\n\n   x_12345678901234567890 "
+                    "\"a\\\"b\\n\\\\\" 12345678901234567.5 fo for";
+  AtomTable atoms;
+  TokenList tokens = lex( src, atoms );
+  ASSERT_EQ( tokens.size(), 7 );
+
+  EXPECT_EQ( tokens.type( 0 ), IDENTIFIER );
+  EXPECT_EQ( tokens.type( 1 ), KW_PRINTLN );
+  EXPECT_EQ( tokens.lexeme( 2 ), "x_12345678901234567890" );
+  EXPECT_EQ( tokens[2].line, 4 );
+  EXPECT_EQ( tokens.type( 3 ), STRING );
+  EXPECT_EQ( tokens.lexeme( 3 ), "a\\\"b\\n\\\\" );
+  EXPECT_EQ( unescape( tokens.lexeme( 3 ) ), "a\"b\n\\" );
+  EXPECT_EQ( tokens.lexeme( 4 ), "12345678901234567.5" );
+  EXPECT_EQ( tokens.type( 5 ), IDENTIFIER );
+  EXPECT_EQ( tokens.type( 6 ), KW_FOR );
+
+  EXPECT_EQ( unescape( "\\t\\x\\" ), "\t\\x\\" );
+}
+
+// Counts the allocations that would leak from a tree, whose destructors are not run
+class CountingResource : public std::pmr::memory_resource
+{
+public:
+  size_t allocations = 0;
+
+private:
+  void * do_allocate( size_t bytes, size_t alignment ) override
+  {
+    allocations++;
+    return std::pmr::new_delete_resource()->allocate( bytes, alignment );
+  }
+
+  void do_deallocate( void * ptr, size_t bytes, size_t alignment ) override
+  {
+    std::pmr::new_delete_resource()->deallocate( ptr, bytes, alignment );
+  }
+
+  bool do_is_equal( const std::pmr::memory_resource & other ) const noexcept override
+  {
+    return this == &other;
+  }
+};
+
+TEST(misc, test_node_allocator_00)
+{
+  // names longer than the small string buffer, lists and nested list types
+  std::string src = "class a_rather_long_class_name { a_long_field_name: [[int]]; }\n";
+  for( int i = 0; i < 2000; i++ )
+  {
+    src += "fn a_long_function_name_" + std::to_string( i ) +
+           "(first_long_argument: int, second_long_argument: [int]) : [int] {\n"
+           "  var a_long_local_variable: [int] = [first_long_argument, 2, 3];\n"
+           "  a_long_local_variable.append(first_long_argument + 1);\n"
+           "  return a_long_local_variable;\n"
+           "}\n";
+  }
+
+  CountingResource counting;
+  std::pmr::memory_resource * previous = std::pmr::set_default_resource( &counting );
+  {
+    GarbageCollector gc;
+    NodeAllocator allocator;
+    AtomTable atoms;
+    auto ast = parse( src, atoms, allocator, gc );
+    ASSERT_TRUE( ast.ok() );
+    EXPECT_LT( 1, allocator.num_blocks() );
+    EXPECT_LT( src.size(), allocator.used() );
+  }
+  std::pmr::set_default_resource( previous );
+  EXPECT_EQ( counting.allocations, 0 );
+}
+
+TEST(misc, test_atom_00)
+{
+  AtomTable table;
+  EXPECT_EQ( table.intern( "" ), 0 );
+  Atom a = table.intern( "a_name" );
+  Atom b = table.intern( std::string( "another_name_that_is_long" ) );
+  EXPECT_NE( a, b );
+  EXPECT_EQ( table.intern( std::string_view( "a_name_" ).substr( 0, 6 ) ), a );
+  EXPECT_EQ( table.name( b ), "another_name_that_is_long" );
+
+  // the names stay in place while the table grows
+  const char * chars = table.name( a ).c_str();
+  for( int i = 0; i < 1000; i++ )
+  {
+    table.intern( "name_" + std::to_string( i ) );
+  }
+  EXPECT_EQ( table.name( a ).c_str(), chars );
+  EXPECT_EQ( table.size(), 1003 );
+
+  // identifiers carry their atom, other tokens atom 0
+  TokenList tokens = lex( "x = x + print_count;", table );
+  EXPECT_EQ( tokens[0].atom, table.intern( "x" ) );
+  EXPECT_EQ( tokens[2].atom, tokens[0].atom );
+  EXPECT_EQ( tokens[1].atom, 0 );
+  EXPECT_EQ( table.name( tokens[4].atom ), "print_count" );
+
+  // atoms are numbered per table, a new compilation starts over
+  AtomTable fresh;
+  EXPECT_EQ( fresh.intern( "name_999" ), 1 );
+  EXPECT_EQ( fresh.size(), 2 );
+}
+
+TEST(misc, test_scope_table_00)
+{
+  AtomTable atoms;
+  ScopeTable<int> scopes;
+  Atom x = atoms.intern( "x" );
+  Atom y = atoms.intern( "y" );
+  EXPECT_EQ( scopes.find( x ), nullptr );
+
+  scopes.define( x, 1 );
+  EXPECT_EQ( scopes.depth(), 1 );
+  EXPECT_TRUE( scopes.is_global( scopes.find( x ) ) );
+
+  // an inner definition shadows the global one until its scope is left
+  scopes.push_scope();
+  scopes.define( x, 2 );
+  scopes.define( y, 3 );
+  scopes.define( y, 4 );
+  EXPECT_EQ( scopes.scope_size(), 2 );
+  EXPECT_EQ( scopes.find( x )->value, 2 );
+  EXPECT_FALSE( scopes.is_global( scopes.find( x ) ) );
+  EXPECT_EQ( scopes.find_global( x )->value, 1 );
+  EXPECT_EQ( scopes.find_global( y ), nullptr );
+  EXPECT_EQ( scopes.find( y )->value, 4 );
+
+  scopes.push_scope();
+  EXPECT_EQ( scopes.scope_size(), 0 );
+  EXPECT_EQ( scopes.find( y )->value, 4 );
+  scopes.pop_scope();
+
+  scopes.pop_scope();
+  EXPECT_EQ( scopes.depth(), 1 );
+  EXPECT_EQ( scopes.find( x )->value, 1 );
+  EXPECT_EQ( scopes.find( y ), nullptr );
+}
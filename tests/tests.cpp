@@ -3,10 +3,23 @@
 #include "allocator.h"
 #include "ast.h"
 #include "brass.h"
+#include "cache.h"
+#include "compiler.h"
 #include "gc.h"
+#include "lexer.h"
 #include "object.h"
+#include "optimizer.h"
+#include "parser.h"
+#include "superinstructions.h"
+#include "utils.h"
 #include "vm.h"
 
+#include <atomic>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+
 class Unittest : public ::testing::Test
 {
 public:
@@ -392,6 +405,127 @@ print sum(5);
   EXPECT_EQ( err.str(), "" );
 }
 
+TEST_F( Unittest, test_rec_02 )
+{
+  const char * src = R"(
+fn sum(n: int) : int {
+  if (n) {
+    return n + sum(n - 1);
+  } else {
+    return 0;
+  }
+}
+
+print sum(98);
+print sum(99);
+  )";
+
+  for( Engine engine : { Engine::STACK, Engine::REGISTER } )
+  {
+    std::ostringstream out, err;
+    VMOptions options;
+    options.engine         = engine;
+    options.max_call_depth = 100;
+    int r                  = eval( src, out, err, options );
+
+    EXPECT_EQ( r, 1 );
+    EXPECT_EQ( out.str(), "4851" );
+    EXPECT_EQ( err.str(), "RUNTIME ERROR: Stack overflow\n" );
+  }
+}
+
+TEST_F( Unittest, test_rec_03 )
+{
+  // the results of calls used as statements are popped, the stack does not grow
+  const char * src = R"(
+fn inc(n: int) : int {
+  return n + 1;
+}
+
+var i = 1000;
+var k = 0;
+while (i) {
+  inc(i);
+  k = inc(k);
+  i = i - 1;
+}
+print k;
+  )";
+
+  for( Engine engine : { Engine::STACK, Engine::REGISTER } )
+  {
+    std::ostringstream out, err;
+    VMOptions options;
+    options.engine     = engine;
+    options.stack_size = 16;
+    int r              = eval( src, out, err, options );
+
+    EXPECT_EQ( r, 0 );
+    EXPECT_EQ( out.str(), "1000" );
+    EXPECT_EQ( err.str(), "" );
+  }
+}
+
+TEST_F( Unittest, test_rec_04 )
+{
+  // shallow frames that together do not fit the operand stack or the register file
+  const char * src = R"(
+fn sum(n: int) : int {
+  if (n) {
+    return n + sum(n - 1);
+  } else {
+    return 0;
+  }
+}
+
+print sum(5);
+print sum(1000);
+  )";
+
+  for( Engine engine : { Engine::STACK, Engine::REGISTER } )
+  {
+    std::ostringstream out, err;
+    VMOptions options;
+    options.engine     = engine;
+    options.stack_size = 256;
+    int r              = eval( src, out, err, options );
+
+    EXPECT_EQ( r, 1 );
+    EXPECT_EQ( out.str(), "15" );
+    EXPECT_EQ( err.str(), "RUNTIME ERROR: Stack overflow\n" );
+  }
+}
+
+TEST_F( Unittest, test_register_limits_00 )
+{
+  // registers are 15 bit operands, the function is rejected before anything runs
+  std::string src = "print 1;\nfn big(a: int) : int {\n";
+  for( int i = 0; i < 33000; i++ )
+  {
+    src += "  var v" + std::to_string( i ) + " = a;\n";
+  }
+  src += "  return v32999;\n}\nprint big(2);\n";
+
+  for( Engine engine : { Engine::STACK, Engine::REGISTER } )
+  {
+    std::ostringstream out, err;
+    int r = eval( src.c_str(), out, err, { engine } );
+
+    if( engine == Engine::STACK )
+    {
+      EXPECT_EQ( r, 0 );
+      EXPECT_EQ( out.str(), "12" );
+      EXPECT_EQ( err.str(), "" );
+    }
+    else
+    {
+      EXPECT_EQ( r, 1 );
+      EXPECT_EQ( out.str(), "" );
+      EXPECT_EQ( err.str(), "COMPILE ERROR: Too many registers in a function for the register engine\n" );
+    }
+  }
+}
+
 TEST_F( Unittest, DISABLED_test_typeof_01 )
 {
   const char * src = R"(
@@ -419,6 +553,18 @@ println typeof(x);
   EXPECT_EQ( err.str(), "" );
 }
 
+TEST_F( Unittest, test_string_02 )
+{
+  const char * src = R"(
+print "say \"hi\"\n\tand leave";
+  )";
+
+  ( void ) eval( src, out, err );
+
+  EXPECT_EQ( out.str(), "say \"hi\"\n\tand leave" );
+  EXPECT_EQ( err.str(), "" );
+}
+
 TEST_F( Unittest, test_types_01 )
 {
   const char * src = R"(
@@ -517,3 +663,930 @@ var x: string = add(2, 3);
   EXPECT_EQ( out.str(), "" );
   EXPECT_EQ( err.str(), "TYPE ERROR: Declared type does not match infered type\n" );
 }
+
+TEST_F( Unittest, test_while_02 )
+{
+  const char * src = R"(
+var i = 3;
+while (i) {
+  if (i - 2) {
+    print i;
+  } else {
+    print 0;
+  }
+  i = i - 1;
+}
+  )";
+
+  ( void ) eval( src, out, err );
+
+  EXPECT_EQ( out.str(), "301" );
+  EXPECT_EQ( err.str(), "" );
+}
+
+TEST_F( Unittest, test_register_00 )
+{
+  const char * src = R"(
+var a = 2;
+print a + a * 4 - 1;
+  )";
+
+  int r = eval( src, out, err, { Engine::REGISTER } );
+
+  EXPECT_EQ( r, 0 );
+  EXPECT_EQ( out.str(), "9" );
+  EXPECT_EQ( err.str(), "" );
+}
+
+TEST_F( Unittest, test_register_01 )
+{
+  const char * src = R"(
+fn foo(a: int, b: int) : int {
+  var c = a + b;
+  c = c * c;
+  return c - a;
+}
+
+print foo(2, 3);
+  )";
+
+  int r = eval( src, out, err, { Engine::REGISTER } );
+
+  EXPECT_EQ( r, 0 );
+  EXPECT_EQ( out.str(), "23" );
+  EXPECT_EQ( err.str(), "" );
+}
+
+TEST_F( Unittest, test_register_02 )
+{
+  const char * src = R"(
+fn sum(n: int) : int {
+  if (n) {
+    return n + sum(n - 1);
+  } else {
+    return 0;
+  }
+}
+
+print sum(100);
+  )";
+
+  int r = eval( src, out, err, { Engine::REGISTER } );
+
+  EXPECT_EQ( r, 0 );
+  EXPECT_EQ( out.str(), "5050" );
+  EXPECT_EQ( err.str(), "" );
+}
+
+TEST_F( Unittest, test_register_03 )
+{
+  const char * src = R"(
+fn foo(n: int) : int {
+  var i = n;
+  var j = 0;
+  while (i) {
+    var k = i;
+    i = i - 1;
+    j = j + k;
+  }
+  return j;
+}
+
+println foo(4);
+{
+  var x = 1;
+  var y = x;
+  x = 5;
+  print y;
+  print x;
+}
+  )";
+
+  int r = eval( src, out, err, { Engine::REGISTER } );
+
+  EXPECT_EQ( r, 0 );
+  EXPECT_EQ( out.str(), "10\n15" );
+  EXPECT_EQ( err.str(), "" );
+}
+
+TEST_F( Unittest, test_register_04 )
+{
+  const char * src = R"(
+class Square {
+  w: int;
+  h: int;
+}
+
+var sq = Square();
+
+sq.w = 2;
+sq.h = 3;
+
+fn area(s: Square) : int {
+  return s.w * s.h;
+}
+
+print area(sq);
+  )";
+
+  int r = eval( src, out, err, { Engine::REGISTER } );
+
+  EXPECT_EQ( r, 0 );
+  EXPECT_EQ( out.str(), "6" );
+  EXPECT_EQ( err.str(), "" );
+}
+
+TEST_F( Unittest, test_superinstructions_00 )
+{
+  const char * src = R"(
+var limit = 3;
+
+fn loop_sum(n: int) : int {
+  var i = n;
+  var s = 0;
+  while (i) {
+    s = s + i;
+    i = i - 1;
+  }
+  return s + n;
+}
+
+print loop_sum(limit);
+print loop_sum(10 - limit);
+  )";
+
+  for( bool superinstructions : { true, false } )
+  {
+    std::ostringstream out, err;
+    int r = eval( src, out, err, { Engine::STACK, superinstructions } );
+
+    EXPECT_EQ( r, 0 );
+    EXPECT_EQ( out.str(), "935" );
+    EXPECT_EQ( err.str(), "" );
+  }
+}
+
+// The fused sequences of the table have to be the ones the optimized code executes
+TEST_F( Unittest, test_superinstructions_01 )
+{
+  const char * src = R"(
+fn loop_sum(n: int, step: int) : int {
+  var i = n;
+  var s = 0;
+  while (i) {
+    s = s + step;
+    i = i - 1;
+  }
+  return s;
+}
+
+print loop_sum(100, 1);
+  )";
+
+  SequenceProfile profile;
+  VMOptions options;
+  options.profile = &profile;
+  int r           = eval( src, out, err, options );
+
+  EXPECT_EQ( r, 0 );
+  EXPECT_EQ( out.str(), "100" );
+  EXPECT_EQ( err.str(), "" );
+  EXPECT_EQ( profile.count( { OP_LOAD_LOCAL, OP_LOAD_LOCAL, OP_ADD_INT, OP_STORE_LOCAL } ), 100 );
+  EXPECT_EQ( profile.count( { OP_LOAD_CONST, OP_LOAD_LOCAL, OP_SUB_INT, OP_STORE_LOCAL } ), 100 );
+  EXPECT_EQ( profile.count( { OP_LOAD_LOCAL, OP_JMP_IF_FALSE } ), 101 );
+
+  // the loop jumps back to the condition, which does not follow its last instruction
+  EXPECT_EQ( profile.count( { OP_LOOP, OP_LOAD_LOCAL } ), 0 );
+}
+
+TEST_F( Unittest, test_globals_00 )
+{
+  // compile and run line by line like the REPL does
+  const char * lines[] = {
+      "var x = 5;",
+      "fn add(a: int) : int { return a + x; }",
+      "print add(2);",
+      "x = 10;",
+      "print add(2);",
+  };
+
+  GarbageCollector gc;
+  NodeAllocator allocator;
+  AtomTable atoms;
+  TypeContext ctx( atoms );
+  VirtualMachine vm( out, err, gc );
+  CodeObject code;
+  Compiler compiler( gc, &code, atoms );
+
+  for( const char * line : lines )
+  {
+    auto ast = parse( line, atoms, allocator, gc );
+    ASSERT_TRUE( ast.ok() );
+    ast.node->check_types( ctx );
+    ASSERT_TRUE( ctx.ok() );
+    ast.node->compile( compiler );
+    EXPECT_EQ( vm.run( &code ), 0 );
+    code.instructions.clear();
+  }
+
+  EXPECT_EQ( out.str(), "712" );
+  EXPECT_EQ( err.str(), "" );
+}
+
+TEST_F( Unittest, test_optimize_00 )
+{
+  const char * src = R"(
+fn f(n: int) : int {
+  var scale = 2 * 3 + 4;
+  var i = n;
+  if (0) {
+    print 1000;
+  } else {
+    i = i * scale;
+  }
+  while (scale - 10) {
+    print 2000;
+  }
+  return i + scale / 5;
+}
+
+print f(4);
+  )";
+
+  GarbageCollector gc;
+  NodeAllocator allocator;
+  AtomTable atoms;
+  TypeContext ctx( atoms );
+  auto ast = parse( src, atoms, allocator, gc );
+  ASSERT_TRUE( ast.ok() );
+  ast.node->check_types( ctx );
+  ASSERT_TRUE( ctx.ok() );
+
+  Optimizer optimizer( allocator );
+  optimize( ast.node, optimizer );
+
+  CodeObject code;
+  compile( ast.node, gc, &code, atoms );
+
+  // the constant local, the dead branches and the constant arithmetic are gone
+  FunctionObject * fn = nullptr;
+  for( const Object & literal : code.literals )
+  {
+    fn = literal.is_function() ? literal.as_function() : fn;
+  }
+  ASSERT_NE( fn, nullptr );
+  fn->code_object.decode();
+  for( const Instr & instr : fn->code_object.decoded )
+  {
+    EXPECT_NE( instr.op, OP_JMP_IF_FALSE );
+    EXPECT_NE( instr.op, OP_PRINT );
+    EXPECT_NE( instr.op, OP_DIV_INT );
+  }
+
+  for( bool optimize : { true, false } )
+  {
+    std::ostringstream out, err;
+    VMOptions options;
+    options.optimize = optimize;
+    int r            = eval( src, out, err, options );
+
+    EXPECT_EQ( r, 0 );
+    EXPECT_EQ( out.str(), "42" );
+    EXPECT_EQ( err.str(), "" );
+  }
+}
+
+TEST_F( Unittest, test_types_08 )
+{
+  const char * src = R"(
+fn area(w: float, h: float) : float {
+  return w * h - 0.5;
+}
+
+fn greet(name: string) : string {
+  return "hello " + name;
+}
+
+fn repeat(s: string, n: int) : string {
+  var r = s;
+  while (n - 1) {
+    r = r + s;
+    n = n - 1;
+  }
+  return r;
+}
+
+println area(1.5, 4.0);
+println 7.0 / 2.0;
+println greet("brass");
+print repeat("ab", 3);
+  )";
+
+  for( Engine engine : { Engine::STACK, Engine::REGISTER } )
+  {
+    for( bool optimize : { true, false } )
+    {
+      std::ostringstream out, err;
+      VMOptions options;
+      options.engine   = engine;
+      options.optimize = optimize;
+      int r            = eval( src, out, err, options );
+
+      EXPECT_EQ( r, 0 );
+      EXPECT_EQ( out.str(), "5.5\n3.5\nhello brass\nababab" );
+      EXPECT_EQ( err.str(), "" );
+    }
+  }
+}
+
+TEST_F( Unittest, test_types_09 )
+{
+  const char * src = R"(
+var a = "a" - "b";
+  )";
+
+  int r = eval( src, out, err );
+
+  EXPECT_EQ( r, 1 );
+  EXPECT_EQ( out.str(), "" );
+  EXPECT_EQ( err.str(), "TYPE ERROR: Operator '-' is not defined for type 'string'\n" );
+}
+
+TEST_F( Unittest, test_class_05 )
+{
+  const char * src = R"(
+class Point {
+  x: int;
+  y: int;
+  z: int;
+}
+
+fn sum(p: Point) : int {
+  return p.x + p.y * 10 + p.z * 100;
+}
+
+var p = Point();
+p.z = 3;
+p.x = 1;
+p.y = 2;
+print sum(p);
+  )";
+
+  for( Engine engine : { Engine::STACK, Engine::REGISTER } )
+  {
+    std::ostringstream out, err;
+    int r = eval( src, out, err, { engine } );
+
+    EXPECT_EQ( r, 0 );
+    EXPECT_EQ( out.str(), "321" );
+    EXPECT_EQ( err.str(), "" );
+  }
+}
+
+// compile and run with a collector that is set up by the test
+static int eval_with_gc( const char * src, std::ostream & out, std::ostream & err, GarbageCollector & gc, Engine engine )
+{
+  NodeAllocator allocator;
+  AtomTable atoms;
+  TypeContext ctx( atoms );
+  VirtualMachine vm( out, err, gc, { engine } );
+  CodeObject code;
+  Compiler compiler( gc, &code, atoms );
+
+  auto ast = parse( src, atoms, allocator, gc );
+  if( !ast.ok() )
+  {
+    return 1;
+  }
+  ast.node->check_types( ctx );
+  if( !ctx.ok() )
+  {
+    return 1;
+  }
+  ast.node->compile( compiler );
+  return vm.run( &code );
+}
+
+TEST_F( Unittest, test_gc_00 )
+{
+  // a tiny threshold and nursery make the loop collect many times
+  const char * src = R"(
+class Point {
+  x: int;
+  y: int;
+}
+
+var p = Point();
+var i = 1000;
+while (i) {
+  p = Point();
+  p.x = i;
+  i = i - 1;
+}
+print p.x;
+  )";
+
+  for( Engine engine : { Engine::STACK, Engine::REGISTER } )
+  {
+    std::ostringstream out, err;
+    GarbageCollector gc( { 1024, 1024 } );
+
+    EXPECT_EQ( eval_with_gc( src, out, err, gc, engine ), 0 );
+    EXPECT_EQ( out.str(), "1" );
+    EXPECT_EQ( err.str(), "" );
+    EXPECT_LT( gc.num_objects(), 100 );
+  }
+}
+
+TEST_F( Unittest, test_gc_01 )
+{
+  // once b is promoted, the only reference to the young Point is in an old object
+  const char * src = R"(
+class Point {
+  x: int;
+}
+
+class Box {
+  p: Point;
+}
+
+var b = Box();
+var c = Point();
+var p = Point();
+var q = Point();
+var sum = 0;
+var i = 100;
+while (i) {
+  p = Point();
+  p.x = i;
+  b.p = p;
+  p = c;
+  q = Point();
+  q = Point();
+  q = b.p;
+  sum = sum + q.x;
+  i = i - 1;
+}
+print sum;
+  )";
+
+  for( Engine engine : { Engine::STACK, Engine::REGISTER } )
+  {
+    std::ostringstream out, err;
+    GarbageCollector gc( { 1024, 256 } );
+
+    EXPECT_EQ( eval_with_gc( src, out, err, gc, engine ), 0 );
+    EXPECT_EQ( out.str(), "5050" );
+    EXPECT_EQ( err.str(), "" );
+  }
+}
+
+TEST_F( Unittest, test_gc_02 )
+{
+  // incremental collection with a tiny budget, the list is built while marking
+  const char * src = R"(
+class Node {
+  v: int;
+  next: Node;
+}
+
+var head = Node();
+var n = Node();
+var i = 500;
+while (i) {
+  n = Node();
+  n.v = i;
+  n.next = head;
+  head = n;
+  n = Node();
+  i = i - 1;
+}
+
+var sum = 0;
+i = 500;
+while (i) {
+  sum = sum + head.v;
+  head = head.next;
+  i = i - 1;
+}
+print sum;
+  )";
+
+  for( Engine engine : { Engine::STACK, Engine::REGISTER } )
+  {
+    std::ostringstream out, err;
+    GCOptions options;
+    options.threshold   = 1024;
+    options.nursery     = 1024;
+    options.incremental = true;
+    options.work_budget = 4;
+    GarbageCollector gc( options );
+
+    EXPECT_EQ( eval_with_gc( src, out, err, gc, engine ), 0 );
+    EXPECT_EQ( out.str(), "125250" );
+    EXPECT_EQ( err.str(), "" );
+    EXPECT_GT( gc.major_pauses().count(), 10 );
+    EXPECT_GT( gc.minor_pauses().count(), 10 );
+  }
+}
+
+TEST_F( Unittest, test_gc_03 )
+{
+  // strings built in a loop become ropes that refer to young and old parts
+  const char * src = R"(
+fn repeat(s: string, n: int) : string {
+  var r = s;
+  var i = n - 1;
+  while (i) {
+    r = r + s;
+    i = i - 1;
+  }
+  return r;
+}
+
+var line = repeat("-", 50);
+print repeat(line + "|", 200);
+  )";
+
+  for( Engine engine : { Engine::STACK, Engine::REGISTER } )
+  {
+    for( bool incremental : { false, true } )
+    {
+      std::ostringstream out, err;
+      GCOptions options;
+      options.threshold   = 4096;
+      options.nursery     = 1024;
+      options.incremental = incremental;
+      options.work_budget = 4;
+      GarbageCollector gc( options );
+
+      EXPECT_EQ( eval_with_gc( src, out, err, gc, engine ), 0 );
+      std::string line = std::string( 50, '-' ) + "|";
+      std::string expected;
+      for( int i = 0; i < 200; i++ )
+      {
+        expected += line;
+      }
+      EXPECT_EQ( out.str(), expected );
+      EXPECT_EQ( err.str(), "" );
+      EXPECT_GT( gc.minor_pauses().count(), 0 );
+    }
+  }
+}
+
+TEST_F( Unittest, test_gc_options_00 )
+{
+  // numbers that do not parse are a usage error, before any file is read
+  for( const char * arg : { "--gc-work-budget=abc", "--gc-work-budget=-1", "--gc-time-budget-us=" } )
+  {
+    char program[]     = "brass";
+    std::string option = arg;
+    char * argv[]      = { program, option.data(), nullptr };
+    EXPECT_EQ( brass( 2, argv ), 1 );
+  }
+}
+
+TEST_F( Unittest, test_list_00 )
+{
+  const char * src = R"(
+fn sum(l: [int]) : int {
+  var s = 0;
+  var i = 4;
+  while (i) {
+    i = i - 1;
+    s = s + l[i];
+  }
+  return s;
+}
+
+var xs = [1, 2, 3];
+xs.append(4);
+xs[0] = 10;
+println xs;
+println sum(xs);
+
+var names: [string] = [];
+names.append("a" + "b");
+var grid = [[1], [2, 3]];
+grid[1].append(4);
+println names;
+println grid;
+print xs[4];
+  )";
+
+  for( Engine engine : { Engine::STACK, Engine::REGISTER } )
+  {
+    std::ostringstream out, err;
+    EXPECT_EQ( eval( src, out, err, { engine } ), 1 );
+    EXPECT_EQ( out.str(), "[10, 2, 3, 4]\n19\n[ab]\n[[1], [2, 3, 4]]\n" );
+    EXPECT_EQ( err.str(), "RUNTIME ERROR: List index out of range\n" );
+  }
+}
+
+TEST_F( Unittest, test_list_01 )
+{
+  const std::vector<std::pair<const char *, const char *>> cases = {
+      { "var a = [1, \"x\"];", "TYPE ERROR: Type mismatch in list literal\n" },
+      { "var a = [];", "TYPE ERROR: Can not infer the type of an empty list\n" },
+      { "var a = 1; print a[0];", "TYPE ERROR: Can not index a value of type 'int'\n" },
+      { "var a = [1]; a.append(\"x\");", "TYPE ERROR: Type mismatch in append\n" },
+      { "var a = [1]; a[0] = 1.5;", "TYPE ERROR: Type mismatch in list element assignment\n" },
+  };
+
+  for( const auto & [src, error] : cases )
+  {
+    std::ostringstream out, err;
+    EXPECT_EQ( eval( src, out, err ), 1 );
+    EXPECT_EQ( err.str(), error );
+  }
+}
+
+TEST_F( Unittest, test_gc_04 )
+{
+  // old lists refer to young elements, they grow while a collection is marking
+  const char * src = R"(
+class Node {
+  v: int;
+}
+
+var nodes: [Node] = [];
+var words = ["a"];
+var i = 300;
+while (i) {
+  var n = Node();
+  n.v = i;
+  nodes.append(n);
+  words.append(words[0] + "b");
+  words[0] = "a";
+  i = i - 1;
+}
+
+var sum = 0;
+i = 300;
+while (i) {
+  i = i - 1;
+  sum = sum + nodes[i].v;
+}
+println sum;
+print words[300];
+  )";
+
+  for( Engine engine : { Engine::STACK, Engine::REGISTER } )
+  {
+    for( bool incremental : { false, true } )
+    {
+      std::ostringstream out, err;
+      GCOptions options;
+      options.threshold   = 1024;
+      options.nursery     = 1024;
+      options.incremental = incremental;
+      options.work_budget = 4;
+      GarbageCollector gc( options );
+
+      EXPECT_EQ( eval_with_gc( src, out, err, gc, engine ), 0 );
+      EXPECT_EQ( out.str(), "45150\nab" );
+      EXPECT_EQ( err.str(), "" );
+      EXPECT_GT( gc.minor_pauses().count(), 10 );
+      EXPECT_GT( gc.major_pauses().count(), 0 );
+    }
+  }
+}
+
+TEST_F( Unittest, test_gc_05 )
+{
+  // promoted nodes and new lists land in pages created while a collection sweeps
+  const char * src = R"(
+class Node {
+  v: int;
+}
+
+var nodes: [Node] = [];
+var i = 3000;
+while (i) {
+  var n = Node();
+  n.v = i;
+  nodes.append(n);
+  var pair = [i, i + 1];
+  i = i - 1;
+}
+
+var sum = 0;
+i = 3000;
+while (i) {
+  i = i - 1;
+  sum = sum + nodes[i].v;
+}
+print sum;
+  )";
+
+  for( Engine engine : { Engine::STACK, Engine::REGISTER } )
+  {
+    for( size_t work_budget : { 1, 2, 3, 4 } )
+    {
+      std::ostringstream out, err;
+      GCOptions options;
+      options.threshold   = 1024;
+      options.nursery     = 1024;
+      options.incremental = true;
+      options.work_budget = work_budget;
+      GarbageCollector gc( options );
+
+      EXPECT_EQ( eval_with_gc( src, out, err, gc, engine ), 0 );
+      EXPECT_EQ( out.str(), "4501500" );
+      EXPECT_EQ( err.str(), "" );
+      EXPECT_GT( gc.major_pauses().count(), 0 );
+    }
+  }
+}
+
+TEST_F( Unittest, test_eval_threads_00 )
+{
+  // every compilation interns its identifiers in a table of its own
+  std::vector<std::thread> threads;
+  std::vector<std::string> outputs( 4 );
+  for( size_t t = 0; t < outputs.size(); t++ )
+  {
+    threads.emplace_back(
+        [t, &outputs]()
+        {
+          std::string src;
+          for( int i = 0; i < 200; i++ )
+          {
+            src += "var v" + std::to_string( t ) + "_" + std::to_string( i ) + " = " + std::to_string( i ) + ";\n";
+          }
+          src += "print v" + std::to_string( t ) + "_199;";
+
+          for( int run = 0; run < 20; run++ )
+          {
+            std::ostringstream out, err;
+            ( void ) eval( src.c_str(), out, err );
+            outputs[t] += out.str();
+          }
+        } );
+  }
+  for( std::thread & thread : threads )
+  {
+    thread.join();
+  }
+
+  for( const std::string & output : outputs )
+  {
+    std::string expected;
+    for( int run = 0; run < 20; run++ )
+    {
+      expected += "199";
+    }
+    EXPECT_EQ( output, expected );
+  }
+}
+
+TEST_F( Unittest, test_cache_00 )
+{
+  const std::string src = R"(
+class Point {
+  x: float;
+  y: float;
+}
+
+fn norm1(p: Point) : float {
+  return p.x + p.y;
+}
+
+var p = Point();
+p.x = 1.5;
+p.y = 2.0;
+var names = ["a", "b"];
+println names;
+print norm1(p);
+  )";
+  const std::string expected = "[a, b]\n3.5";
+
+  std::string path = ( std::filesystem::temp_directory_path() / "brass_test_cache_00.bsc" ).string();
+  std::remove( path.c_str() );
+
+  // the first run writes the cache, the second one reads it
+  for( int run = 0; run < 2; run++ )
+  {
+    std::ostringstream out, err;
+    EXPECT_EQ( eval_cached( src, path, out, err ), 0 );
+    EXPECT_EQ( out.str(), expected );
+    EXPECT_EQ( err.str(), "" );
+  }
+
+  GarbageCollector gc;
+  CodeObject code;
+  EXPECT_FALSE( read_cache( path, cache_key( src, false ), gc, &code ) );
+  ASSERT_TRUE( read_cache( path, cache_key( src, true ), gc, &code ) );
+
+  // code cached under the key of another source runs without looking at that source
+  std::string other = "print 1;";
+  ASSERT_TRUE( write_cache( path, cache_key( other, true ), code ) );
+  {
+    std::ostringstream out, err;
+    EXPECT_EQ( eval_cached( other, path, out, err, { Engine::REGISTER } ), 0 );
+    EXPECT_EQ( out.str(), expected );
+  }
+
+  // a damaged cache is replaced
+  std::filesystem::resize_file( path, std::filesystem::file_size( path ) - 1 );
+  CodeObject damaged;
+  EXPECT_FALSE( read_cache( path, cache_key( other, true ), gc, &damaged ) );
+  EXPECT_TRUE( damaged.instructions.empty() );
+  {
+    std::ostringstream out, err;
+    EXPECT_EQ( eval_cached( other, path, out, err ), 0 );
+    EXPECT_EQ( out.str(), "1" );
+  }
+  EXPECT_TRUE( read_cache( path, cache_key( other, true ), gc, &damaged ) );
+  std::remove( path.c_str() );
+}
+
+TEST_F( Unittest, test_cache_01 )
+{
+  // a file with a valid checksum is still checked before its code runs
+  const std::string src = "print 1;";
+  std::string path      = ( std::filesystem::temp_directory_path() / "brass_test_cache_01.bsc" ).string();
+  uint64_t key          = cache_key( src, true );
+  {
+    std::ostringstream out, err;
+    EXPECT_EQ( eval_cached( src, path, out, err ), 0 );
+  }
+
+  std::vector<char> original;
+  {
+    std::ifstream file( path, std::ios::binary );
+    original.assign( std::istreambuf_iterator<char>( file ), std::istreambuf_iterator<char>() );
+  }
+
+  // the body starts after the header (24 bytes) and the first instruction after the
+  // locals, the stack size and the instruction count
+  const size_t header_size = 24;
+  const size_t first_instr = header_size + 8;
+  ASSERT_EQ( ( uint8_t ) original[first_instr], OP_LOAD_CONST );
+
+  const std::vector<std::pair<size_t, uint8_t>> damages = {
+      { first_instr, OP_ADD_LL },           // a superinstruction is never encoded
+      { first_instr, 0xff },                // not an opcode
+      { first_instr + 2, 7 },               // a literal that does not exist
+      { first_instr + 3, OP_LOAD_LOCAL },   // a local of the root code
+  };
+  for( const auto & [offset, byte] : damages )
+  {
+    std::vector<char> bytes = original;
+    bytes[offset]           = ( char ) byte;
+    uint64_t checksum       = hash_bytes( bytes.data() + header_size, bytes.size() - header_size );
+    memcpy( bytes.data() + 16, &checksum, sizeof( checksum ) );
+    {
+      std::ofstream file( path, std::ios::binary | std::ios::trunc );
+      file.write( bytes.data(), ( std::streamsize ) bytes.size() );
+    }
+
+    GarbageCollector gc;
+    CodeObject code;
+    EXPECT_FALSE( read_cache( path, key, gc, &code ) );
+  }
+  std::remove( path.c_str() );
+}
+
+TEST_F( Unittest, test_cache_02 )
+{
+  // concurrent writers of a cache leave a whole file and no temporary ones
+  std::filesystem::path dir = std::filesystem::temp_directory_path() / "brass_test_cache_02";
+  std::filesystem::remove_all( dir );
+  std::filesystem::create_directories( dir );
+  std::string path = ( dir / "code.bsc" ).string();
+
+  const std::string src = "var s = \"x\"; print s + s;";
+  GarbageCollector gc;
+  CodeObject code;
+  {
+    std::ostringstream out, err;
+    ASSERT_EQ( eval_cached( src, path, out, err ), 0 );
+    ASSERT_TRUE( read_cache( path, cache_key( src, true ), gc, &code ) );
+  }
+
+  std::vector<std::thread> writers;
+  std::atomic<int> failures{ 0 };
+  for( int i = 0; i < 8; i++ )
+  {
+    writers.emplace_back(
+        [&]()
+        {
+          for( int k = 0; k < 50; k++ )
+          {
+            failures += write_cache( path, cache_key( src, true ), code ) ? 0 : 1;
+          }
+        } );
+  }
+  for( std::thread & writer : writers )
+  {
+    writer.join();
+  }
+
+  EXPECT_EQ( failures, 0 );
+  CodeObject read;
+  EXPECT_TRUE( read_cache( path, cache_key( src, true ), gc, &read ) );
+  EXPECT_EQ( read.instructions, code.instructions );
+  EXPECT_EQ( std::distance( std::filesystem::directory_iterator( dir ), std::filesystem::directory_iterator() ), 1 );
+  std::filesystem::remove_all( dir );
+}